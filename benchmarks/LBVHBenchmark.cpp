@@ -0,0 +1,144 @@
+// CPU only benchmark of LBVH: build, refit and query throughput over a field of unit cubes.
+// Doesn't need a window or a Vulkan device
+
+#include "LBVH.h"
+
+#include <chrono>
+#include <print>
+#include <random>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    double elapsedMs(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // same convention as the renderer: normalized planes, normals point inside, depth in [0, 1]
+    LBVH::Planes extractFrustumPlanes(const glm::mat4& projView)
+    {
+        const glm::vec4 row0 = glm::vec4(projView[0][0], projView[1][0], projView[2][0], projView[3][0]);
+        const glm::vec4 row1 = glm::vec4(projView[0][1], projView[1][1], projView[2][1], projView[3][1]);
+        const glm::vec4 row2 = glm::vec4(projView[0][2], projView[1][2], projView[2][2], projView[3][2]);
+        const glm::vec4 row3 = glm::vec4(projView[0][3], projView[1][3], projView[2][3], projView[3][3]);
+
+        LBVH::Planes planes = { row3 + row0, row3 - row0, row3 + row1, row3 - row1, row2, row3 - row2 };
+        for (glm::vec4& plane : planes)
+        {
+            plane /= glm::length(glm::vec3(plane));
+        }
+        return planes;
+    }
+
+    LAABB makeCube(const glm::vec3& center)
+    {
+        LAABB bounds;
+        bounds.min = center - glm::vec3(0.5f);
+        bounds.max = center + glm::vec3(0.5f);
+        return bounds;
+    }
+
+    void runBenchmark(uint32 instancesNum, std::mt19937& random)
+    {
+        // cubes are scattered over a square, the density doesn't depend on the number of instances
+        const float fieldSize = 2.0f * std::sqrt(static_cast<float>(instancesNum));
+        std::uniform_real_distribution<float> position(-fieldSize * 0.5f, fieldSize * 0.5f);
+        std::uniform_real_distribution<float> height(0.0f, 8.0f);
+        std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+
+        std::vector<glm::vec3> centers(instancesNum);
+        std::vector<LAABB> itemBounds(instancesNum);
+        for (uint32 i = 0; i < instancesNum; ++i)
+        {
+            centers[i] = glm::vec3(position(random), height(random), position(random));
+            itemBounds[i] = makeCube(centers[i]);
+        }
+
+        LBVH bvh;
+
+        auto start = Clock::now();
+        bvh.build(std::move(itemBounds));
+        const double buildMs = elapsedMs(start);
+
+        // the mostly static scene: 1% of the instances move every frame
+        const uint32 movedNum = std::max(instancesNum / 100, 1u);
+        std::uniform_int_distribution<uint32> item(0, instancesNum - 1);
+
+        start = Clock::now();
+        for (uint32 i = 0; i < movedNum; ++i)
+        {
+            const uint32 movedItem = item(random);
+            centers[movedItem] += glm::vec3(offset(random), 0.0f, offset(random));
+            bvh.updateItem(movedItem, makeCube(centers[movedItem]));
+        }
+        bvh.refit();
+        const double refitMs = elapsedMs(start);
+
+        constexpr uint32 queriesNum = 256;
+        const glm::mat4 projection = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 200.0f);
+
+        std::vector<LBVH::Planes> frustums(queriesNum);
+        std::vector<glm::vec3> origins(queriesNum);
+        std::vector<glm::vec3> directions(queriesNum);
+        for (uint32 i = 0; i < queriesNum; ++i)
+        {
+            origins[i] = glm::vec3(position(random), 4.0f, position(random));
+            directions[i] = glm::normalize(glm::vec3(offset(random), offset(random) * 0.25f, offset(random)) + glm::vec3(0.0f, 0.0f, 1e-3f));
+            frustums[i] = extractFrustumPlanes(projection * glm::lookAt(origins[i], origins[i] + directions[i], glm::vec3(0.0f, 1.0f, 0.0f)));
+        }
+
+        std::vector<uint32> results;
+        uint64 frustumHits = 0;
+        start = Clock::now();
+        for (const LBVH::Planes& frustum : frustums)
+        {
+            results.clear();
+            bvh.queryFrustum(frustum, results);
+            frustumHits += results.size();
+        }
+        const double frustumMs = elapsedMs(start);
+
+        uint64 sphereHits = 0;
+        start = Clock::now();
+        for (const glm::vec3& origin : origins)
+        {
+            results.clear();
+            bvh.querySphere(origin, 16.0f, results);
+            sphereHits += results.size();
+        }
+        const double sphereMs = elapsedMs(start);
+
+        uint32 rayHits = 0;
+        start = Clock::now();
+        for (uint32 i = 0; i < queriesNum; ++i)
+        {
+            rayHits += bvh.raycast(origins[i], directions[i], 1000.0f) != LBVH::invalidItem;
+        }
+        const double rayMs = elapsedMs(start);
+
+        auto perSecond = [](double ms) { return queriesNum / (ms * 1e-3); };
+
+        std::println("{} instances, {} nodes", instancesNum, bvh.getNodesNum());
+        std::println("  build   {:10.3f} ms", buildMs);
+        std::println("  refit   {:10.3f} ms ({} moved)", refitMs, movedNum);
+        std::println("  frustum {:10.0f} queries/s, {} items per query", perSecond(frustumMs), frustumHits / queriesNum);
+        std::println("  sphere  {:10.0f} queries/s, {} items per query", perSecond(sphereMs), sphereHits / queriesNum);
+        std::println("  ray     {:10.0f} queries/s, {} of {} hit", perSecond(rayMs), rayHits, queriesNum);
+    }
+}
+
+int main()
+{
+    std::mt19937 random(42);
+    for (uint32 instancesNum : { 10'000u, 100'000u, 1'000'000u })
+    {
+        runBenchmark(instancesNum, random);
+    }
+    return 0;
+}
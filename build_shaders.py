@@ -15,18 +15,18 @@ generated_file.write('#include <vector>\n\n')
     
 for file in os.listdir(directory):
     filename = os.fsdecode(file)
-    if filename.endswith('.vert') or filename.endswith('.frag'): 
+    if filename.endswith('.vert') or filename.endswith('.frag') or filename.endswith('.comp'): 
         
         
         in_path = os.path.join(directory, filename)
-        out_path = in_path.replace('.vert','.spv').replace('.frag','.spv')
+        out_path = in_path.replace('.vert','.spv').replace('.frag','.spv').replace('.comp','.spv')
         command = '{compiler} {fileIn} -o {fileOut}'.format(compiler=shader_compiler_path, fileIn=in_path, fileOut=out_path)
         print(command)
         os.system(command)
         f = open(out_path, 'rb')
         data = f.read()
            
-        generated_file.write("static const std::vector<uint8_t> {} = {{".format(filename.replace('.vert','').replace('.frag','')))
+        generated_file.write("static const std::vector<uint8_t> {} = {{".format(filename.replace('.vert','').replace('.frag','').replace('.comp','')))
         generated_file.write(", ".join(f"0x{b:02X}" for b in data))
         generated_file.write("};\n")
         
\ No newline at end of file
@@ -0,0 +1,392 @@
+#include "pch.h"
+#include "LBVH.h"
+
+#include <tracy/Tracy.hpp>
+
+void LAABB::expand(const LAABB& other)
+{
+    min = glm::min(min, other.min);
+    max = glm::max(max, other.max);
+}
+
+void LBVH::build(std::vector<LAABB> itemBounds)
+{
+    ZoneScoped;
+
+    items = std::move(itemBounds);
+    nodes.clear();
+    dirtyLeaves.clear();
+
+    const uint32 itemsNum = getItemsNum();
+    itemOrder.resize(itemsNum);
+    std::iota(itemOrder.begin(), itemOrder.end(), 0);
+    itemLeaves.assign(itemsNum, 0);
+
+    // empty items are kept so updateItem can bring them back, they sit around the origin
+    std::vector<glm::vec3> centers(itemsNum);
+    for (uint32 i = 0; i < itemsNum; ++i)
+    {
+        centers[i] = items[i].isEmpty() ? glm::vec3(0.0f) : items[i].getCenter();
+    }
+
+    nodes.reserve(itemsNum > 0 ? 2 * ((itemsNum + maxLeafSize - 1) / maxLeafSize) : 1);
+    nodes.emplace_back();
+    nodes[0].itemsNum = itemsNum;
+    buildNode(0, centers);
+
+    dirtyNodes.assign(nodes.size(), 0);
+}
+
+void LBVH::buildNode(uint32 nodeIndex, std::vector<glm::vec3>& centers)
+{
+    const uint32 first = nodes[nodeIndex].firstItem;
+    const uint32 count = nodes[nodeIndex].itemsNum;
+
+    LAABB bounds;
+    LAABB centerBounds;
+    for (uint32 i = first; i < first + count; ++i)
+    {
+        bounds.expand(items[itemOrder[i]]);
+        centerBounds.expand({ centers[itemOrder[i]], centers[itemOrder[i]] });
+    }
+    nodes[nodeIndex].bounds = bounds;
+
+    if (count <= maxLeafSize)
+    {
+        for (uint32 i = first; i < first + count; ++i)
+        {
+            itemLeaves[itemOrder[i]] = nodeIndex;
+        }
+        return;
+    }
+
+    // median split along the longest axis of the centers, cheap to build and balanced by construction
+    const glm::vec3 size = centerBounds.max - centerBounds.min;
+    const int32 axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+    const uint32 half = count / 2;
+    std::nth_element(itemOrder.begin() + first, itemOrder.begin() + first + half, itemOrder.begin() + first + count,
+        [&centers, axis](uint32 left, uint32 right) { return centers[left][axis] < centers[right][axis]; });
+
+    const uint32 leftChild = static_cast<uint32>(nodes.size());
+    nodes[nodeIndex].leftChild = leftChild;
+
+    Node left;
+    left.firstItem = first;
+    left.itemsNum = half;
+    left.parent = nodeIndex;
+
+    Node right;
+    right.firstItem = first + half;
+    right.itemsNum = count - half;
+    right.parent = nodeIndex;
+
+    nodes.push_back(left);
+    nodes.push_back(right);
+
+    buildNode(leftChild, centers);
+    buildNode(leftChild + 1, centers);
+}
+
+void LBVH::updateItem(uint32 item, const LAABB& bounds)
+{
+    assert(item < getItemsNum());
+    items[item] = bounds;
+
+    const uint32 leaf = itemLeaves[item];
+    if (!dirtyNodes[leaf])
+    {
+        dirtyNodes[leaf] = 1;
+        dirtyLeaves.push_back(leaf);
+    }
+}
+
+void LBVH::refit()
+{
+    ZoneScoped;
+
+    if (dirtyLeaves.empty())
+    {
+        return;
+    }
+
+    // parents are marked on the way up, children have bigger indices, so the descending order
+    // recomputes every dirty node once and after all of its children
+    std::vector<uint32> dirtyOrder = dirtyLeaves;
+    for (uint32 leaf : dirtyLeaves)
+    {
+        for (uint32 node = leaf; node != 0 && !dirtyNodes[nodes[node].parent]; node = nodes[node].parent)
+        {
+            dirtyNodes[nodes[node].parent] = 1;
+            dirtyOrder.push_back(nodes[node].parent);
+        }
+    }
+    dirtyLeaves.clear();
+
+    std::sort(dirtyOrder.begin(), dirtyOrder.end(), std::greater<uint32>());
+
+    for (uint32 nodeIndex : dirtyOrder)
+    {
+        dirtyNodes[nodeIndex] = 0;
+
+        Node& node = nodes[nodeIndex];
+        LAABB bounds;
+        if (node.isLeaf())
+        {
+            for (uint32 i = node.firstItem; i < node.firstItem + node.itemsNum; ++i)
+            {
+                bounds.expand(items[itemOrder[i]]);
+            }
+        }
+        else
+        {
+            bounds.expand(nodes[node.leftChild].bounds);
+            bounds.expand(nodes[node.leftChild + 1].bounds);
+        }
+        node.bounds = bounds;
+    }
+}
+
+void LBVH::appendItems(const Node& node, std::vector<uint32>& itemsOut) const
+{
+    for (uint32 i = node.firstItem; i < node.firstItem + node.itemsNum; ++i)
+    {
+        if (!items[itemOrder[i]].isEmpty())
+        {
+            itemsOut.push_back(itemOrder[i]);
+        }
+    }
+}
+
+void LBVH::queryFrustum(const Planes& planes, std::vector<uint32>& itemsOut) const
+{
+    ZoneScoped;
+
+    if (nodes.empty())
+    {
+        return;
+    }
+
+    constexpr uint32 allPlanesMask = (1u << 6) - 1;
+
+    // a bit per plane the box still straddles, planes a parent is fully inside of are not tested again
+    struct Entry
+    {
+        uint32 node;
+        uint32 planesMask;
+    };
+
+    std::vector<Entry> stack;
+    stack.push_back({ 0, allPlanesMask });
+
+    while (!stack.empty())
+    {
+        const Entry entry = stack.back();
+        stack.pop_back();
+
+        const Node& node = nodes[entry.node];
+        if (node.bounds.isEmpty())
+        {
+            continue;
+        }
+
+        const glm::vec3 center = node.bounds.getCenter();
+        const glm::vec3 extent = node.bounds.getExtent();
+
+        uint32 planesMask = entry.planesMask;
+        bool bOutside = false;
+        for (uint32 i = 0; i < planes.size() && !bOutside; ++i)
+        {
+            if (planesMask & (1u << i))
+            {
+                const glm::vec3 normal = glm::vec3(planes[i]);
+                const float distance = glm::dot(normal, center) + planes[i].w;
+                const float radius = glm::dot(glm::abs(normal), extent);
+
+                bOutside = distance + radius < 0.0f;
+                if (distance - radius >= 0.0f)
+                {
+                    planesMask &= ~(1u << i);
+                }
+            }
+        }
+
+        if (bOutside)
+        {
+            continue;
+        }
+
+        if (planesMask == 0)
+        {
+            appendItems(node, itemsOut);
+        }
+        else if (node.isLeaf())
+        {
+            for (uint32 i = node.firstItem; i < node.firstItem + node.itemsNum; ++i)
+            {
+                const LAABB& bounds = items[itemOrder[i]];
+                if (bounds.isEmpty())
+                {
+                    continue;
+                }
+
+                const glm::vec3 itemCenter = bounds.getCenter();
+                const glm::vec3 itemExtent = bounds.getExtent();
+
+                bool bVisible = true;
+                for (uint32 plane = 0; plane < planes.size() && bVisible; ++plane)
+                {
+                    const glm::vec3 normal = glm::vec3(planes[plane]);
+                    bVisible = glm::dot(normal, itemCenter) + planes[plane].w + glm::dot(glm::abs(normal), itemExtent) >= 0.0f;
+                }
+
+                if (bVisible)
+                {
+                    itemsOut.push_back(itemOrder[i]);
+                }
+            }
+        }
+        else
+        {
+            stack.push_back({ node.leftChild + 1, planesMask });
+            stack.push_back({ node.leftChild, planesMask });
+        }
+    }
+}
+
+void LBVH::querySphere(const glm::vec3& center, float radius, std::vector<uint32>& itemsOut) const
+{
+    ZoneScoped;
+
+    if (nodes.empty())
+    {
+        return;
+    }
+
+    auto overlaps = [&center, radius](const LAABB& bounds)
+        {
+            const glm::vec3 closest = glm::clamp(center, bounds.min, bounds.max);
+            const glm::vec3 offset = closest - center;
+            return !bounds.isEmpty() && glm::dot(offset, offset) <= radius * radius;
+        };
+
+    std::vector<uint32> stack;
+    stack.push_back(0);
+
+    while (!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        if (!overlaps(node.bounds))
+        {
+            continue;
+        }
+
+        if (node.isLeaf())
+        {
+            for (uint32 i = node.firstItem; i < node.firstItem + node.itemsNum; ++i)
+            {
+                if (overlaps(items[itemOrder[i]]))
+                {
+                    itemsOut.push_back(itemOrder[i]);
+                }
+            }
+        }
+        else
+        {
+            stack.push_back(node.leftChild + 1);
+            stack.push_back(node.leftChild);
+        }
+    }
+}
+
+bool LBVH::intersectRay(const LAABB& bounds, const glm::vec3& origin, const glm::vec3& inverseDirection, float maxDistance, float& distanceOut)
+{
+    if (bounds.isEmpty())
+    {
+        return false;
+    }
+
+    // slab test, infinite inverse components are handled by the min/max
+    const glm::vec3 t0 = (bounds.min - origin) * inverseDirection;
+    const glm::vec3 t1 = (bounds.max - origin) * inverseDirection;
+    const glm::vec3 tMin = glm::min(t0, t1);
+    const glm::vec3 tMax = glm::max(t0, t1);
+
+    const float enter = std::max({ tMin.x, tMin.y, tMin.z, 0.0f });
+    const float exit = std::min({ tMax.x, tMax.y, tMax.z, maxDistance });
+
+    distanceOut = enter;
+    return enter <= exit;
+}
+
+uint32 LBVH::raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float* distanceOut) const
+{
+    ZoneScoped;
+
+    uint32 closestItem = invalidItem;
+    if (nodes.empty())
+    {
+        return closestItem;
+    }
+
+    const glm::vec3 inverseDirection = 1.0f / direction;
+    float closestDistance = maxDistance;
+
+    std::vector<uint32> stack;
+    stack.push_back(0);
+
+    while (!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+
+        float distance;
+        if (!intersectRay(node.bounds, origin, inverseDirection, closestDistance, distance))
+        {
+            continue;
+        }
+
+        if (node.isLeaf())
+        {
+            for (uint32 i = node.firstItem; i < node.firstItem + node.itemsNum; ++i)
+            {
+                if (intersectRay(items[itemOrder[i]], origin, inverseDirection, closestDistance, distance))
+                {
+                    closestDistance = distance;
+                    closestItem = itemOrder[i];
+                }
+            }
+        }
+        else
+        {
+            // the nearer child is visited first, so the farther one is likely rejected by closestDistance
+            float leftDistance;
+            float rightDistance;
+            const bool bLeft = intersectRay(nodes[node.leftChild].bounds, origin, inverseDirection, closestDistance, leftDistance);
+            const bool bRight = intersectRay(nodes[node.leftChild + 1].bounds, origin, inverseDirection, closestDistance, rightDistance);
+
+            if (bLeft && bRight)
+            {
+                const bool bLeftFirst = leftDistance <= rightDistance;
+                stack.push_back(bLeftFirst ? node.leftChild + 1 : node.leftChild);
+                stack.push_back(bLeftFirst ? node.leftChild : node.leftChild + 1);
+            }
+            else if (bLeft)
+            {
+                stack.push_back(node.leftChild);
+            }
+            else if (bRight)
+            {
+                stack.push_back(node.leftChild + 1);
+            }
+        }
+    }
+
+    if (distanceOut && closestItem != invalidItem)
+    {
+        *distanceOut = closestDistance;
+    }
+    return closestItem;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <limits>
+
+#include "globals.h"
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+struct LAABB
+{
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
+
+    // default constructed box is empty, it never intersects anything
+    bool isEmpty() const { return min.x > max.x; }
+
+    void expand(const LAABB& other);
+    glm::vec3 getCenter() const { return (min + max) * 0.5f; }
+    glm::vec3 getExtent() const { return (max - min) * 0.5f; }
+};
+
+// Bounding volume hierarchy over a fixed set of items, an item is identified by its index in the build input.
+// Moved items are refitted in place, the topology only changes on build
+class LBVH
+{
+public:
+
+    static constexpr uint32 invalidItem = std::numeric_limits<uint32>::max();
+    static constexpr uint32 maxLeafSize = 4;
+
+    // normalized planes, xyz - normal pointing inside, w - distance
+    using Planes = std::array<glm::vec4, 6>;
+
+    void build(std::vector<LAABB> itemBounds);
+
+    // the change becomes visible to the queries after refit
+    void updateItem(uint32 item, const LAABB& bounds);
+
+    // recomputes the bounds of the nodes above the updated items only
+    void refit();
+
+    uint32 getItemsNum() const { return static_cast<uint32>(items.size()); }
+    uint32 getNodesNum() const { return static_cast<uint32>(nodes.size()); }
+
+    // appends the items intersecting the query, empty items are never reported
+    void queryFrustum(const Planes& planes, std::vector<uint32>& itemsOut) const;
+    void querySphere(const glm::vec3& center, float radius, std::vector<uint32>& itemsOut) const;
+
+    // closest item whose box is hit within maxDistance, invalidItem when nothing is hit
+    uint32 raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float* distanceOut = nullptr) const;
+
+protected:
+
+    struct Node
+    {
+        LAABB bounds;
+
+        // items of the subtree are itemOrder[firstItem, firstItem + itemsNum)
+        uint32 firstItem = 0;
+        uint32 itemsNum = 0;
+
+        // children are allocated in pairs, leftChild + 1 is the right one. 0 for leaves, the root is never a child
+        uint32 leftChild = 0;
+        uint32 parent = 0;
+
+        bool isLeaf() const { return leftChild == 0; }
+    };
+
+    void buildNode(uint32 nodeIndex, std::vector<glm::vec3>& centers);
+    void appendItems(const Node& node, std::vector<uint32>& itemsOut) const;
+
+    static bool intersectRay(const LAABB& bounds, const glm::vec3& origin, const glm::vec3& inverseDirection, float maxDistance, float& distanceOut);
+
+    // children always have bigger indices than their parent
+    std::vector<Node> nodes;
+
+    std::vector<LAABB> items;
+    std::vector<uint32> itemOrder;
+    std::vector<uint32> itemLeaves;
+
+    // leaves touched by updateItem since the last refit
+    std::vector<uint32> dirtyLeaves;
+    std::vector<uint8> dirtyNodes;
+};
@@ -0,0 +1,102 @@
+#include "pch.h"
+#include "LDrawQueue.h"
+#include "LJobSystem.h"
+
+#include <tracy/Tracy.hpp>
+
+uint64 LDrawKey::make(uint32 pass, uint32 pipeline, uint32 material, uint32 mesh, float depth)
+{
+    constexpr uint32 depthMax = (1u << depthBits) - 1;
+    const uint32 quantizedDepth = static_cast<uint32>(std::clamp(depth, 0.0f, 1.0f) * depthMax);
+
+    return (static_cast<uint64>(pass & ((1u << passBits) - 1)) << passShift) |
+        (static_cast<uint64>(pipeline & ((1u << pipelineBits) - 1)) << pipelineShift) |
+        (static_cast<uint64>(material & ((1u << materialBits) - 1)) << materialShift) |
+        (static_cast<uint64>(mesh & ((1u << meshBits) - 1)) << meshShift) |
+        (static_cast<uint64>(quantizedDepth) << depthShift);
+}
+
+void LDrawQueue::sort(LJobSystem* jobSystem)
+{
+    ZoneScoped;
+
+    const uint32 count = getSize();
+    if (count < 2)
+    {
+        return;
+    }
+
+    // bits that differ between the keys, digits without them don't change the order
+    uint64 differentBits = 0;
+    for (const Item& item : items)
+    {
+        differentBits |= item.key ^ items[0].key;
+    }
+
+    const uint32 chunksNum = (count + chunkSize - 1) / chunkSize;
+    scratch.resize(count);
+    histograms.resize(chunksNum);
+
+    auto runChunks = [jobSystem, chunksNum](const std::function<void(uint32, uint32)>& func)
+        {
+            if (jobSystem && chunksNum > 1)
+            {
+                jobSystem->wait(jobSystem->parallelFor(chunksNum, 1, func));
+            }
+            else
+            {
+                func(0, chunksNum);
+            }
+        };
+
+    for (uint32 shift = 0; shift < 64; shift += radixBits)
+    {
+        if (((differentBits >> shift) & (radixSize - 1)) == 0)
+        {
+            continue;
+        }
+
+        runChunks([this, shift, count](uint32 beginChunk, uint32 endChunk)
+            {
+                for (uint32 chunk = beginChunk; chunk < endChunk; ++chunk)
+                {
+                    Histogram& histogram = histograms[chunk];
+                    histogram.fill(0);
+
+                    const uint32 end = std::min((chunk + 1) * chunkSize, count);
+                    for (uint32 i = chunk * chunkSize; i < end; ++i)
+                    {
+                        ++histogram[(items[i].key >> shift) & (radixSize - 1)];
+                    }
+                }
+            });
+
+        // exclusive prefix sum, digit major and chunk minor, so equal digits keep their order
+        uint32 offset = 0;
+        for (uint32 digit = 0; digit < radixSize; ++digit)
+        {
+            for (Histogram& histogram : histograms)
+            {
+                const uint32 digitCount = histogram[digit];
+                histogram[digit] = offset;
+                offset += digitCount;
+            }
+        }
+
+        runChunks([this, shift, count](uint32 beginChunk, uint32 endChunk)
+            {
+                for (uint32 chunk = beginChunk; chunk < endChunk; ++chunk)
+                {
+                    Histogram& offsets = histograms[chunk];
+
+                    const uint32 end = std::min((chunk + 1) * chunkSize, count);
+                    for (uint32 i = chunk * chunkSize; i < end; ++i)
+                    {
+                        scratch[offsets[(items[i].key >> shift) & (radixSize - 1)]++] = items[i];
+                    }
+                }
+            });
+
+        items.swap(scratch);
+    }
+}
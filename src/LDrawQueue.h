@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "globals.h"
+
+class LJobSystem;
+
+// 64-bit sort key of a draw. The most significant fields change the most expensive state, so sorted draws
+// are grouped by pass, then pipeline, material and mesh, and go front to back inside a group
+struct LDrawKey
+{
+    static constexpr uint32 passBits = 4;
+    static constexpr uint32 pipelineBits = 4;
+    static constexpr uint32 materialBits = 16;
+    static constexpr uint32 meshBits = 16;
+    static constexpr uint32 depthBits = 24;
+
+    static constexpr uint32 depthShift = 0;
+    static constexpr uint32 meshShift = depthShift + depthBits;
+    static constexpr uint32 materialShift = meshShift + meshBits;
+    static constexpr uint32 pipelineShift = materialShift + materialBits;
+    static constexpr uint32 passShift = pipelineShift + pipelineBits;
+
+    // depth is normalized to [0, 1], out of range values are clamped. Wider fields are masked
+    static uint64 make(uint32 pass, uint32 pipeline, uint32 material, uint32 mesh, float depth);
+
+    static uint32 getPass(uint64 key) { return static_cast<uint32>(key >> passShift) & ((1u << passBits) - 1); }
+    static uint32 getPipeline(uint64 key) { return static_cast<uint32>(key >> pipelineShift) & ((1u << pipelineBits) - 1); }
+};
+
+// Draws of a frame, each one is a sort key and an index into the payload array of the caller.
+// Sorted with a stable LSD radix sort, histograms and scatters of big queues are spread over the job system
+class LDrawQueue
+{
+public:
+
+    struct Item
+    {
+        uint64 key;
+        uint32 payload;
+    };
+
+    void clear() { items.clear(); }
+    void push(uint64 key, uint32 payload) { items.push_back({ key, payload }); }
+
+    // jobSystem may be null, digits equal in every key are skipped
+    void sort(LJobSystem* jobSystem);
+
+    const std::vector<Item>& getItems() const { return items; }
+    uint32 getSize() const { return static_cast<uint32>(items.size()); }
+
+protected:
+
+    static constexpr uint32 radixBits = 8;
+    static constexpr uint32 radixSize = 1u << radixBits;
+
+    // smaller queues are sorted on the calling thread
+    static constexpr uint32 chunkSize = 4096;
+
+    using Histogram = std::array<uint32, radixSize>;
+
+    std::vector<Item> items;
+    std::vector<Item> scratch;
+    std::vector<Histogram> histograms;
+};
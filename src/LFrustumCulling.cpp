@@ -0,0 +1,221 @@
+#include "pch.h"
+#include "LFrustumCulling.h"
+
+#include <bit>
+
+#include <tracy/Tracy.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define L_TARGET_AVX2
+#else
+#define L_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+
+void LSphereBatch::clear()
+{
+    x.clear();
+    y.clear();
+    z.clear();
+    radius.clear();
+}
+
+void LSphereBatch::push(const glm::vec3& center, float sphereRadius)
+{
+    x.push_back(center.x);
+    y.push_back(center.y);
+    z.push_back(center.z);
+    radius.push_back(sphereRadius);
+}
+
+void LFrustumCulling::cull(const Planes& planes, const LSphereBatch& spheres, std::vector<uint32>& visibleOut)
+{
+    ZoneScoped;
+
+    const uint32 count = spheres.getSize();
+    visibleOut.resize(count);
+
+    const uint32 visibleNum = getKernel().kernel(planes, spheres.x.data(), spheres.y.data(), spheres.z.data(), spheres.radius.data(), count, visibleOut.data());
+    visibleOut.resize(visibleNum);
+}
+
+const char* LFrustumCulling::getKernelName()
+{
+    return getKernel().name;
+}
+
+const LFrustumCulling::KernelInfo& LFrustumCulling::getKernel()
+{
+    static const KernelInfo kernel = selectKernel();
+    return kernel;
+}
+
+LFrustumCulling::KernelInfo LFrustumCulling::selectKernel()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    bool bHasAVX2 = false;
+#if defined(_MSC_VER)
+    int32 info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7)
+    {
+        __cpuid(info, 1);
+        const bool bOSSavesYmm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+
+        __cpuidex(info, 7, 0);
+        bHasAVX2 = bOSSavesYmm && (info[1] & (1 << 5));
+    }
+#else
+    bHasAVX2 = __builtin_cpu_supports("avx2");
+#endif
+    if (bHasAVX2)
+    {
+        return { &LFrustumCulling::cullAVX2, "AVX2" };
+    }
+    // SSE2 is a part of x86-64
+    return { &LFrustumCulling::cullSSE, "SSE" };
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    return { &LFrustumCulling::cullNEON, "NEON" };
+#else
+    return { &LFrustumCulling::cullScalar, "Scalar" };
+#endif
+}
+
+uint32 LFrustumCulling::cullScalar(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut)
+{
+    uint32 visibleNum = 0;
+    for (uint32 i = 0; i < count; ++i)
+    {
+        bool bVisible = true;
+        for (const glm::vec4& plane : planes)
+        {
+            bVisible &= plane.x * x[i] + plane.y * y[i] + plane.z * z[i] + plane.w >= -radius[i];
+        }
+
+        // branchless compaction, the slot is overwritten when the sphere is culled
+        visibleOut[visibleNum] = i;
+        visibleNum += bVisible;
+    }
+    return visibleNum;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+uint32 LFrustumCulling::cullSSE(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut)
+{
+    constexpr uint32 width = 4;
+    const uint32 simdCount = count - count % width;
+
+    uint32 visibleNum = 0;
+    for (uint32 i = 0; i < simdCount; i += width)
+    {
+        const __m128 px = _mm_loadu_ps(x + i);
+        const __m128 py = _mm_loadu_ps(y + i);
+        const __m128 pz = _mm_loadu_ps(z + i);
+        const __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+
+        __m128 visible = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (const glm::vec4& plane : planes)
+        {
+            __m128 distance = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(plane.x)), _mm_set1_ps(plane.w));
+            distance = _mm_add_ps(distance, _mm_mul_ps(py, _mm_set1_ps(plane.y)));
+            distance = _mm_add_ps(distance, _mm_mul_ps(pz, _mm_set1_ps(plane.z)));
+            visible = _mm_and_ps(visible, _mm_cmpge_ps(distance, negRadius));
+        }
+
+        for (uint32 mask = static_cast<uint32>(_mm_movemask_ps(visible)); mask != 0; mask &= mask - 1)
+        {
+            visibleOut[visibleNum++] = i + std::countr_zero(mask);
+        }
+    }
+
+    const uint32 tailNum = cullScalar(planes, x + simdCount, y + simdCount, z + simdCount, radius + simdCount, count - simdCount, visibleOut + visibleNum);
+    for (uint32 i = visibleNum; i < visibleNum + tailNum; ++i)
+    {
+        visibleOut[i] += simdCount;
+    }
+    return visibleNum + tailNum;
+}
+
+L_TARGET_AVX2 uint32 LFrustumCulling::cullAVX2(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut)
+{
+    constexpr uint32 width = 8;
+    const uint32 simdCount = count - count % width;
+
+    uint32 visibleNum = 0;
+    for (uint32 i = 0; i < simdCount; i += width)
+    {
+        const __m256 px = _mm256_loadu_ps(x + i);
+        const __m256 py = _mm256_loadu_ps(y + i);
+        const __m256 pz = _mm256_loadu_ps(z + i);
+        const __m256 negRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(radius + i));
+
+        __m256 visible = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (const glm::vec4& plane : planes)
+        {
+            __m256 distance = _mm256_add_ps(_mm256_mul_ps(px, _mm256_set1_ps(plane.x)), _mm256_set1_ps(plane.w));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(py, _mm256_set1_ps(plane.y)));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(pz, _mm256_set1_ps(plane.z)));
+            visible = _mm256_and_ps(visible, _mm256_cmp_ps(distance, negRadius, _CMP_GE_OQ));
+        }
+
+        for (uint32 mask = static_cast<uint32>(_mm256_movemask_ps(visible)); mask != 0; mask &= mask - 1)
+        {
+            visibleOut[visibleNum++] = i + std::countr_zero(mask);
+        }
+    }
+
+    const uint32 tailNum = cullScalar(planes, x + simdCount, y + simdCount, z + simdCount, radius + simdCount, count - simdCount, visibleOut + visibleNum);
+    for (uint32 i = visibleNum; i < visibleNum + tailNum; ++i)
+    {
+        visibleOut[i] += simdCount;
+    }
+    return visibleNum + tailNum;
+}
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+
+uint32 LFrustumCulling::cullNEON(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut)
+{
+    constexpr uint32 width = 4;
+    const uint32 simdCount = count - count % width;
+
+    uint32 visibleNum = 0;
+    for (uint32 i = 0; i < simdCount; i += width)
+    {
+        const float32x4_t px = vld1q_f32(x + i);
+        const float32x4_t py = vld1q_f32(y + i);
+        const float32x4_t pz = vld1q_f32(z + i);
+        const float32x4_t negRadius = vnegq_f32(vld1q_f32(radius + i));
+
+        uint32x4_t visible = vdupq_n_u32(~0u);
+        for (const glm::vec4& plane : planes)
+        {
+            float32x4_t distance = vmlaq_n_f32(vdupq_n_f32(plane.w), px, plane.x);
+            distance = vmlaq_n_f32(distance, py, plane.y);
+            distance = vmlaq_n_f32(distance, pz, plane.z);
+            visible = vandq_u32(visible, vcgeq_f32(distance, negRadius));
+        }
+
+        const uint32 lanes[width] = { vgetq_lane_u32(visible, 0), vgetq_lane_u32(visible, 1), vgetq_lane_u32(visible, 2), vgetq_lane_u32(visible, 3) };
+        for (uint32 lane = 0; lane < width; ++lane)
+        {
+            visibleOut[visibleNum] = i + lane;
+            visibleNum += lanes[lane] & 1;
+        }
+    }
+
+    const uint32 tailNum = cullScalar(planes, x + simdCount, y + simdCount, z + simdCount, radius + simdCount, count - simdCount, visibleOut + visibleNum);
+    for (uint32 i = visibleNum; i < visibleNum + tailNum; ++i)
+    {
+        visibleOut[i] += simdCount;
+    }
+    return visibleNum + tailNum;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "globals.h"
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+// Bounds of a mesh in its local space
+struct LMeshBounds
+{
+    glm::vec3 aabbMin = glm::vec3(0.0f);
+    glm::vec3 aabbMax = glm::vec3(0.0f);
+
+    // xyz - center, w - radius
+    glm::vec4 sphere = glm::vec4(0.0f);
+};
+
+// World space bounding spheres in structure of arrays layout, the input of the culling kernels
+struct LSphereBatch
+{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> radius;
+
+    void clear();
+    void push(const glm::vec3& center, float sphereRadius);
+    uint32 getSize() const { return static_cast<uint32>(x.size()); }
+};
+
+// Batch sphere vs frustum test. The kernel is picked once at runtime: AVX2, SSE or NEON, scalar as the fallback
+class LFrustumCulling
+{
+public:
+
+    // normalized planes, xyz - normal pointing inside, w - distance
+    using Planes = std::array<glm::vec4, 6>;
+
+    // writes indices of the spheres intersecting the frustum to visibleOut, in ascending order
+    static void cull(const Planes& planes, const LSphereBatch& spheres, std::vector<uint32>& visibleOut);
+
+    static const char* getKernelName();
+
+protected:
+
+    using Kernel = uint32 (*)(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut);
+
+    struct KernelInfo
+    {
+        Kernel kernel;
+        const char* name;
+    };
+
+    static const KernelInfo& getKernel();
+    static KernelInfo selectKernel();
+
+    static uint32 cullScalar(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut);
+#if defined(__x86_64__) || defined(_M_X64)
+    static uint32 cullSSE(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut);
+    static uint32 cullAVX2(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut);
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    static uint32 cullNEON(const Planes& planes, const float* x, const float* y, const float* z, const float* radius, uint32 count, uint32* visibleOut);
+#endif
+};
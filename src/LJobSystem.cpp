@@ -0,0 +1,237 @@
+#include "pch.h"
+#include "LJobSystem.h"
+
+#include <tracy/Tracy.hpp>
+
+thread_local uint32 LJobSystem::workerIndex = std::numeric_limits<uint32>::max();
+
+LJobSystem::LJobSystem(uint32 workersNum)
+{
+	if (workersNum == 0)
+	{
+		workersNum = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	}
+
+	queues.resize(workersNum + 1);
+	for (auto& queue : queues)
+	{
+		queue = std::make_unique<WorkerQueue>();
+	}
+
+	workers.reserve(workersNum);
+	for (uint32 i = 0; i < workersNum; ++i)
+	{
+		workers.emplace_back(&LJobSystem::workerLoop, this, i);
+	}
+}
+
+LJobSystem::~LJobSystem()
+{
+	bStop = true;
+	{
+		std::lock_guard lock(sleepMutex);
+	}
+	sleepCondition.notify_all();
+
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+LJobSystem::JobHandle LJobSystem::parallelFor(uint32 count, uint32 chunkSize, RangeFunc func, std::initializer_list<JobHandle> dependencies)
+{
+	return createJob(count, chunkSize, std::move(func), dependencies);
+}
+
+LJobSystem::JobHandle LJobSystem::parallelFor(uint32 count, uint32 chunkSize, RangeFunc func, const std::vector<JobHandle>& dependencies)
+{
+	return createJob(count, chunkSize, std::move(func), dependencies);
+}
+
+LJobSystem::JobHandle LJobSystem::schedule(std::function<void()> func, std::initializer_list<JobHandle> dependencies)
+{
+	return createJob(1, 1, [func = std::move(func)](uint32, uint32) { func(); }, dependencies);
+}
+
+LJobSystem::JobHandle LJobSystem::schedule(std::function<void()> func, const std::vector<JobHandle>& dependencies)
+{
+	return createJob(1, 1, [func = std::move(func)](uint32, uint32) { func(); }, dependencies);
+}
+
+template<typename Container>
+LJobSystem::JobHandle LJobSystem::createJob(uint32 count, uint32 chunkSize, RangeFunc func, const Container& dependencies)
+{
+	auto job = std::make_shared<Job>();
+	job->func = std::move(func);
+	job->count = count;
+	job->chunkSize = std::max(chunkSize, 1u);
+
+	// an empty job still runs one empty chunk, so its dependents are released the usual way
+	job->unfinishedChunks = std::max((count + job->chunkSize - 1) / job->chunkSize, 1u);
+
+	for (const JobHandle& dependency : dependencies)
+	{
+		if (!dependency)
+		{
+			continue;
+		}
+
+		std::lock_guard lock(dependency->dependentsMutex);
+		if (!dependency->bFinished)
+		{
+			++job->unfinishedDependencies;
+			dependency->dependents.push_back(job);
+		}
+	}
+
+	if (--job->unfinishedDependencies == 0)
+	{
+		submit(job);
+	}
+
+	return job;
+}
+
+void LJobSystem::wait(const JobHandle& job)
+{
+	if (!job)
+	{
+		return;
+	}
+
+	const uint32 queueIndex = getCurrentQueueIndex();
+	while (!job->bFinished)
+	{
+		if (!tryExecute(queueIndex))
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+void LJobSystem::wait(const std::vector<JobHandle>& jobs)
+{
+	for (const JobHandle& job : jobs)
+	{
+		wait(job);
+	}
+}
+
+void LJobSystem::workerLoop(uint32 index)
+{
+	workerIndex = index;
+	tracy::SetThreadName(std::format("LJobSystem worker {}", index).data());
+
+	while (!bStop)
+	{
+		if (!tryExecute(index))
+		{
+			std::unique_lock lock(sleepMutex);
+			sleepCondition.wait(lock, [this]() { return bStop || pendingChunks > 0; });
+		}
+	}
+}
+
+void LJobSystem::submit(const JobHandle& job)
+{
+	const uint32 chunksNum = job->unfinishedChunks;
+	pendingChunks += chunksNum;
+
+	for (uint32 i = 0; i < chunksNum; ++i)
+	{
+		uint32 begin = std::min(i * job->chunkSize, job->count);
+		uint32 end = std::min(begin + job->chunkSize, job->count);
+
+		WorkerQueue& queue = *queues[nextQueue++ % queues.size()];
+		std::lock_guard lock(queue.mutex);
+		queue.chunks.push_back({ job, begin, end });
+	}
+
+	// taking the mutex orders the pendingChunks increment with a worker going to sleep
+	{
+		std::lock_guard lock(sleepMutex);
+	}
+	sleepCondition.notify_all();
+}
+
+void LJobSystem::finishChunk(const JobHandle& job)
+{
+	if (--job->unfinishedChunks != 0)
+	{
+		return;
+	}
+
+	std::vector<JobHandle> dependents;
+	{
+		std::lock_guard lock(job->dependentsMutex);
+		job->bFinished = true;
+		dependents.swap(job->dependents);
+	}
+
+	for (const JobHandle& dependent : dependents)
+	{
+		if (--dependent->unfinishedDependencies == 0)
+		{
+			submit(dependent);
+		}
+	}
+}
+
+bool LJobSystem::tryExecute(uint32 queueIndex)
+{
+	Chunk chunk;
+	if (!popChunk(queueIndex, chunk) && !stealChunk(queueIndex, chunk))
+	{
+		return false;
+	}
+
+	--pendingChunks;
+
+	if (chunk.begin != chunk.end)
+	{
+		ZoneScopedN("Job chunk");
+		chunk.job->func(chunk.begin, chunk.end);
+	}
+
+	finishChunk(chunk.job);
+	return true;
+}
+
+uint32 LJobSystem::getCurrentQueueIndex() const
+{
+	return workerIndex < workers.size() ? workerIndex : static_cast<uint32>(queues.size() - 1);
+}
+
+bool LJobSystem::popChunk(uint32 queueIndex, Chunk& chunkOut)
+{
+	WorkerQueue& queue = *queues[queueIndex];
+	std::lock_guard lock(queue.mutex);
+
+	if (queue.chunks.empty())
+	{
+		return false;
+	}
+
+	chunkOut = std::move(queue.chunks.back());
+	queue.chunks.pop_back();
+	return true;
+}
+
+bool LJobSystem::stealChunk(uint32 thiefIndex, Chunk& chunkOut)
+{
+	const uint32 queuesNum = static_cast<uint32>(queues.size());
+	for (uint32 offset = 1; offset < queuesNum; ++offset)
+	{
+		WorkerQueue& queue = *queues[(thiefIndex + offset) % queuesNum];
+		std::lock_guard lock(queue.mutex);
+
+		if (!queue.chunks.empty())
+		{
+			chunkOut = std::move(queue.chunks.front());
+			queue.chunks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <initializer_list>
+
+#include "globals.h"
+
+// Persistent pool of worker threads. Every worker owns a deque: it pops its own work from the back,
+// idle workers steal from the front of the others. The thread waiting for a job helps to execute work.
+class LJobSystem
+{
+protected:
+
+	struct Job;
+
+public:
+
+	using JobHandle = std::shared_ptr<Job>;
+	using RangeFunc = std::function<void(uint32 begin, uint32 end)>;
+
+	// workersNum == 0 means one worker per hardware thread except the calling one
+	explicit LJobSystem(uint32 workersNum = 0);
+	~LJobSystem();
+
+	LJobSystem(const LJobSystem&) = delete;
+	LJobSystem& operator=(const LJobSystem&) = delete;
+
+	// splits [0, count) into chunks of chunkSize elements, func is called once per chunk.
+	// Chunks are not started before all the dependencies have finished
+	JobHandle parallelFor(uint32 count, uint32 chunkSize, RangeFunc func, std::initializer_list<JobHandle> dependencies = {});
+	JobHandle parallelFor(uint32 count, uint32 chunkSize, RangeFunc func, const std::vector<JobHandle>& dependencies);
+
+	JobHandle schedule(std::function<void()> func, std::initializer_list<JobHandle> dependencies = {});
+	JobHandle schedule(std::function<void()> func, const std::vector<JobHandle>& dependencies);
+
+	void wait(const JobHandle& job);
+	void wait(const std::vector<JobHandle>& jobs);
+
+	uint32 getWorkersNum() const { return static_cast<uint32>(workers.size()); }
+
+	// workers are [0, getWorkersNum()), every other thread shares the last index
+	uint32 getThreadIndex() const { return getCurrentQueueIndex(); }
+	uint32 getThreadsNum() const { return static_cast<uint32>(queues.size()); }
+
+protected:
+
+	struct Job
+	{
+		RangeFunc func;
+		uint32 count = 0;
+		uint32 chunkSize = 1;
+
+		std::atomic<uint32> unfinishedChunks = 0;
+
+		// + 1 while the dependencies are being registered, so the job can't start too early
+		std::atomic<uint32> unfinishedDependencies = 1;
+
+		std::mutex dependentsMutex;
+		std::vector<JobHandle> dependents;
+		std::atomic<bool> bFinished = false;
+	};
+
+	struct Chunk
+	{
+		JobHandle job;
+		uint32 begin = 0;
+		uint32 end = 0;
+	};
+
+	struct WorkerQueue
+	{
+		std::mutex mutex;
+		std::deque<Chunk> chunks;
+	};
+
+	template<typename Container>
+	JobHandle createJob(uint32 count, uint32 chunkSize, RangeFunc func, const Container& dependencies);
+
+	void workerLoop(uint32 index);
+	void submit(const JobHandle& job);
+	void finishChunk(const JobHandle& job);
+	bool tryExecute(uint32 queueIndex);
+	uint32 getCurrentQueueIndex() const;
+
+	// owner pops from the back
+	bool popChunk(uint32 queueIndex, Chunk& chunkOut);
+	// thieves steal from the front
+	bool stealChunk(uint32 thiefIndex, Chunk& chunkOut);
+
+	std::vector<std::thread> workers;
+
+	// one queue per worker and the last one for the external threads
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::atomic<uint32> nextQueue = 0;
+
+	std::mutex sleepMutex;
+	std::condition_variable sleepCondition;
+	std::atomic<uint32> pendingChunks = 0;
+	std::atomic<bool> bStop = false;
+
+	static thread_local uint32 workerIndex;
+};
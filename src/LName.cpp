@@ -0,0 +1,51 @@
+#include "pch.h"
+#include "LName.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+struct LName::Table
+{
+    std::mutex mutex;
+
+    // deque keeps the strings in place, so the views used as keys stay valid
+    std::deque<std::string> names = { std::string() };
+    std::unordered_map<std::string_view, uint32> ids = { { std::string_view(), 0 } };
+};
+
+LName::Table& LName::getTable()
+{
+    static Table table;
+    return table;
+}
+
+LName::LName(std::string_view str)
+{
+    Table& table = getTable();
+    std::lock_guard lock(table.mutex);
+
+    if (auto it = table.ids.find(str); it != table.ids.end())
+    {
+        id = it->second;
+        return;
+    }
+
+    id = static_cast<uint32>(table.names.size());
+    const std::string& name = table.names.emplace_back(str);
+    table.ids.emplace(name, id);
+}
+
+const std::string& LName::toString() const
+{
+    Table& table = getTable();
+    std::lock_guard lock(table.mutex);
+    return table.names[id];
+}
+
+uint32 LName::getNamesNum()
+{
+    Table& table = getTable();
+    std::lock_guard lock(table.mutex);
+    return static_cast<uint32>(table.names.size());
+}
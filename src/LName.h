@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <functional>
+
+#include "globals.h"
+
+// Interned string, an alternative to UE FName. Equal strings share one 32-bit id, so comparison and hashing
+// are integer operations. Ids are dense and never released, which lets them index plain vectors.
+// Id 0 is the empty name.
+class LName
+{
+public:
+
+    LName() = default;
+    explicit LName(std::string_view str);
+
+    uint32 getId() const { return id; }
+    bool isNone() const { return id == 0; }
+
+    // takes a lock, not meant for the frame path
+    const std::string& toString() const;
+
+    bool operator==(const LName& other) const = default;
+
+    // upper bound of the ids handed out so far
+    static uint32 getNamesNum();
+
+protected:
+
+    struct Table;
+    static Table& getTable();
+
+    uint32 id = 0;
+};
+
+template<>
+struct std::hash<LName>
+{
+    size_t operator()(const LName& name) const noexcept
+    {
+        return name.getId();
+    }
+};
@@ -29,30 +29,65 @@ DEBUG_CODE(
 
 LRenderer* LRenderer::thisPtr = nullptr;
 bool LRenderer::bFramebufferResized = false;
-std::unordered_map<std::string, int32> RenderComponentBuilder::objectsCounter;
-std::unordered_map<std::string, LRenderer::VkMemoryBuffer> RenderComponentBuilder::memoryBuffers;
+std::vector<int32> RenderComponentBuilder::objectsCounter;
+std::vector<LRenderer::MeshRange> RenderComponentBuilder::meshRanges;
+std::vector<LMeshBounds> RenderComponentBuilder::meshBounds;
 
 LRenderer::LRenderer(const std::unique_ptr<LWindow>& window, StaticInitData&& initData)
-    :primitiveCounterInitData(initData.primitiveCounter), maxPortalNum(initData.maxPortalNum)
+    :maxPortalNum(initData.maxPortalNum),
+    portalMode(initData.portalMode),
+    portalRecursionDepth(initData.portalRecursionDepth),
+    maxPortalPasses(initData.maxPortalPasses),
+    jobSystem(std::make_unique<LJobSystem>(initData.jobWorkersNum)),
+    bReuseCommandBuffers(initData.bReuseCommandBuffers),
+    bAdaptivePortalResolution(initData.bAdaptivePortalResolution)
 {
     if (thisPtr)
     {
         RAISE_VK_ERROR("LRenderer is a singleton object, can't create more than 1")
     }
+
+    if (initData.portalLinks.empty())
+    {
+        for (uint32 i = 0; i + 1 < maxPortalNum; i += 2)
+        {
+            initData.portalLinks.emplace_back(i, i + 1);
+        }
+    }
+
+    portalExits.assign(maxPortalNum, invalidIndex);
+    for (const auto& [portal1, portal2] : initData.portalLinks)
+    {
+        if (portal1 >= maxPortalNum || portal2 >= maxPortalNum || portal1 == portal2 ||
+            portalExits[portal1] != invalidIndex || portalExits[portal2] != invalidIndex)
+        {
+            RAISE_VK_ERROR("Portal links must pair two different portals below maxPortalNum, a portal can't have more than 1 link")
+        }
+
+        portalExits[portal1] = portal2;
+        portalExits[portal2] = portal1;
+    }
     
     thisPtr = this;
     
     this->window = window.get()->getWindow();
     specs = window.get()->getWindowSpecs();
 
-    texturesInitData.reserve(initData.textures.size());
+    for (const auto& [primitiveName, primitivesNum] : initData.primitiveCounter)
+    {
+        primitiveCounterInitData[LName(primitiveName)] = primitivesNum;
+    }
 
+    textureNames.reserve(initData.textures.size());
+    for (const auto& texture : initData.textures)
     {
-        uint32 textureId = 0;
-        for (const auto& texture : initData.textures)
+        LName textureName(texture);
+        if (textureName.getId() >= textureIndices.size())
         {
-            texturesInitData[texture] = textureId++;
+            textureIndices.resize(textureName.getId() + 1, invalidIndex);
         }
+        textureIndices[textureName.getId()] = static_cast<uint32>(textureNames.size());
+        textureNames.push_back(textureName);
     }
 
     glfwSetWindowUserPointer(this->window, this);
@@ -68,6 +103,8 @@ LRenderer::~LRenderer()
 
 void LRenderer::init()
 {
+    buildViewTree();
+
     HANDLE_VK_ERROR(createInstance())
     HANDLE_VK_ERROR(setupDebugMessenger())
     HANDLE_VK_ERROR(createSurface())
@@ -81,10 +118,12 @@ void LRenderer::init()
     
     mainPass = std::make_unique<RenderPass>(logicalDevice, swapChainImageFormat, findDepthFormat(), true);
     HANDLE_VK_ERROR(createDescriptorSetLayout())
+    HANDLE_VK_ERROR(createCullPipeline())
 
     GraphicsPipelineParams mainPipelineParams;
     mainPipelineParams.bInstanced = true;
     mainPipelineParams.polygonMode = VkPolygonMode::VK_POLYGON_MODE_FILL;
+    mainPipelineParams.stencilUsage = portalMode == PortalMode::Stencil ? StencilUsage::Test : StencilUsage::None;
 
 
     HANDLE_VK_ERROR(createGraphicsPipeline(mainPipelineParams, graphicsPipelineInstanced, mainPass->getRenderPass()))
@@ -92,6 +131,25 @@ void LRenderer::init()
     mainPipelineParams.bInstanced = false;
     HANDLE_VK_ERROR(createGraphicsPipeline(mainPipelineParams, graphicsPipelineRegular, mainPass->getRenderPass()))
 
+    mainPipelineParams.bBatched = true;
+    HANDLE_VK_ERROR(createGraphicsPipeline(mainPipelineParams, graphicsPipelineBatched, mainPass->getRenderPass()))
+
+    if (portalMode == PortalMode::Stencil && maxPortalNum > 0)
+    {
+        GraphicsPipelineParams portalPipelineParams;
+        portalPipelineParams.bInstanced = false;
+        portalPipelineParams.polygonMode = VkPolygonMode::VK_POLYGON_MODE_FILL;
+
+        portalPipelineParams.stencilUsage = StencilUsage::PortalMask;
+        HANDLE_VK_ERROR(createGraphicsPipeline(portalPipelineParams, graphicsPipelinePortalMask, mainPass->getRenderPass()))
+
+        portalPipelineParams.stencilUsage = StencilUsage::PortalDepthReset;
+        HANDLE_VK_ERROR(createGraphicsPipeline(portalPipelineParams, graphicsPipelinePortalDepthReset, mainPass->getRenderPass()))
+
+        portalPipelineParams.stencilUsage = StencilUsage::PortalFallback;
+        HANDLE_VK_ERROR(createGraphicsPipeline(portalPipelineParams, graphicsPipelinePortalFallback, mainPass->getRenderPass()))
+    }
+
         //DEBUG_CODE(
         //    GraphicsPipelineParams debugPipelineParams;
         //    debugPipelineParams.polygonMode = VkPolygonMode::VK_POLYGON_MODE_LINE;
@@ -102,34 +160,36 @@ void LRenderer::init()
 
     createFramebuffers(swapChainRt.get(), swapChainExtent, swapChainSize, mainPass->getRenderPass());
 
-    for (uint32 i = 0; i < maxPortalNum; ++i)
+    if (maxPortalNum > 0)
     {
-        auto portalPass = std::make_unique<RenderPass>(logicalDevice, swapChainImageFormat, findDepthFormat(), false);
-        HANDLE_VK_ERROR(createPortalRenderTarget())
+        HANDLE_VK_ERROR(createPortalFallbackImage())
+        createTextureSampler(portalSampler, 0);
+    }
 
-        GraphicsPipelineParams mainPipelineParams;
-        mainPipelineParams.bInstanced = true;
-        mainPipelineParams.polygonMode = VkPolygonMode::VK_POLYGON_MODE_FILL;
-        HANDLE_VK_ERROR(createGraphicsPipeline(mainPipelineParams, graphicsPipelineInstancedPortal, portalPass->getRenderPass()))
+    // stencil portals are drawn into the main framebuffer
+    if (portalMode == PortalMode::Offscreen && maxPortalNum > 0)
+    {
+        portalPass = std::make_unique<RenderPass>(logicalDevice, swapChainImageFormat, findDepthFormat(), false);
 
-        mainPipelineParams.bInstanced = false;
-        HANDLE_VK_ERROR(createGraphicsPipeline(mainPipelineParams, graphicsPipelineRegularPortal, portalPass->getRenderPass()))
-        createFramebuffers(portalsRt[i].get(), swapChainExtent, maxFramesInFlight, portalPass->getRenderPass());
+        GraphicsPipelineParams portalPipelineParams;
+        portalPipelineParams.bInstanced = true;
+        portalPipelineParams.polygonMode = VkPolygonMode::VK_POLYGON_MODE_FILL;
+        HANDLE_VK_ERROR(createGraphicsPipeline(portalPipelineParams, graphicsPipelineInstancedPortal, portalPass->getRenderPass()))
 
-        portalPasses.emplace_back(std::move(portalPass));
-    }
+        portalPipelineParams.bInstanced = false;
+        HANDLE_VK_ERROR(createGraphicsPipeline(portalPipelineParams, graphicsPipelineRegularPortal, portalPass->getRenderPass()))
 
-    if (maxPortalNum > 0)
-    {
-        createTextureSampler(portalSampler, 0);
+        createPortalTargetPools();
     }
 
     initStaticDataTextures();
     createInstancesStorageBuffers();
+    createBatchBuffer(batchInitialCapacity);
+    createViewBuffer();
 
     HANDLE_VK_ERROR(createDescriptorPool())
     HANDLE_VK_ERROR(createDescriptorSets())
-    HANDLE_VK_ERROR(createCommandBuffers())
+    HANDLE_VK_ERROR(createPassCommandPools())
     HANDLE_VK_ERROR(createSyncObjects())
 }
 
@@ -137,9 +197,14 @@ void LRenderer::cleanup()
 {
     swapChainRt.reset();
 
-    for (auto& portalRt : portalsRt)
+    for (PortalTargetPool& pool : portalTargetPools)
+    {
+        pool.targets.clear();
+    }
+    if (maxPortalNum > 0)
     {
-        portalRt.reset();
+        vkDestroyImageView(logicalDevice, portalFallbackImage.imageView, nullptr);
+        vmaDestroyImage(allocator, portalFallbackImage.image, portalFallbackImage.allocation);
     }
 
     for (auto& [_, sampler] : textureSamplers)
@@ -162,14 +227,18 @@ void LRenderer::cleanup()
 
     vkDestroyPipeline(logicalDevice, graphicsPipelineInstanced, nullptr);
     vkDestroyPipeline(logicalDevice, graphicsPipelineRegular, nullptr);
+    vkDestroyPipeline(logicalDevice, graphicsPipelineBatched, nullptr);
+    vkDestroyPipeline(logicalDevice, graphicsPipelinePortalMask, nullptr);
+    vkDestroyPipeline(logicalDevice, graphicsPipelinePortalDepthReset, nullptr);
+    vkDestroyPipeline(logicalDevice, graphicsPipelinePortalFallback, nullptr);
     vkDestroyPipelineLayout(logicalDevice, pipelineLayout, nullptr);
 
+    vkDestroyPipeline(logicalDevice, cullPipeline, nullptr);
+    vkDestroyPipelineLayout(logicalDevice, cullPipelineLayout, nullptr);
+
     mainPass.reset();
 
-    for (auto& portalPass : portalPasses)
-    {
-        portalPass.reset();
-    }
+    portalPass.reset();
     
     for (uint32 i = 0; i < maxFramesInFlight; ++i)
     {
@@ -178,15 +247,32 @@ void LRenderer::cleanup()
         vkDestroyFence(logicalDevice, inFlightFences[i], nullptr);
     }
     
+    for (auto& framePools : passCommandPools)
+    {
+        for (auto& passPool : framePools)
+        {
+            vkDestroyCommandPool(logicalDevice, passPool.pool, nullptr);
+        }
+    }
+
     vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
 
-    for (auto& [buffer, allocation] : primitivesData)
+    for (auto& primitiveData : primitivesData)
     {
-        vmaDestroyBuffer(allocator, buffer, allocation);
+        vmaDestroyBuffer(allocator, primitiveData.buffer, primitiveData.memory);
+    }
+
+    vmaDestroyBuffer(allocator, drawData.buffer, drawData.memory);
+    vmaDestroyBuffer(allocator, batchData.buffer, batchData.memory);
+    vmaDestroyBuffer(allocator, viewBuffer.buffer, viewBuffer.memory);
+    vmaDestroyBuffer(allocator, geometryArena.vertexBuffer, geometryArena.vertexMemory);
+    vmaDestroyBuffer(allocator, geometryArena.indexBuffer, geometryArena.indexMemory);
+
+    for (auto& retiredBuffer : retiredBuffers)
+    {
+        vmaDestroyBuffer(allocator, retiredBuffer.buffer, retiredBuffer.memory);
     }
 
-    vmaUnmapMemory(allocator, stagingBuffer.memory);
-    vmaDestroyBuffer(allocator, stagingBuffer.buffer, stagingBuffer.memory);
     vmaDestroyAllocator(allocator);
 
     vkDestroyDevice(logicalDevice, nullptr);
@@ -276,6 +362,87 @@ glm::mat4 viewWorldToLocal(const glm::mat4& view)
     return res;
 }
 
+// normalized left, right, bottom, top, near, far planes, xyz - normal pointing inside, w - distance.
+// Side planes pass through the ndc rect, the whole screen by default
+std::array<glm::vec4, 6> extractFrustumPlanes(const glm::mat4& projView, const glm::vec2& ndcMin = glm::vec2(-1.0f), const glm::vec2& ndcMax = glm::vec2(1.0f))
+{
+    const glm::vec4 row0 = glm::vec4(projView[0][0], projView[1][0], projView[2][0], projView[3][0]);
+    const glm::vec4 row1 = glm::vec4(projView[0][1], projView[1][1], projView[2][1], projView[3][1]);
+    const glm::vec4 row2 = glm::vec4(projView[0][2], projView[1][2], projView[2][2], projView[3][2]);
+    const glm::vec4 row3 = glm::vec4(projView[0][3], projView[1][3], projView[2][3], projView[3][3]);
+
+    // depth is in [0, 1] range, so the near plane is row2 alone
+    std::array<glm::vec4, 6> planes = { row0 - ndcMin.x * row3, ndcMax.x * row3 - row0, row1 - ndcMin.y * row3, ndcMax.y * row3 - row1, row2, row3 - row2 };
+    for (glm::vec4& plane : planes)
+    {
+        plane /= glm::length(glm::vec3(plane));
+    }
+    return planes;
+}
+
+bool hasStencilComponent(VkFormat format)
+{
+    return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
+}
+
+std::array<glm::vec3, 8> computeBoxCorners(const LMeshBounds& bounds, const glm::mat4& model)
+{
+    std::array<glm::vec3, 8> corners;
+    for (uint32 i = 0; i < corners.size(); ++i)
+    {
+        const glm::vec3 local((i & 1) ? bounds.aabbMax.x : bounds.aabbMin.x,
+            (i & 2) ? bounds.aabbMax.y : bounds.aabbMin.y,
+            (i & 4) ? bounds.aabbMax.z : bounds.aabbMin.z);
+        corners[i] = glm::vec3(model * glm::vec4(local, 1.0f));
+    }
+    return corners;
+}
+
+// plane of a quad mesh in world space, the normal is the thinnest axis of its box. xyz - normal, w - distance
+glm::vec4 computeQuadPlane(const LMeshBounds& bounds, const glm::mat4& model)
+{
+    const glm::vec3 size = bounds.aabbMax - bounds.aabbMin;
+    glm::vec3 localNormal(0.0f);
+    localNormal[size.x <= size.y && size.x <= size.z ? 0 : (size.y <= size.z ? 1 : 2)] = 1.0f;
+
+    const glm::vec3 normal = glm::normalize(glm::transpose(glm::inverse(glm::mat3(model))) * localNormal);
+    const glm::vec3 point = glm::vec3(model * glm::vec4((bounds.aabbMin + bounds.aabbMax) * 0.5f, 1.0f));
+    return glm::vec4(normal, -glm::dot(normal, point));
+}
+
+// Lengyel's oblique frustum for [0, 1] depth. clipPlane is in view space, its positive side is kept.
+// The far plane is tilted to pass through the frustum corner opposite to the clip plane
+glm::mat4 computeObliqueProjection(const glm::mat4& projection, const glm::vec4& clipPlane)
+{
+    const glm::mat4 inverseProjection = glm::inverse(projection);
+    const glm::vec4 clipSpacePlane = glm::transpose(inverseProjection) * clipPlane;
+    const glm::vec4 corner = inverseProjection * glm::vec4(glm::sign(clipSpacePlane.x), glm::sign(clipSpacePlane.y), 1.0f, 1.0f);
+
+    const glm::vec4 row3 = glm::vec4(projection[0][3], projection[1][3], projection[2][3], projection[3][3]);
+    const glm::vec4 row2 = clipPlane * (glm::dot(row3, corner) / glm::dot(clipPlane, corner));
+
+    glm::mat4 oblique = projection;
+    for (int32 column = 0; column < 4; ++column)
+    {
+        oblique[column][2] = row2[column];
+    }
+    return oblique;
+}
+
+// FNV-1a over the bytes of the value, only for trivially copyable types without padding
+template<typename T>
+uint64 hashCombine(uint64 hash, const T& value)
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    const uint8* bytes = reinterpret_cast<const uint8*>(&value);
+    for (size_t i = 0; i < sizeof(T); ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
 glm::mat4 resetScale(const glm::mat4& matrix)
 {
     glm::vec3 translation = glm::vec3(matrix[3]);
@@ -292,285 +459,619 @@ glm::mat4 resetScale(const glm::mat4& matrix)
     return newMatrix;
 }
 
-void LRenderer::doPortalPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, 
-    const std::unique_ptr<RenderPass>& portalPass, uint32 portal1Ind, uint32 portal2Ind)
+glm::mat4 LRenderer::computePortalViewer(uint32 portal1Ind, uint32 portal2Ind, const glm::mat4& viewerModel)
 {
-    glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
-
-    std::shared_ptr<LG::LPortal> portalIn = portals[portal1Ind].lock();
-    std::shared_ptr<LG::LPortal> portalOut = portals[portal2Ind].lock();
+    LG::LPortal* portalIn = getPortal(portal1Ind);
+    LG::LPortal* portalOut = getPortal(portal2Ind);
 
     glm::mat4 portalInMat = portalIn->getModelMatrix();
     glm::mat4 portalOutMat = portalOut->getModelMatrix();
 
-    glm::mat4 playerRelativeToPortalIn = glm::inverse(portalInMat) * playerModel;
+    glm::mat4 viewerRelativeToPortalIn = glm::inverse(portalInMat) * viewerModel;
     glm::mat4 rotationMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), { 0.0f,0.0f,1.0f });
-    glm::mat4 rotatedRelativeToPortalIn = rotationMatrix * playerRelativeToPortalIn;
+    glm::mat4 rotatedRelativeToPortalIn = rotationMatrix * viewerRelativeToPortalIn;
 
-    glm::mat4 playerWorldFromPortalOut = portalOutMat * rotatedRelativeToPortalIn;
+    return portalOutMat * rotatedRelativeToPortalIn;
+}
 
+glm::mat4 LRenderer::computeViewerView(const glm::mat4& viewerModel) const
+{
     glm::mat4 cameraMatrixRelativeToPlayer = glm::mat4(1.0f);
     cameraMatrixRelativeToPlayer = glm::translate(cameraMatrixRelativeToPlayer, cameraPositionToPlayer);
     cameraMatrixRelativeToPlayer *= glm::mat4_cast(playerOrientation);
 
-    glm::mat4 virtualView = glm::inverse(resetScale(playerWorldFromPortalOut) * cameraMatrixRelativeToPlayer);
-    setView(virtualView);
-
-    updateProjView();
-    portalPass->beginPass(commandBuffer, framebuffer, swapChainExtent);
-    doMainPass(commandBuffer, framebuffer, false);
-    portalPass->endPass(commandBuffer);
+    return glm::inverse(resetScale(viewerModel) * cameraMatrixRelativeToPlayer);
 }
 
-void LRenderer::doMainPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, bool bSwitchRenderPass)
+glm::mat4 LRenderer::computePortalProjection(uint32 exitPortalIndex, const glm::mat4& portalView)
 {
-    // TODO: Ideally this thing should be incapsulated inside RenderPass->render(), but there is some work to do...
-    if (bSwitchRenderPass)
+    const LG::LPortal* portalOut = getPortal(exitPortalIndex);
+    if (!portalOut)
     {
-        mainPass->beginPass(commandBuffer, framebuffer, swapChainExtent);
+        return projection;
     }
-    auto drawStaticInstancedMeshes = [this, commandBuffer, bSwitchRenderPass]()
-        {
-            uint32 instanceArrayNum = 0;
-            for (const auto& [typeName, primitives] : staticPreloadedInstancedMeshes)
-            {
-                bool bIsPortal = typeName == "LPortal";
-                // TODO: actually here we should only ignore current portal
-                if (!bSwitchRenderPass && bIsPortal)
-                {
-                    // just skip for now
-                }
 
-                else
-                {
-                    const auto& memoryBuffer = RenderComponentBuilder::getMemoryBuffer(typeName);
-                    VkBuffer vertexBuffers[] = { memoryBuffer.vertexBuffer };
-                    VkDeviceSize offsets[] = { 0 };
+    const glm::vec4 worldPlane = computeQuadPlane(RenderComponentBuilder::getMeshBounds(portalOut->getMeshName()), portalOut->getModelMatrix());
+    glm::vec4 viewPlane = glm::transpose(glm::inverse(portalView)) * worldPlane;
 
-                    auto indicesCount = primitives[0].lock()->getIndexBuffer().size();
-                    auto instancesCount = primitives.size();
+    // the camera is at the origin of the view space, the side of the portal it's on is clipped
+    if (viewPlane.w > 0.0f)
+    {
+        viewPlane = -viewPlane;
+    }
 
-                    PushConstants projViewConstants =
-                    {
-                        .genericMatrix = projView,
-                        .width = static_cast<float>(swapChainExtent.width),
-                        .height = static_cast<float>(swapChainExtent.height),
-                    };
+    if (viewPlane.w > -obliquePlaneMinDistance)
+    {
+        return projection;
+    }
 
-                    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &projViewConstants);
+    return computeObliqueProjection(projection, viewPlane);
+}
 
-                    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame * staticPreloadedInstancedMeshes.size() + instanceArrayNum], 0, nullptr);
+void LRenderer::recordPass(RecordedFrame& recordedFrame, uint32 viewIndex, VkRenderPass renderPass, VkFramebuffer framebuffer)
+{
+    ZoneScoped;
 
-                    vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-                    vkCmdBindIndexBuffer(commandBuffer, memoryBuffer.indexBuffer, 0, VK_INDEX_TYPE_UINT16);
-                    vkCmdDrawIndexed(commandBuffer, indicesCount, instancesCount, 0, 0, 0);
-                }
+    const PassCommandBuffer passCommandBuffer = acquirePassCommandBuffer();
+    VkCommandBuffer commandBuffer = passCommandBuffer.commandBuffer;
 
-                ++instanceArrayNum;
-            }
-        };
+    VkCommandBufferInheritanceInfo inheritanceInfo{};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = renderPass;
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = framebuffer;
 
-    auto drawMeshes = [this, commandBuffer, bSwitchRenderPass](std::vector<std::weak_ptr<LG::LGraphicsComponent>>& meshes)
-        {
-            for (auto it = meshes.begin(); it != meshes.end(); ++it)
-            {
-                if (!it->expired())
-                {
-                    LG::LGraphicsComponent& mesh = *it->lock();
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
 
-                    PushConstants projViewConstants =
-                    {
-                        .genericMatrix = projView * mesh.getModelMatrix(),
-                        .width = static_cast<float>(swapChainExtent.width),
-                        .height = static_cast<float>(swapChainExtent.height),
-                    };
+    HANDLE_VK_ERROR(vkBeginCommandBuffer(commandBuffer, &beginInfo))
 
-                    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &projViewConstants);
+    // the buffer may be submitted again with the cached primary one, so it isn't one time submit.
+    // Dynamic state isn't inherited from the primary buffer
+    VkViewport viewport{};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = viewTable[viewIndex].extent.x;
+    viewport.height = viewTable[viewIndex].extent.y;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
 
-                    const auto& memoryBuffer = RenderComponentBuilder::getMemoryBuffer(mesh.getTypeName());
-                    VkBuffer vertexBuffers[] = { memoryBuffer.vertexBuffer };
-                    VkDeviceSize offsets[] = { 0 };
+    // the viewport covers the whole target, so the portal view matches the normalized fragment coordinates it's sampled at
+    vkCmdSetScissor(commandBuffer, 0, 1, &viewRects[viewIndex]);
 
-                    vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-                    vkCmdBindIndexBuffer(commandBuffer, memoryBuffer.indexBuffer, 0, VK_INDEX_TYPE_UINT16);
-                    vkCmdDrawIndexed(commandBuffer, mesh.getIndicesCount(), 1, 0, 0, 0);
-                }
-                else
-                {
-                    it = meshes.erase(it);
-                }
-            }
-        };
+    GraphicsBindState& bindState = passBindStates[viewIndex];
+    bindState = {};
 
+    if (portalMode == PortalMode::Stencil)
     {
-        ZoneScopedN("Instance pass");
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipelineInstanced);
-        drawStaticInstancedMeshes();
+        // draws of the view pass only inside the mask its parent view left in the stencil
+        vkCmdSetStencilReference(commandBuffer, VK_STENCIL_FACE_FRONT_AND_BACK, viewNodes[viewIndex].stencilRef);
+
+        if (viewIndex != 0)
+        {
+            resetPortalDepth(commandBuffer, viewIndex, bindState);
+        }
     }
 
+    doMainPass(commandBuffer, viewIndex, bindState);
+
+    if (portalMode == PortalMode::Stencil)
     {
-        ZoneScopedN("Regular pass");
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipelineRegular);
-        drawMeshes(primitiveMeshes);
+        drawPortalFallbacks(commandBuffer, viewIndex, bindState);
+        drawPortalMasks(commandBuffer, viewIndex, bindState);
     }
 
-    //DEBUG_CODE(
-    //    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, debugGraphicsPipeline);
-    //    drawMeshes(debugMeshes);
-    //          )
+    HANDLE_VK_ERROR(vkEndCommandBuffer(commandBuffer))
+    recordedFrame.passes[viewIndex] = passCommandBuffer;
+}
 
-    if (bSwitchRenderPass)
+void LRenderer::resetPortalDepth(VkCommandBuffer commandBuffer, uint32 viewIndex, GraphicsBindState& bindState)
+{
+    const ViewNode& node = viewNodes[viewIndex];
+
+    const LG::LPortal* portal = getPortal(node.portalIndex);
+    if (!portal)
     {
-        mainPass->endPass(commandBuffer);
+        return;
     }
+
+    bindDrawState(commandBuffer, bindState, graphicsPipelinePortalDepthReset);
+
+    // the quad is where the parent view saw it, its depth is the one the parent view left there
+    PushConstants portalConstants =
+    {
+        .genericMatrix = portal->getModelMatrix(),
+        .viewIndex = node.parent,
+    };
+
+    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &portalConstants);
+    bindState.bViewConstantsPushed = false;
+
+    const MeshRange& meshRange = RenderComponentBuilder::getMeshRange(portal->getMeshName());
+    vkCmdDrawIndexed(commandBuffer, meshRange.indicesCount, 1, meshRange.firstIndex, meshRange.vertexOffset, 0);
 }
 
-bool LRenderer::checkValidationLayerSupport() const
+void LRenderer::drawPortalFallbacks(VkCommandBuffer commandBuffer, uint32 viewIndex, GraphicsBindState& bindState)
 {
-    uint32 layerCount;
-    vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+    const ViewNode& node = viewNodes[viewIndex];
 
-    std::vector<VkLayerProperties> availableLayers(layerCount);
-    vkEnumerateInstanceLayerProperties(&layerCount, availableLayers.data());
+    // the exit portal is the near plane of the view
+    const uint32 exitPortalIndex = viewIndex != 0 ? getExitPortalIndex(node.portalIndex) : invalidIndex;
 
-    for (const char* layerName : validationLayers) 
+    for (uint32 portalIndex = 0; portalIndex < maxPortalNum; ++portalIndex)
     {
-        bool layerFound = false;
+        const LG::LPortal* portal = getPortal(portalIndex);
+        if (!portal || portalIndex == exitPortalIndex)
+        {
+            continue;
+        }
 
-        for (const auto& layerProperties : availableLayers) 
+        bool bHasView = false;
+        for (uint32 childIndex = node.firstChild; childIndex < node.firstChild + node.childrenNum; ++childIndex)
         {
-            if (strcmp(layerName, layerProperties.layerName) == 0) 
-            {
-                layerFound = true;
-                break;
-            }
+            bHasView |= viewNodes[childIndex].portalIndex == portalIndex && isViewActive(childIndex);
         }
 
-        if (!layerFound) 
+        if (bHasView)
         {
-            return false;
+            continue;
         }
-    }
 
-    return true;
+        // the stencil reference is still the one of the view
+        bindDrawState(commandBuffer, bindState, graphicsPipelinePortalFallback);
+        drawRegularMesh(commandBuffer, bindState, *portal, viewIndex);
+    }
 }
 
-std::vector<const char*> LRenderer::getRequiredExtensions() const
+void LRenderer::drawPortalMasks(VkCommandBuffer commandBuffer, uint32 viewIndex, GraphicsBindState& bindState)
 {
-    uint32 glfwExtensionCount = 0;
-    const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    const ViewNode& node = viewNodes[viewIndex];
 
-    if (enableValidationLayers)
+    for (uint32 childIndex = node.firstChild; childIndex < node.firstChild + node.childrenNum; ++childIndex)
     {
-        extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
-    }
+        // slots without a portal are never active
+        if (!isViewActive(childIndex))
+        {
+            continue;
+        }
 
-    return extensions;
-}
+        const ViewNode& child = viewNodes[childIndex];
 
-VkResult LRenderer::setupDebugMessenger()
-{
-    if (!enableValidationLayers)
-    {
-        return VK_SUCCESS;
-    }
+        const LG::LPortal* portal = getPortal(child.portalIndex);
+        if (!portal)
+        {
+            continue;
+        }
 
-    VkDebugUtilsMessengerCreateInfoEXT createInfo;
-    populateDebugMessengerCreateInfo(createInfo);
+        bindDrawState(commandBuffer, bindState, graphicsPipelinePortalMask);
 
-    createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)&createInfo;
+        // the digits of this view are compared, the digit of the child is written where the portal passes the depth test
+        vkCmdSetStencilCompareMask(commandBuffer, VK_STENCIL_FACE_FRONT_AND_BACK, child.stencilCompareMask);
+        vkCmdSetStencilWriteMask(commandBuffer, VK_STENCIL_FACE_FRONT_AND_BACK, child.stencilWriteMask);
+        vkCmdSetStencilReference(commandBuffer, VK_STENCIL_FACE_FRONT_AND_BACK, child.stencilRef);
 
-    return CreateDebugUtilsMessengerEXT(instance, &createInfo, nullptr, &debugMessenger);
-}
+        PushConstants portalConstants =
+        {
+            .genericMatrix = portal->getModelMatrix(),
+            .viewIndex = viewIndex,
+        };
 
-VkResult LRenderer::CreateDebugUtilsMessengerEXT(VkInstance instanceIn, const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDebugUtilsMessengerEXT* pDebugMessenger)
-{
-    auto func = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
-    return func ? func(instanceIn, pCreateInfo, pAllocator, pDebugMessenger) : VK_ERROR_EXTENSION_NOT_PRESENT;
-}
+        vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &portalConstants);
+        bindState.bViewConstantsPushed = false;
 
-VKAPI_ATTR VkBool32 VKAPI_CALL LRenderer::debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, VkDebugUtilsMessageTypeFlagsEXT messageType, const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData, void* pUserData)
-{
-    LLogger::LogString(messageSeverity, true);
-    LLogger::LogString(pCallbackData->pMessage, true);
-    return VK_FALSE;
+        const MeshRange& meshRange = RenderComponentBuilder::getMeshRange(portal->getMeshName());
+        vkCmdDrawIndexed(commandBuffer, meshRange.indicesCount, 1, meshRange.firstIndex, meshRange.vertexOffset, 0);
+    }
 }
 
-void LRenderer::DestroyDebugUtilsMessengerEXT(VkInstance instanceIn, VkDebugUtilsMessengerEXT debugMessenger, const VkAllocationCallbacks* pAllocator)
+LRenderer::PassCommandBuffer LRenderer::acquirePassCommandBuffer()
 {
-    auto func = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instanceIn, "vkDestroyDebugUtilsMessengerEXT");
-    if (func) 
+    const uint32 threadIndex = jobSystem->getThreadIndex();
+    PassCommandPool& passPool = passCommandPools[currentFrame][threadIndex];
+
+    if (!passPool.freeCommandBuffers.empty())
     {
-        func(instanceIn, debugMessenger, pAllocator);
+        const VkCommandBuffer commandBuffer = passPool.freeCommandBuffers.back();
+        passPool.freeCommandBuffers.pop_back();
+        return { threadIndex, commandBuffer };
     }
-}
 
-void LRenderer::populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& createInfo)
-{
-    createInfo = {};
-    createInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
-    createInfo.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
-    createInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
-    createInfo.pfnUserCallback = debugCallback;
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = passPool.pool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    allocInfo.commandBufferCount = 1;
+
+    VkCommandBuffer commandBuffer;
+    HANDLE_VK_ERROR(vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffer))
+    return { threadIndex, commandBuffer };
 }
 
-VkResult LRenderer::createInstance()
+LRenderer::RecordedFrame& LRenderer::getRecordedFrame(uint32 imageIndex)
 {
-    VkApplicationInfo appInfo{};
-    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-    appInfo.pApplicationName = "Hello Triangle";
-    appInfo.applicationVersion = VK_MAKE_VERSION(majorApiVersion, minorApiVersion, 0);
-    appInfo.pEngineName = "No Engine";
-    appInfo.engineVersion = VK_MAKE_VERSION(majorApiVersion, minorApiVersion, 0);
-    appInfo.apiVersion = VK_MAKE_API_VERSION(0, majorApiVersion, minorApiVersion, 0);
-
-    VkInstanceCreateInfo createInfo{};
-    createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-    createInfo.pApplicationInfo = &appInfo;
-    
-    // required extension request
-    uint32_t glfwExtensionCount = 0;
-    auto extensions = getRequiredExtensions();
-    
-#ifdef __APPLE__
-    createInfo.flags = VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
-    extensions.push_back("VK_KHR_portability_enumeration");
-#endif
-    createInfo.enabledExtensionCount = extensions.size();
-    createInfo.ppEnabledExtensionNames = extensions.data();
-
-    VkDebugUtilsMessengerCreateInfoEXT debugCreateInfo{};
-    if (enableValidationLayers) 
+    std::vector<RecordedFrame>& frameRecords = recordedFrames[currentFrame];
+    if (imageIndex >= frameRecords.size())
     {
-        createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
-        createInfo.ppEnabledLayerNames = validationLayers.data();
-
-        populateDebugMessengerCreateInfo(debugCreateInfo);
-        createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)&debugCreateInfo;
+        frameRecords.resize(imageIndex + 1);
     }
-    else 
+
+    RecordedFrame& recordedFrame = frameRecords[imageIndex];
+    if (recordedFrame.commandBuffer == VK_NULL_HANDLE)
     {
-        createInfo.enabledLayerCount = 0;
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
 
-        createInfo.pNext = nullptr;
+        HANDLE_VK_ERROR(vkAllocateCommandBuffers(logicalDevice, &allocInfo, &recordedFrame.commandBuffer))
     }
 
-    return vkCreateInstance(&createInfo, nullptr, &instance);
+    return recordedFrame;
 }
 
-VkResult LRenderer::createSurface()
+uint64 LRenderer::computeFrameSignature() const
 {
-   return glfwCreateWindowSurface(instance, window, nullptr, &surface);
-}
+    ZoneScoped;
 
-VkImageView LRenderer::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32 mipLevels)
-{
-    VkImageViewCreateInfo viewInfo{};
-    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    viewInfo.image = image;
-    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    uint64 hash = 14695981039346656037ull;
+    hash = hashCombine(hash, recordedCommandsVersion);
+    hash = hashCombine(hash, swapChainExtent);
+    hash = hashCombine(hash, activeViewsMask);
+
+    // slots render the view of the portal assigned to them, offscreen ones into its pooled target
+    for (const ViewNode& node : viewNodes)
+    {
+        hash = hashCombine(hash, node.portalIndex);
+    }
+    for (const PortalTargetHandle& handle : viewTargets)
+    {
+        hash = hashCombine(hash, handle);
+    }
+    for (const VkRect2D& rect : viewRects)
+    {
+        hash = hashCombine(hash, rect);
+    }
+    hash = hashCombine(hash, static_cast<uint32>(primitivesData.size()));
+    hash = hashCombine(hash, drawData.visibleListNum);
+
+    // the commands of the cull pass are written by vkCmdUpdateBuffer of the primary buffer
+    for (const ObjectDataBuffer& primitiveData : primitivesData)
+    {
+        hash = hashCombine(hash, primitiveData.instances.empty());
+        hash = hashCombine(hash, primitiveData.drawBase);
+        hash = hashCombine(hash, primitiveData.bIsPortal);
+        hash = hashCombine(hash, primitiveData.boundingSphere);
+        hash = hashCombine(hash, RenderComponentBuilder::getMeshRange(primitiveData.meshName));
+    }
+
+    // stencil masks of the portals push their model matrices
+    if (portalMode == PortalMode::Stencil)
+    {
+        for (const LSlotMapHandle& portalHandle : portals)
+        {
+            if (LG::LGraphicsComponent* const* portalPtr = objects.get(portalHandle))
+            {
+                hash = hashCombine(hash, (*portalPtr)->getModelMatrix());
+                hash = hashCombine(hash, RenderComponentBuilder::getMeshRange((*portalPtr)->getMeshName()));
+            }
+        }
+    }
+
+    // keys hold the pass and the order of the draws, packets what is drawn
+    const uint32 viewsNum = getViewsNum();
+    for (const LDrawQueue::Item& item : drawQueue.getItems())
+    {
+        hash = hashCombine(hash, item.key);
+
+        const DrawPacket& packet = drawPackets[item.payload];
+        if (packet.pipeline == DrawPipeline::Batched)
+        {
+            const uint32 pass = LDrawKey::getPass(item.key);
+            const uint32 viewIndex = pass == viewsNum - 1 ? 0 : pass + 1;
+            const RegularBatch& batch = regularBatches[viewIndex][packet.index];
+            hash = hashCombine(hash, RenderComponentBuilder::getMeshRange(batch.meshName));
+            hash = hashCombine(hash, batch.firstInstance);
+            hash = hashCombine(hash, batch.instancesNum);
+        }
+        else if (packet.pipeline == DrawPipeline::Regular)
+        {
+            const LG::LGraphicsComponent& mesh = *regularMeshesFrame[packet.index];
+            hash = hashCombine(hash, RenderComponentBuilder::getMeshRange(mesh.getMeshName()));
+            hash = hashCombine(hash, mesh.getModelMatrix());
+        }
+    }
+
+    return hash;
+}
+
+void LRenderer::doMainPass(VkCommandBuffer commandBuffer, uint32 viewIndex, GraphicsBindState& bindState)
+{
+    {
+        ZoneScopedN("Draw queue");
+
+        const std::vector<LDrawQueue::Item>& drawItems = drawQueue.getItems();
+        const auto [drawBegin, drawEnd] = passDrawRanges[viewIndex];
+
+        for (uint32 i = drawBegin; i < drawEnd; ++i)
+        {
+            const DrawPacket& packet = drawPackets[drawItems[i].payload];
+
+            switch (packet.pipeline)
+            {
+            case DrawPipeline::Instanced:
+            {
+                bindDrawState(commandBuffer, bindState, graphicsPipelineInstanced);
+                pushViewConstants(commandBuffer, bindState, viewIndex);
+
+                // a command per bucket, instance counts are written by cullInstances. Skipped portals have zero instances
+                const uint32 bucketsNum = static_cast<uint32>(primitivesData.size());
+                VkDeviceSize commandOffset = currentFrame * drawData.regionSize + viewIndex * bucketsNum * sizeof(VkDrawIndexedIndirectCommand);
+                vkCmdDrawIndexedIndirect(commandBuffer, drawData.buffer, commandOffset, bucketsNum, sizeof(VkDrawIndexedIndirectCommand));
+                break;
+            }
+            case DrawPipeline::Batched:
+            {
+                bindDrawState(commandBuffer, bindState, graphicsPipelineBatched);
+                pushViewConstants(commandBuffer, bindState, viewIndex);
+
+                const RegularBatch& batch = regularBatches[viewIndex][packet.index];
+                const MeshRange& meshRange = RenderComponentBuilder::getMeshRange(batch.meshName);
+                vkCmdDrawIndexed(commandBuffer, meshRange.indicesCount, batch.instancesNum, meshRange.firstIndex, meshRange.vertexOffset, batch.firstInstance);
+                break;
+            }
+            case DrawPipeline::Regular:
+            {
+                // meshes opted out of batching keep a draw call with their own push constants
+                bindDrawState(commandBuffer, bindState, graphicsPipelineRegular);
+
+                drawRegularMesh(commandBuffer, bindState, *regularMeshesFrame[packet.index], viewIndex);
+                break;
+            }
+            }
+        }
+    }
+
+    //DEBUG_CODE(
+    //    bindDrawState(commandBuffer, bindState, debugGraphicsPipeline);
+    //    for (const LSlotMapHandle& handle : debugMeshes)
+    //    {
+    //        if (LG::LGraphicsComponent* const* meshPtr = objects.get(handle))
+    //        {
+    //            drawRegularMesh(commandBuffer, bindState, **meshPtr, viewIndex);
+    //        }
+    //    }
+    //          )
+}
+
+void LRenderer::drawRegularMesh(VkCommandBuffer commandBuffer, GraphicsBindState& bindState, const LG::LGraphicsComponent& mesh, uint32 viewIndex)
+{
+    PushConstants meshConstants =
+    {
+        .genericMatrix = mesh.getModelMatrix(),
+        .viewIndex = viewIndex,
+    };
+
+    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &meshConstants);
+    bindState.bViewConstantsPushed = false;
+
+    const MeshRange& meshRange = RenderComponentBuilder::getMeshRange(mesh.getMeshName());
+    vkCmdDrawIndexed(commandBuffer, meshRange.indicesCount, 1, meshRange.firstIndex, meshRange.vertexOffset, 0);
+}
+
+void LRenderer::bindDrawState(VkCommandBuffer commandBuffer, GraphicsBindState& bindState, VkPipeline pipeline)
+{
+    if (bindState.pipeline != pipeline)
+    {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        bindState.pipeline = pipeline;
+        ++bindState.issuedBinds;
+    }
+    else
+    {
+        ++bindState.skippedBinds;
+    }
+
+    // every pipeline has the same layout, so the set stays bound across pipeline switches
+    if (bindState.descriptorSet != descriptorSets[currentFrame])
+    {
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame], 0, nullptr);
+        bindState.descriptorSet = descriptorSets[currentFrame];
+        ++bindState.issuedBinds;
+    }
+    else
+    {
+        ++bindState.skippedBinds;
+    }
+
+    // every mesh lives in the geometry arena, it's created with the first uploaded mesh
+    if (geometryArena.vertexBuffer == VK_NULL_HANDLE)
+    {
+        return;
+    }
+
+    if (bindState.vertexBuffer != geometryArena.vertexBuffer || bindState.indexBuffer != geometryArena.indexBuffer)
+    {
+        VkBuffer vertexBuffers[] = { geometryArena.vertexBuffer };
+        VkDeviceSize offsets[] = { 0 };
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+        vkCmdBindIndexBuffer(commandBuffer, geometryArena.indexBuffer, 0, VK_INDEX_TYPE_UINT16);
+
+        bindState.vertexBuffer = geometryArena.vertexBuffer;
+        bindState.indexBuffer = geometryArena.indexBuffer;
+        bindState.issuedBinds += 2;
+    }
+    else
+    {
+        bindState.skippedBinds += 2;
+    }
+}
+
+void LRenderer::pushViewConstants(VkCommandBuffer commandBuffer, GraphicsBindState& bindState, uint32 viewIndex)
+{
+    if (bindState.bViewConstantsPushed)
+    {
+        return;
+    }
+
+    PushConstants viewConstants =
+    {
+        .viewIndex = viewIndex,
+    };
+
+    vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), &viewConstants);
+    bindState.bViewConstantsPushed = true;
+}
+
+bool LRenderer::checkValidationLayerSupport() const
+{
+    uint32 layerCount;
+    vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+
+    std::vector<VkLayerProperties> availableLayers(layerCount);
+    vkEnumerateInstanceLayerProperties(&layerCount, availableLayers.data());
+
+    for (const char* layerName : validationLayers) 
+    {
+        bool layerFound = false;
+
+        for (const auto& layerProperties : availableLayers) 
+        {
+            if (strcmp(layerName, layerProperties.layerName) == 0) 
+            {
+                layerFound = true;
+                break;
+            }
+        }
+
+        if (!layerFound) 
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::vector<const char*> LRenderer::getRequiredExtensions() const
+{
+    uint32 glfwExtensionCount = 0;
+    const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+
+    std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+
+    if (enableValidationLayers)
+    {
+        extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    }
+
+    return extensions;
+}
+
+VkResult LRenderer::setupDebugMessenger()
+{
+    if (!enableValidationLayers)
+    {
+        return VK_SUCCESS;
+    }
+
+    VkDebugUtilsMessengerCreateInfoEXT createInfo;
+    populateDebugMessengerCreateInfo(createInfo);
+
+    createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)&createInfo;
+
+    return CreateDebugUtilsMessengerEXT(instance, &createInfo, nullptr, &debugMessenger);
+}
+
+VkResult LRenderer::CreateDebugUtilsMessengerEXT(VkInstance instanceIn, const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDebugUtilsMessengerEXT* pDebugMessenger)
+{
+    auto func = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
+    return func ? func(instanceIn, pCreateInfo, pAllocator, pDebugMessenger) : VK_ERROR_EXTENSION_NOT_PRESENT;
+}
+
+VKAPI_ATTR VkBool32 VKAPI_CALL LRenderer::debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, VkDebugUtilsMessageTypeFlagsEXT messageType, const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData, void* pUserData)
+{
+    LLogger::LogString(messageSeverity, true);
+    LLogger::LogString(pCallbackData->pMessage, true);
+    return VK_FALSE;
+}
+
+void LRenderer::DestroyDebugUtilsMessengerEXT(VkInstance instanceIn, VkDebugUtilsMessengerEXT debugMessenger, const VkAllocationCallbacks* pAllocator)
+{
+    auto func = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instanceIn, "vkDestroyDebugUtilsMessengerEXT");
+    if (func) 
+    {
+        func(instanceIn, debugMessenger, pAllocator);
+    }
+}
+
+void LRenderer::populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& createInfo)
+{
+    createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+    createInfo.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+    createInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+    createInfo.pfnUserCallback = debugCallback;
+}
+
+VkResult LRenderer::createInstance()
+{
+    VkApplicationInfo appInfo{};
+    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    appInfo.pApplicationName = "Hello Triangle";
+    appInfo.applicationVersion = VK_MAKE_VERSION(majorApiVersion, minorApiVersion, 0);
+    appInfo.pEngineName = "No Engine";
+    appInfo.engineVersion = VK_MAKE_VERSION(majorApiVersion, minorApiVersion, 0);
+    appInfo.apiVersion = VK_MAKE_API_VERSION(0, majorApiVersion, minorApiVersion, 0);
+
+    VkInstanceCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    createInfo.pApplicationInfo = &appInfo;
+    
+    // required extension request
+    uint32_t glfwExtensionCount = 0;
+    auto extensions = getRequiredExtensions();
+    
+#ifdef __APPLE__
+    createInfo.flags = VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR;
+    extensions.push_back("VK_KHR_portability_enumeration");
+#endif
+    createInfo.enabledExtensionCount = extensions.size();
+    createInfo.ppEnabledExtensionNames = extensions.data();
+
+    VkDebugUtilsMessengerCreateInfoEXT debugCreateInfo{};
+    if (enableValidationLayers) 
+    {
+        createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
+        createInfo.ppEnabledLayerNames = validationLayers.data();
+
+        populateDebugMessengerCreateInfo(debugCreateInfo);
+        createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)&debugCreateInfo;
+    }
+    else 
+    {
+        createInfo.enabledLayerCount = 0;
+
+        createInfo.pNext = nullptr;
+    }
+
+    return vkCreateInstance(&createInfo, nullptr, &instance);
+}
+
+VkResult LRenderer::createSurface()
+{
+   return glfwCreateWindowSurface(instance, window, nullptr, &surface);
+}
+
+VkImageView LRenderer::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32 mipLevels)
+{
+    VkImageViewCreateInfo viewInfo{};
+    viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    viewInfo.image = image;
+    viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = aspectFlags;
     viewInfo.subresourceRange.baseMipLevel = 0;
@@ -583,925 +1084,2388 @@ VkImageView LRenderer::createImageView(VkImage image, VkFormat format, VkImageAs
     return imageView;
 }
 
-VkResult LRenderer::createPortalRenderTarget()
+VkResult LRenderer::createPortalRenderTarget(const VkExtent2D& extent, std::unique_ptr<RenderTarget>& renderTargetOut)
+{
+    auto portalRt = std::make_unique<RenderTarget>(logicalDevice, allocator);
+    portalRt->images.resize(1);
+
+    HANDLE_VK_ERROR(createImageInternal(extent.width, extent.height, swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+        VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        portalRt->images[0].image, portalRt->images[0].allocation, 1))
+
+    clearUndefinedImage(portalRt->images[0].image);
+
+    portalRt->images[0].imageView = createImageView(portalRt->images[0].image, swapChainImageFormat, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+    createFramebuffers(portalRt.get(), extent, 1, portalPass->getRenderPass());
+
+    renderTargetOut = std::move(portalRt);
+    return VK_SUCCESS;
+}
+
+VkResult LRenderer::createPortalFallbackImage()
+{
+    HANDLE_VK_ERROR(createImageInternal(1, 1, swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        portalFallbackImage.image, portalFallbackImage.allocation, 1))
+
+    clearUndefinedImage(portalFallbackImage.image);
+
+    portalFallbackImage.imageView = createImageView(portalFallbackImage.image, swapChainImageFormat, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+    return VK_SUCCESS;
+}
+
+void LRenderer::createPortalTargetPools()
+{
+    for (uint32 resolution = 0; resolution < portalResolutionsNum; ++resolution)
+    {
+        PortalTargetPool& pool = portalTargetPools[resolution];
+        pool.extent = { std::max(swapChainExtent.width >> resolution, 1u), std::max(swapChainExtent.height >> resolution, 1u) };
+        pool.targets.clear();
+        pool.freeTargets.clear();
+    }
+
+    portalTargets.assign(maxFramesInFlight, std::vector<PortalTargetHandle>(maxPortalNum));
+    portalResolutions.assign(maxPortalNum, invalidIndex);
+}
+
+uint32 LRenderer::choosePortalResolution(uint32 viewIndex)
+{
+    if (!bAdaptivePortalResolution)
+    {
+        return 0;
+    }
+
+    // the rect is clipped by the screen, a portal going out of the screen keeps its resolution
+    const VkRect2D& rect = viewRects[viewIndex];
+    const float screenFraction = std::max(static_cast<float>(rect.extent.width) / swapChainExtent.width,
+        static_cast<float>(rect.extent.height) / swapChainExtent.height);
+
+    const ViewNode& node = viewNodes[viewIndex];
+    const glm::vec3 cameraPosition = glm::vec3(glm::inverse(viewTable[node.parent].view)[3]);
+    const float distance = glm::distance(cameraPosition, getPortal(node.portalIndex)->getPosition());
+
+    // thresholds are scaled by the band, above 1 a finer resolution is harder to reach
+    auto pickResolution = [screenFraction, distance](float band)
+        {
+            const uint32 sizeResolution = screenFraction >= 0.5f * band ? 0 : screenFraction >= 0.25f * band ? 1 : 2;
+            const uint32 distanceResolution = distance <= portalFullResolutionDistance / band ? 0 : distance <= 2.0f * portalFullResolutionDistance / band ? 1 : 2;
+            return std::min(std::max(sizeResolution, distanceResolution), portalResolutionsNum - 1);
+        };
+
+    const uint32 resolution = pickResolution(1.0f);
+    const uint32 currentResolution = portalResolutions[node.portalIndex];
+    if (currentResolution == invalidIndex || resolution == currentResolution)
+    {
+        return resolution;
+    }
+
+    // the portal has to be past the threshold by the band, so one sitting on it doesn't switch targets every frame
+    const uint32 bandResolution = pickResolution(resolution < currentResolution ? portalResolutionHysteresis : 1.0f / portalResolutionHysteresis);
+    return std::clamp(bandResolution, std::min(resolution, currentResolution), std::max(resolution, currentResolution));
+}
+
+void LRenderer::assignPortalTarget(uint32 viewIndex)
+{
+    const uint32 portalIndex = viewNodes[viewIndex].portalIndex;
+    const uint32 resolution = portalResolutions[portalIndex] = choosePortalResolution(viewIndex);
+
+    // the fence of the frame slot is waited, its old target isn't read by anything in flight
+    PortalTargetHandle& handle = portalTargets[currentFrame][portalIndex];
+    if (handle.resolution != resolution)
+    {
+        if (handle.resolution != invalidIndex)
+        {
+            portalTargetPools[handle.resolution].freeTargets.push_back(handle.target);
+        }
+
+        PortalTargetPool& pool = portalTargetPools[resolution];
+        if (pool.freeTargets.empty())
+        {
+            pool.freeTargets.push_back(static_cast<uint32>(pool.targets.size()));
+            HANDLE_VK_ERROR(createPortalRenderTarget(pool.extent, pool.targets.emplace_back()))
+        }
+
+        handle = { resolution, pool.freeTargets.back() };
+        pool.freeTargets.pop_back();
+
+        updatePortalDescriptor(currentFrame, portalIndex);
+    }
+
+    viewTargets[viewIndex] = handle;
+
+    // the view fills its whole target, so the portal samples it at the same normalized coordinates at any resolution
+    const VkExtent2D& extent = portalTargetPools[resolution].extent;
+    VkRect2D& rect = viewRects[viewIndex];
+
+    const uint32 x0 = static_cast<uint32>(static_cast<uint64>(rect.offset.x) * extent.width / swapChainExtent.width);
+    const uint32 y0 = static_cast<uint32>(static_cast<uint64>(rect.offset.y) * extent.height / swapChainExtent.height);
+    const uint32 x1 = static_cast<uint32>((static_cast<uint64>(rect.offset.x + rect.extent.width) * extent.width + swapChainExtent.width - 1) / swapChainExtent.width);
+    const uint32 y1 = static_cast<uint32>((static_cast<uint64>(rect.offset.y + rect.extent.height) * extent.height + swapChainExtent.height - 1) / swapChainExtent.height);
+
+    rect = { { static_cast<int32>(x0), static_cast<int32>(y0) }, { std::min(x1, extent.width) - x0, std::min(y1, extent.height) - y0 } };
+    viewTable[viewIndex].extent = glm::vec2(static_cast<float>(extent.width), static_cast<float>(extent.height));
+}
+
+void LRenderer::updatePortalDescriptor(uint32 frame, uint32 portalIndex)
+{
+    const PortalTargetHandle& handle = portalTargets[frame][portalIndex];
+    VkDescriptorImageInfo imageInfo{};
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imageInfo.imageView = handle.resolution != invalidIndex ? getPortalTarget(handle)->images[0].imageView : portalFallbackImage.imageView;
+    imageInfo.sampler = portalSampler;
+
+    // textures are update after bind, recorded command buffers stay valid
+    VkWriteDescriptorSet descriptorWrite{};
+    descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrite.dstSet = descriptorSets[frame];
+    descriptorWrite.dstBinding = 1;
+    descriptorWrite.dstArrayElement = getTextureId(LName(std::format("portal{}", portalIndex + 1)));
+    descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptorWrite.descriptorCount = 1;
+    descriptorWrite.pImageInfo = &imageInfo;
+
+    vkUpdateDescriptorSets(logicalDevice, 1, &descriptorWrite, 0, nullptr);
+}
+
+VkResult LRenderer::createDescriptorSetLayout()
+{
+    const uint32 bucketsNum = static_cast<uint32>(primitiveCounterInitData.size());
+
+    // one set per frame is shared by the graphics pipelines and the cull pass, buffer arrays are indexed by the bucket
+    std::array<VkDescriptorSetLayoutBinding, 7> bindings{};
+
+    // visible lists of every view, firstInstance of a command points at the range of its bucket
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[0].descriptorCount = 1;
+    bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[1].descriptorCount = static_cast<uint32>(textureNames.size());
+    bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    // indirect commands of every bucket for every view
+    bindings[2].binding = 2;
+    bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[2].descriptorCount = 1;
+    bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    // instance entries and BVH candidates of every bucket
+    bindings[3].binding = 3;
+    bindings[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[3].descriptorCount = bucketsNum;
+    bindings[3].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    bindings[4].binding = 4;
+    bindings[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[4].descriptorCount = bucketsNum;
+    bindings[4].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    // entries of the batched regular meshes of every view
+    bindings[5].binding = 5;
+    bindings[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[5].descriptorCount = 1;
+    bindings[5].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    // matrices and frustum planes of every view
+    bindings[6].binding = 6;
+    bindings[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[6].descriptorCount = 1;
+    bindings[6].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    // textures may be rewritten while the set is bound, unused ones may stay empty
+    std::array<VkDescriptorBindingFlags, 7> bindingFlags{};
+    bindingFlags[1] = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{};
+    bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    bindingFlagsInfo.bindingCount = static_cast<uint32>(bindingFlags.size());
+    bindingFlagsInfo.pBindingFlags = bindingFlags.data();
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext = &bindingFlagsInfo;
+    layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    layoutInfo.bindingCount = static_cast<uint32>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+
+    return vkCreateDescriptorSetLayout(logicalDevice, &layoutInfo, nullptr, &descriptorSetLayout);
+}
+
+VkResult LRenderer::createGraphicsPipeline(const GraphicsPipelineParams& params, VkPipeline& graphicsPipelineOut, VkRenderPass renderPass)
+{
+    VkShaderModule vertShaderModule = params.bInstanced? createShaderModule(genericInstancedVert) :
+        params.bBatched? createShaderModule(genericBatchedVert) : createShaderModule(genericVert);
+    VkShaderModule fragShaderModule = params.stencilUsage == StencilUsage::PortalDepthReset ? createShaderModule(portalDepthResetFrag) :
+        params.stencilUsage == StencilUsage::PortalFallback ? createShaderModule(portalFallbackFrag) : createShaderModule(genericFrag);
+
+    const bool bDepthStencilOnly = params.stencilUsage == StencilUsage::PortalMask || params.stencilUsage == StencilUsage::PortalDepthReset;
+    const bool bPortalSurface = bDepthStencilOnly || params.stencilUsage == StencilUsage::PortalFallback;
+    
+    VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+    vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    vertShaderStageInfo.module = vertShaderModule;
+    vertShaderStageInfo.pName = "main";
+
+    VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
+    fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    fragShaderStageInfo.module = fragShaderModule;
+    fragShaderStageInfo.pName = "main";
+
+    VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
+
+    auto bindingDescription = LG::LGraphicsComponent::getBindingDescription();
+    auto attributeDescriptions = LG::LGraphicsComponent::getAttributeDescriptions();
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInputInfo.vertexBindingDescriptionCount = 1;
+    vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32>(attributeDescriptions.size());
+    
+    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+    vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+    VkPipelineViewportStateCreateInfo viewportState{};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.scissorCount = 1;
+    
+    VkPipelineRasterizationStateCreateInfo rasterizer{};
+    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer.depthClampEnable = VK_FALSE;
+    rasterizer.rasterizerDiscardEnable = VK_FALSE;
+    rasterizer.polygonMode = params.polygonMode;
+    rasterizer.lineWidth = 1.0f;
+    // portals are quads seen from both sides
+    rasterizer.cullMode = bPortalSurface ? VK_CULL_MODE_NONE : VK_CULL_MODE_BACK_BIT;
+    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterizer.depthBiasEnable = VK_FALSE;
+    rasterizer.depthBiasConstantFactor = 0.0f; // Optional
+    rasterizer.depthBiasClamp = 0.0f; // Optional
+    rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
+
+    VkPipelineMultisampleStateCreateInfo multisampling{};
+    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling.sampleShadingEnable = VK_FALSE;
+    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    multisampling.minSampleShading = 1.0f; // Optional
+    multisampling.pSampleMask = nullptr; // Optional
+    multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
+    multisampling.alphaToOneEnable = VK_FALSE; // Optional
+
+    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+    colorBlendAttachment.colorWriteMask = bDepthStencilOnly ? 0 :
+        VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    colorBlendAttachment.blendEnable = VK_FALSE;
+    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
+    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
+    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
+    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
+    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
+    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
+
+    VkPipelineColorBlendStateCreateInfo colorBlending{};
+    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending.logicOpEnable = VK_FALSE;
+    colorBlending.logicOp = VK_LOGIC_OP_COPY;
+    colorBlending.attachmentCount = 1;
+    colorBlending.pAttachments = &colorBlendAttachment;
+    colorBlending.blendConstants[0] = 0.0f;
+    colorBlending.blendConstants[1] = 0.0f;
+    colorBlending.blendConstants[2] = 0.0f;
+    colorBlending.blendConstants[3] = 0.0f;
+
+    std::vector<VkDynamicState> dynamicStates =
+    {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR
+    };
+
+    if (params.stencilUsage != StencilUsage::None)
+    {
+        dynamicStates.push_back(VK_DYNAMIC_STATE_STENCIL_REFERENCE);
+    }
+
+    if (params.stencilUsage == StencilUsage::PortalMask)
+    {
+        dynamicStates.push_back(VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK);
+        dynamicStates.push_back(VK_DYNAMIC_STATE_STENCIL_WRITE_MASK);
+    }
+
+    VkPipelineDynamicStateCreateInfo dynamicState{};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = static_cast<uint32>(dynamicStates.size());
+    dynamicState.pDynamicStates = dynamicStates.data();
+    
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+
+    VkPushConstantRange pushConstantRange = {};
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(PushConstants);
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    if (!pipelineLayout)
+    {
+        HANDLE_VK_ERROR(vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &pipelineLayout))
+    }
+
+    VkPipelineDepthStencilStateCreateInfo depthStencil{};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = VK_TRUE;
+    // the depth reset writes the far plane over whatever the parent view left there
+    depthStencil.depthCompareOp = params.stencilUsage == StencilUsage::PortalDepthReset ? VK_COMPARE_OP_ALWAYS : VK_COMPARE_OP_LESS;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.minDepthBounds = 0.0f; // Optional
+    depthStencil.maxDepthBounds = 1.0f; // Optional
+    depthStencil.stencilTestEnable = params.stencilUsage != StencilUsage::None;
+    depthStencil.front = {}; // Optional
+    depthStencil.back = {}; // Optional
+
+    if (params.stencilUsage != StencilUsage::None)
+    {
+        // the mask writes its digit only where the portal passes the depth test of the parent view
+        VkStencilOpState stencilOp{};
+        stencilOp.failOp = VK_STENCIL_OP_KEEP;
+        stencilOp.passOp = params.stencilUsage == StencilUsage::PortalMask ? VK_STENCIL_OP_REPLACE : VK_STENCIL_OP_KEEP;
+        stencilOp.depthFailOp = VK_STENCIL_OP_KEEP;
+        stencilOp.compareOp = VK_COMPARE_OP_EQUAL;
+        stencilOp.compareMask = 0xFF;
+        stencilOp.writeMask = 0;
+        stencilOp.reference = 0;
+
+        depthStencil.front = stencilOp;
+        depthStencil.back = stencilOp;
+    }
+
+    VkGraphicsPipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.pVertexInputState = &vertexInputInfo;
+    pipelineInfo.pInputAssemblyState = &inputAssembly;
+    pipelineInfo.pTessellationState = nullptr;
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer;
+    pipelineInfo.pMultisampleState = &multisampling;
+    pipelineInfo.pDepthStencilState = &depthStencil;
+    pipelineInfo.pColorBlendState = &colorBlending;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = pipelineLayout;
+    pipelineInfo.renderPass = renderPass;
+    pipelineInfo.subpass = 0;
+    pipelineInfo.basePipelineHandle = nullptr; // Optional
+    pipelineInfo.basePipelineIndex = -1;
+
+    HANDLE_VK_ERROR(vkCreateGraphicsPipelines(logicalDevice, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipelineOut))
+
+    vkDestroyShaderModule(logicalDevice, fragShaderModule, nullptr);
+    vkDestroyShaderModule(logicalDevice, vertShaderModule, nullptr);
+    
+    return VK_SUCCESS;
+}
+
+VkResult LRenderer::createCullPipeline()
+{
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(CullPushConstants);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+    HANDLE_VK_ERROR(vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &cullPipelineLayout))
+
+    VkShaderModule computeShaderModule = createShaderModule(cullInstancesComp);
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = computeShaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.layout = cullPipelineLayout;
+
+    HANDLE_VK_ERROR(vkCreateComputePipelines(logicalDevice, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &cullPipeline))
+
+    vkDestroyShaderModule(logicalDevice, computeShaderModule, nullptr);
+
+    return VK_SUCCESS;
+}
+
+VkShaderModule LRenderer::createShaderModule(const std::vector<uint8_t>& code)
+{
+    VkShaderModuleCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    createInfo.codeSize = code.size();
+    createInfo.pCode = reinterpret_cast<const uint32*>(code.data());
+    
+    VkShaderModule shaderModule;
+    HANDLE_VK_ERROR(vkCreateShaderModule(logicalDevice, &createInfo, nullptr, &shaderModule))
+    return shaderModule;
+}
+
+void LRenderer::createFramebuffers(RenderTarget* renderTarget, const VkExtent2D& size, uint32 framebuffersNum, VkRenderPass renderPass)
+{ 
+    renderTarget->depthImages.resize(framebuffersNum);
+
+    VkFormat depthFormat = findDepthFormat();
+    for (int32 i = 0; i < framebuffersNum; ++i)
+    {
+        createImageInternal(size.width, size.height, depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, renderTarget->depthImages[i].image, renderTarget->depthImages[i].allocation, 1);
+        const VkImageAspectFlags depthAspect = hasStencilComponent(depthFormat) ? VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT : VK_IMAGE_ASPECT_DEPTH_BIT;
+        renderTarget->depthImages[i].imageView = createImageView(renderTarget->depthImages[i].image, depthFormat, depthAspect, 1);
+    }
+
+    renderTarget->framebuffers.resize(framebuffersNum);
+    for (uint32 i = 0; i < framebuffersNum; ++i)
+    {
+        std::array<VkImageView, 2> attachments = 
+        {
+            renderTarget->images[i].imageView,
+            renderTarget->depthImages[i].imageView
+        };
+
+        VkFramebufferCreateInfo framebufferInfo{};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = renderPass;
+        framebufferInfo.attachmentCount = static_cast<uint32>(attachments.size());
+        framebufferInfo.pAttachments = attachments.data();
+        framebufferInfo.width = size.width;
+        framebufferInfo.height = size.height;
+        framebufferInfo.layers = 1;
+
+        HANDLE_VK_ERROR(vkCreateFramebuffer(logicalDevice, &framebufferInfo, nullptr, &renderTarget->framebuffers[i]))
+    }
+}
+
+VkResult LRenderer::createImage(const std::string& texturePath, Image& imageOut)
+{
+    stbi_set_flip_vertically_on_load(true);
+
+    int texWidth, texHeight, texChannels;
+
+    if (stbi_uc* pixels = stbi_load(texturePath.data(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha))
+    {
+        VkDeviceSize imageSize = texWidth * texHeight * 4;
+
+        VkBuffer stagingBuffer;
+        VmaAllocation stagingBufferMemory;
+
+        void* data;
+        // stage buffer to copy from CPU to GPU
+        createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO, stagingBuffer, stagingBufferMemory, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+
+        vmaMapMemory(allocator, stagingBufferMemory, &data);
+        memcpy(data, pixels, static_cast<uint64>(imageSize));
+        stbi_image_free(pixels);
+
+        imageOut.mipLevels = static_cast<uint32>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
+
+        HANDLE_VK_ERROR(createImageInternal(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            imageOut.image, imageOut.allocation, imageOut.mipLevels))
+
+        transitionImageLayout(imageOut.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT, imageOut.mipLevels);
+        copyBufferToImage(stagingBuffer, imageOut.image, static_cast<uint32>(texWidth), static_cast<uint32>(texHeight));
+
+        // TODO: should be pregenerated
+        generateMipmaps(imageOut.image, VK_FORMAT_R8G8B8A8_SRGB, texWidth, texHeight, imageOut.mipLevels);
+        //transitionImageLayout(imageOut.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT, imageOut.mipLevels);
+
+        vmaUnmapMemory(allocator, stagingBufferMemory);
+        vmaDestroyBuffer(allocator, stagingBuffer, stagingBufferMemory);
+
+        createTextureImageView(imageOut, imageOut.mipLevels);
+        return VK_SUCCESS;
+    }
+    else
+    {
+        if (texturePath.find("portal") != 0)
+        {
+            RAISE_VK_ERROR("failed to load texture image!");
+        }
+    }
+}
+
+VkResult LRenderer::createImageInternal(uint32 width, uint32 height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VmaAllocation& imageMemory, uint32 mipLevels)
+{
+    VkImageCreateInfo imageInfo{};
+    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageInfo.extent.width = width;
+    imageInfo.extent.height = height;
+    imageInfo.extent.depth = 1;
+    imageInfo.mipLevels = mipLevels;
+    imageInfo.arrayLayers = 1;
+    imageInfo.format = format;
+    imageInfo.tiling = tiling;
+    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageInfo.usage = usage;
+    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VmaAllocationCreateInfo createInfo{};
+    createInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+    VmaAllocationInfo allocInfo{};
+    return vmaCreateImage(allocator, &imageInfo, &createInfo, &image, &imageMemory, &allocInfo);
+}
+
+VkResult LRenderer::loadTextureImage(LName texturePath)
+{
+    if (images.find(texturePath) == images.end())
+    {
+        Image imageToCreate{};
+        HANDLE_VK_ERROR(createImage(texturePath.toString(), imageToCreate))
+        images.emplace(texturePath, imageToCreate);
+
+        if (textureSamplers.find(imageToCreate.mipLevels) == textureSamplers.end())
+        {
+            VkSampler sampler;
+            createTextureSampler(sampler, imageToCreate.mipLevels);
+            textureSamplers[imageToCreate.mipLevels] = sampler;
+        }
+    }
+    return VK_SUCCESS;
+}
+
+void LRenderer::clearUndefinedImage(VkImage imageToClear)
+{
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = imageToClear;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0,
+        0, nullptr,
+        0, nullptr,
+        1, &barrier
+    );
+
+    // 2. Clear the image with black color
+    VkClearColorValue clearColor = {};
+    clearColor.float32[0] = 0.0f;
+    clearColor.float32[1] = 0.0f;
+    clearColor.float32[2] = 0.0f;
+    clearColor.float32[3] = 1.0f;
+
+    vkCmdClearColorImage(
+        commandBuffer,
+        imageToClear,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        &clearColor,
+        1,
+        &barrier.subresourceRange
+    );
+
+    // portal targets are sampled before their first pass when the portal is over the pass budget
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0,
+        0, nullptr,
+        0, nullptr,
+        1, &barrier
+    );
+
+    endSingleTimeCommands(commandBuffer);
+}
+
+VkResult LRenderer::createTextureSampler(VkSampler& samplerOut, uint32 mipLevels)
+{
+    if (textureSamplers.find(mipLevels) == textureSamplers.end())
+    {
+        VkSamplerCreateInfo samplerInfo{};
+        samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        samplerInfo.magFilter = VK_FILTER_LINEAR;
+        samplerInfo.minFilter = VK_FILTER_LINEAR;
+        samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        samplerInfo.anisotropyEnable = VK_TRUE;
+        samplerInfo.maxAnisotropy = getMaxAnisotropy(physicalDevice);
+        samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+        samplerInfo.unnormalizedCoordinates = VK_FALSE;
+        samplerInfo.compareEnable = VK_FALSE;
+        samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+        samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+        samplerInfo.mipLodBias = 0.0f;
+        samplerInfo.minLod = 0.0f;
+        samplerInfo.maxLod = mipLevels;
+        return vkCreateSampler(logicalDevice, &samplerInfo, nullptr, &samplerOut);
+    }
+    return VK_SUCCESS;
+}
+
+void LRenderer::createTextureImageView(Image& imageInOut, uint32 mipLevels)
+{
+    imageInOut.imageView = createImageView(imageInOut.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels);
+}
+
+void LRenderer::initStaticDataTextures()
+{
+    for (LName path : textureNames)
+    {
+        // TODO: temporar check
+        if (path.toString().find("portal") != 0)
+        {
+            loadTextureImage(path);
+        }
+    }
+}
+
+void LRenderer::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, VkImageAspectFlags aspect, uint32 mipLevels)
+{
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = aspect;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = mipLevels;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+
+    VkPipelineStageFlags sourceStage;
+    VkPipelineStageFlags destinationStage;
+
+    if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) 
+    {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+        sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) 
+    {
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    }
+    else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) 
+    {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+        sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        destinationStage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    }
+    else 
+    {
+        RAISE_VK_ERROR("unsupported layout transition!")
+    }
+
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        sourceStage, destinationStage,
+        0,
+        0, nullptr,
+        0, nullptr,
+        1, &barrier
+    );
+
+    endSingleTimeCommands(commandBuffer);
+}
+
+void LRenderer::copyBufferToImage(VkBuffer buffer, VkImage image, uint32 width, uint32 height)
+{
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkBufferImageCopy region{};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+
+    region.imageOffset = { 0, 0, 0 };
+    region.imageExtent = {
+        width,
+        height,
+        1
+    };
+
+    vkCmdCopyBufferToImage(
+        commandBuffer,
+        buffer,
+        image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        1,
+        &region
+    );
+
+    endSingleTimeCommands(commandBuffer);
+}
+
+void LRenderer::generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32 mipLevels)
+{
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat, &formatProperties);
+
+    if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)) 
+    {
+        RAISE_VK_ERROR("texture image format does not support linear blitting!");
+    }
+
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.image = image;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.subresourceRange.levelCount = 1;
+
+    int32 mipWidth = texWidth;
+    int32 mipHeight = texHeight;
+
+    for (uint32 i = 1; i < mipLevels; i++) 
+    {
+        barrier.subresourceRange.baseMipLevel = i - 1;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+            0, nullptr,
+            0, nullptr,
+            1, &barrier);
+
+        VkImageBlit blit{};
+        blit.srcOffsets[0] = { 0, 0, 0 };
+        blit.srcOffsets[1] = { mipWidth, mipHeight, 1 };
+        blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.srcSubresource.mipLevel = i - 1;
+        blit.srcSubresource.baseArrayLayer = 0;
+        blit.srcSubresource.layerCount = 1;
+        blit.dstOffsets[0] = { 0, 0, 0 };
+        blit.dstOffsets[1] = { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1, 1 };
+        blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.dstSubresource.mipLevel = i;
+        blit.dstSubresource.baseArrayLayer = 0;
+        blit.dstSubresource.layerCount = 1;
+
+        vkCmdBlitImage(commandBuffer,
+            image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            1, &blit,
+            VK_FILTER_LINEAR);
+
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+            0, nullptr,
+            0, nullptr,
+            1, &barrier);
+
+        if (mipWidth > 1)
+        {
+            mipWidth /= 2;
+        }
+        if (mipHeight > 1)
+        {
+            mipHeight /= 2;
+        }
+    }
+
+    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+        0, nullptr,
+        0, nullptr,
+        1, &barrier);
+
+    endSingleTimeCommands(commandBuffer);
+}
+
+VkResult LRenderer::createCommandPool()
+{
+    QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+
+    return vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &commandPool);
+}
+
+VkFormat LRenderer::findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features)
+{
+    for (VkFormat format : candidates) 
+    {
+        VkFormatProperties props;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &props);
+        if (tiling == VK_IMAGE_TILING_LINEAR && (props.linearTilingFeatures & features) == features) 
+        {
+            return format;
+        }
+        else if (tiling == VK_IMAGE_TILING_OPTIMAL && (props.optimalTilingFeatures & features) == features) 
+        {
+            return format;
+        }
+    }
+    RAISE_VK_ERROR("failed to find supported format!")
+}
+
+VkFormat LRenderer::findDepthFormat()
+{
+    // stencil portals keep the ids of the views in the stencil aspect
+    if (portalMode == PortalMode::Stencil)
+    {
+        return findSupportedFormat(
+            { VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
+        );
+    }
+
+    return findSupportedFormat(
+        { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
+    );
+}
+
+VkCommandBuffer LRenderer::beginSingleTimeCommands()
+{
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandPool = commandPool;
+    allocInfo.commandBufferCount = 1;
+
+    VkCommandBuffer commandBuffer;
+    vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffer);
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+    return commandBuffer;
+}
+
+void LRenderer::endSingleTimeCommands(VkCommandBuffer commandBuffer)
+{
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+
+    vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+    vkQueueWaitIdle(graphicsQueue);
+
+    vkFreeCommandBuffers(logicalDevice, commandPool, 1, &commandBuffer);
+}
+
+void LRenderer::updateStaticStorageBuffer(/*uint32 imageIndex*/)
+{
+    ZoneScoped;
+
+    uploadedBytes = 0;
+
+    std::vector<LJobSystem::JobHandle> flushJobs;
+    std::vector<std::vector<uint32>*> processedIndices;
+
+    for (ObjectDataBuffer& primitiveData : primitivesData)
+    {
+        // region of the current frame, its previous reader has been already waited on inFlightFences
+        std::vector<uint32>& dirtyIndices = primitiveData.dirtyIndices[currentFrame];
+
+        if (dirtyIndices.empty())
+        {
+            continue;
+        }
+
+        std::sort(dirtyIndices.begin(), dirtyIndices.end());
+        dirtyIndices.erase(std::unique(dirtyIndices.begin(), dirtyIndices.end()), dirtyIndices.end());
+
+        auto packJob = jobSystem->parallelFor(static_cast<uint32>(dirtyIndices.size()), instancesChunkSize,
+            [this, &primitiveData](uint32 begin, uint32 end)
+            {
+                packInstances(primitiveData, begin, end);
+            });
+
+        flushJobs.emplace_back(jobSystem->schedule([this, &primitiveData]() { flushInstances(primitiveData); }, { packJob }));
+        processedIndices.push_back(&dirtyIndices);
+        uploadedBytes += dirtyIndices.size() * sizeof(SSBOData);
+    }
+
+    jobSystem->wait(flushJobs);
+
+    for (std::vector<uint32>* dirtyIndices : processedIndices)
+    {
+        dirtyIndices->clear();
+    }
+
+    TracyPlot("Instance upload bytes", static_cast<int64_t>(uploadedBytes));
+}
+
+void LRenderer::packInstances(ObjectDataBuffer& primitiveData, uint32 begin, uint32 end)
+{
+    ZoneScoped;
+
+    const std::vector<uint32>& dirtyIndices = primitiveData.dirtyIndices[currentFrame];
+    SSBOData* regionPtr = primitiveData.getRegion(currentFrame);
+
+    // sorted indices are coalesced into contiguous ranges, matrices of a range are composed in one linear pass
+    for (uint32 rangeBegin = begin; rangeBegin < end;)
+    {
+        uint32 rangeEnd = rangeBegin + 1;
+        while (rangeEnd < end && dirtyIndices[rangeEnd] == dirtyIndices[rangeEnd - 1] + 1)
+        {
+            ++rangeEnd;
+        }
+
+        uint32 first = dirtyIndices[rangeBegin];
+        uint32 count = rangeEnd - rangeBegin;
+        primitiveData.transforms->composeModelMatrices(first, count, &regionPtr[first].genericMatrix, sizeof(SSBOData));
+
+        for (uint32 i = first; i < first + count; ++i)
+        {
+            if (LG::LGraphicsComponent* const* objectPtrPtr = objects.get(primitiveData.instances[i]))
+            {
+                LG::LGraphicsComponent* objectPtr = *objectPtrPtr;
+                assert(objectPtr->textureId != LG::LGraphicsComponent::invalidTextureId && "Please, make sure that you set up a color texture to your mesh");
+                objectPtr->bDirty = false;
+
+                regionPtr[i].textureId = objectPtr->textureId;
+                regionPtr[i].isPortal = primitiveData.bIsPortal;
+            }
+            else
+            {
+                // Object is expired, its transform slot has zero scale already
+            }
+        }
+
+        rangeBegin = rangeEnd;
+    }
+}
+
+void LRenderer::flushInstances(const ObjectDataBuffer& primitiveData)
+{
+    ZoneScoped;
+
+    const std::vector<uint32>& dirtyIndices = primitiveData.dirtyIndices[currentFrame];
+
+    // no-op for HOST_COHERENT memory
+    for (uint64 rangeBegin = 0; rangeBegin < dirtyIndices.size();)
+    {
+        uint64 rangeEnd = rangeBegin + 1;
+        while (rangeEnd < dirtyIndices.size() && dirtyIndices[rangeEnd] == dirtyIndices[rangeEnd - 1] + 1)
+        {
+            ++rangeEnd;
+        }
+
+        VkDeviceSize offset = currentFrame * primitiveData.regionSize + dirtyIndices[rangeBegin] * sizeof(SSBOData);
+        VkDeviceSize size = (rangeEnd - rangeBegin) * sizeof(SSBOData);
+        vmaFlushAllocation(allocator, primitiveData.memory, offset, size);
+
+        rangeBegin = rangeEnd;
+    }
+}
+
+LAABB LRenderer::computeInstanceBounds(const ObjectDataBuffer& primitiveData, uint32 slot) const
+{
+    LAABB bounds;
+
+    // freed slots have zero scale, their box stays empty
+    const glm::vec3& scale = primitiveData.transforms->getScale(slot);
+    if (scale == glm::vec3(0.0f))
+    {
+        return bounds;
+    }
+
+    const LMeshBounds& meshBounds = RenderComponentBuilder::getMeshBounds(primitiveData.meshName);
+    const glm::vec3 localCenter = (meshBounds.aabbMin + meshBounds.aabbMax) * 0.5f * scale;
+    const glm::vec3 localExtent = (meshBounds.aabbMax - meshBounds.aabbMin) * 0.5f * glm::abs(scale);
+
+    // extent of the rotated box projected on the world axes
+    const glm::mat3 rotation = glm::mat3_cast(primitiveData.transforms->getRotation(slot));
+    const glm::mat3 absRotation = glm::mat3(glm::abs(rotation[0]), glm::abs(rotation[1]), glm::abs(rotation[2]));
+
+    const glm::vec3 center = primitiveData.transforms->getPosition(slot) + rotation * localCenter;
+    const glm::vec3 extent = absRotation * localExtent;
+
+    bounds.min = center - extent;
+    bounds.max = center + extent;
+    return bounds;
+}
+
+void LRenderer::updateInstanceHierarchy(ObjectDataBuffer& primitiveData)
+{
+    ZoneScoped;
+
+    const uint32 slotsNum = primitiveData.transforms->getSize();
+
+    // new slots change the topology, moved and freed ones only change the bounds
+    if (slotsNum != primitiveData.bvh.getItemsNum())
+    {
+        std::vector<LAABB> itemBounds(slotsNum);
+        for (uint32 slot = 0; slot < slotsNum; ++slot)
+        {
+            itemBounds[slot] = computeInstanceBounds(primitiveData, slot);
+        }
+        primitiveData.bvh.build(std::move(itemBounds));
+    }
+    else
+    {
+        for (uint32 slot : primitiveData.bvhDirtySlots)
+        {
+            primitiveData.bvh.updateItem(slot, computeInstanceBounds(primitiveData, slot));
+        }
+        primitiveData.bvh.refit();
+    }
+
+    primitiveData.bvhDirtySlots.clear();
+}
+
+void LRenderer::collectInstanceCandidates()
+{
+    ZoneScoped;
+
+    const uint32 viewsNum = getViewsNum();
+    std::vector<LJobSystem::JobHandle> candidateJobs;
+
+    for (ObjectDataBuffer& primitiveData : primitivesData)
+    {
+        primitiveData.candidates.resize(viewsNum);
+        if (primitiveData.instances.empty())
+        {
+            continue;
+        }
+
+        auto hierarchyJob = jobSystem->schedule([this, &primitiveData]() { updateInstanceHierarchy(primitiveData); });
+
+        candidateJobs.emplace_back(jobSystem->parallelFor(viewsNum, 1, [this, &primitiveData](uint32 begin, uint32 end)
+            {
+                for (uint32 viewIndex = begin; viewIndex < end; ++viewIndex)
+                {
+                    std::vector<uint32>& candidates = primitiveData.candidates[viewIndex];
+                    candidates.clear();
+                    if (isViewActive(viewIndex))
+                    {
+                        primitiveData.bvh.queryFrustum(viewTable[viewIndex].frustumPlanes, candidates);
+                    }
+
+                    // the cull dispatch is indirect, so recorded command buffers don't depend on the count
+                    const uint32 candidatesNum = static_cast<uint32>(candidates.size());
+                    uint32* candidatesPtr = primitiveData.getCandidates(currentFrame, viewIndex);
+                    candidatesPtr[0] = (candidatesNum + cullGroupSize - 1) / cullGroupSize;
+                    candidatesPtr[1] = 1;
+                    candidatesPtr[2] = 1;
+                    candidatesPtr[3] = candidatesNum;
+
+                    const VkDeviceSize size = (ObjectDataBuffer::candidatesHeaderNum + candidatesNum) * sizeof(uint32);
+                    memcpy(candidatesPtr + ObjectDataBuffer::candidatesHeaderNum, candidates.data(), candidatesNum * sizeof(uint32));
+
+                    // no-op for HOST_COHERENT memory
+                    const VkDeviceSize offset = currentFrame * primitiveData.regionSize + primitiveData.entriesSize + viewIndex * primitiveData.candidateListSize;
+                    vmaFlushAllocation(allocator, primitiveData.memory, offset, size);
+                }
+            }, { hierarchyJob }));
+    }
+
+    jobSystem->wait(candidateJobs);
+
+    if (!primitivesData.empty())
+    {
+        uint64 mainViewCandidates = 0;
+        for (const ObjectDataBuffer& primitiveData : primitivesData)
+        {
+            mainViewCandidates += primitiveData.candidates[0].size();
+        }
+        TracyPlot("BVH main view candidates", static_cast<int64_t>(mainViewCandidates));
+    }
+}
+
+void LRenderer::cullRegularMeshes()
+{
+    ZoneScoped;
+
+    regularMeshesFrame.clear();
+    regularSpheres.clear();
+
+    for (uint64 i = 0; i < primitiveMeshes.size();)
+    {
+        if (LG::LGraphicsComponent** meshPtr = objects.get(primitiveMeshes[i]))
+        {
+            LG::LGraphicsComponent* mesh = *meshPtr;
+
+            // stencil portals are drawn by the views they're seen from, as masks or opaque
+            if (portalMode == PortalMode::Stencil && mesh->getPrimitiveType().traits.bPortal)
+            {
+                ++i;
+                continue;
+            }
+
+            const glm::vec4& localSphere = RenderComponentBuilder::getMeshBounds(mesh->getMeshName()).sphere;
+
+            const glm::vec3 scale = mesh->getScale();
+            const glm::vec3 center = mesh->getPosition() + mesh->getRotation() * (scale * glm::vec3(localSphere));
+            const float maxScale = std::max({ std::abs(scale.x), std::abs(scale.y), std::abs(scale.z) });
+
+            regularMeshesFrame.push_back(mesh);
+            regularSpheres.push(center, localSphere.w * maxScale);
+            ++i;
+        }
+        else
+        {
+            primitiveMeshes[i] = primitiveMeshes.back();
+            primitiveMeshes.pop_back();
+        }
+    }
+
+    const uint32 viewsNum = getViewsNum();
+    regularVisible.resize(viewsNum);
+
+    auto cullJob = jobSystem->parallelFor(viewsNum, 1, [this](uint32 begin, uint32 end)
+        {
+            for (uint32 viewIndex = begin; viewIndex < end; ++viewIndex)
+            {
+                if (isViewActive(viewIndex))
+                {
+                    LFrustumCulling::cull(viewTable[viewIndex].frustumPlanes, regularSpheres, regularVisible[viewIndex]);
+                }
+                else
+                {
+                    regularVisible[viewIndex].clear();
+                }
+            }
+        });
+    jobSystem->wait(cullJob);
+}
+
+void LRenderer::batchRegularMeshes()
+{
+    ZoneScoped;
+
+    const uint32 viewsNum = getViewsNum();
+    regularBatches.resize(viewsNum);
+    regularUnbatched.resize(viewsNum);
+
+    // batched meshes go first and are sorted by mesh, so every run of one mesh becomes one draw
+    auto getBatchKey = [this](uint32 meshIndex)
+        {
+            const LG::LPrimitiveType& primitiveType = regularMeshesFrame[meshIndex]->getPrimitiveType();
+            return primitiveType.traits.bBatched ? primitiveType.meshName.getId() : std::numeric_limits<uint32>::max();
+        };
+
+    uint32 batchedNum = 0;
+    for (uint32 viewIndex = 0; viewIndex < viewsNum; ++viewIndex)
+    {
+        std::vector<uint32>& visible = regularVisible[viewIndex];
+        std::sort(visible.begin(), visible.end(), [&getBatchKey](uint32 a, uint32 b) { return getBatchKey(a) < getBatchKey(b); });
+
+        auto unbatchedBegin = std::find_if(visible.begin(), visible.end(), [this](uint32 meshIndex)
+            { return !regularMeshesFrame[meshIndex]->getPrimitiveType().traits.bBatched; });
+
+        regularUnbatched[viewIndex].assign(unbatchedBegin, visible.end());
+        batchedNum += static_cast<uint32>(unbatchedBegin - visible.begin());
+    }
+
+    if (batchedNum > batchData.capacity)
+    {
+        createBatchBuffer(std::max(batchedNum, batchData.capacity * 2));
+
+        // the fence of the current frame is waited, its set can be rewritten right away
+        updateBatchDescriptor(currentFrame);
+        batchData.outdatedDescriptorsMask &= ~(1u << currentFrame);
+    }
+
+    SSBOData* regionPtr = batchData.getRegion(currentFrame);
+    uint32 entryIndex = 0;
+    uint32 batchesNum = 0;
+
+    for (uint32 viewIndex = 0; viewIndex < viewsNum; ++viewIndex)
+    {
+        const std::vector<uint32>& visible = regularVisible[viewIndex];
+        const uint64 viewBatchedNum = visible.size() - regularUnbatched[viewIndex].size();
+
+        std::vector<RegularBatch>& batches = regularBatches[viewIndex];
+        batches.clear();
+
+        for (uint64 i = 0; i < viewBatchedNum; ++i)
+        {
+            const LG::LGraphicsComponent& mesh = *regularMeshesFrame[visible[i]];
+            const LName meshName = mesh.getMeshName();
+
+            if (batches.empty() || batches.back().meshName != meshName)
+            {
+                batches.push_back({ meshName, entryIndex, 0 });
+            }
+            ++batches.back().instancesNum;
+
+            SSBOData& entry = regionPtr[entryIndex++];
+            entry.genericMatrix = mesh.getModelMatrix();
+            entry.textureId = mesh.textureId != LG::LGraphicsComponent::invalidTextureId ? mesh.textureId : 0;
+            entry.isPortal = mesh.getPrimitiveType().traits.bPortal;
+        }
+
+        batchesNum += static_cast<uint32>(batches.size());
+    }
+
+    // no-op for HOST_COHERENT memory
+    if (entryIndex > 0)
+    {
+        vmaFlushAllocation(allocator, batchData.memory, currentFrame * batchData.regionSize, entryIndex * sizeof(SSBOData));
+    }
+
+    TracyPlot("Regular batches", static_cast<int64_t>(batchesNum));
+}
+
+void LRenderer::buildDrawQueue()
+{
+    ZoneScoped;
+
+    const uint32 viewsNum = getViewsNum();
+    assert(viewsNum <= (1u << LDrawKey::passBits) && "Too many views for the pass field of the draw key");
+
+    drawQueue.clear();
+    drawPackets.clear();
+
+    for (uint32 viewIndex = 0; viewIndex < viewsNum; ++viewIndex)
+    {
+        const uint32 pass = getPassOrder(viewIndex);
+
+        if (!primitivesData.empty())
+        {
+            drawQueue.push(LDrawKey::make(pass, static_cast<uint32>(DrawPipeline::Instanced), 0, 0, 0.0f), static_cast<uint32>(drawPackets.size()));
+            drawPackets.push_back({ DrawPipeline::Instanced, 0 });
+        }
+
+        // a batch mixes textures, it's keyed by the mesh only
+        const std::vector<RegularBatch>& batches = regularBatches[viewIndex];
+        for (uint32 batchIndex = 0; batchIndex < batches.size(); ++batchIndex)
+        {
+            const uint64 key = LDrawKey::make(pass, static_cast<uint32>(DrawPipeline::Batched), 0, batches[batchIndex].meshName.getId(), 0.0f);
+            drawQueue.push(key, static_cast<uint32>(drawPackets.size()));
+            drawPackets.push_back({ DrawPipeline::Batched, batchIndex });
+        }
+
+        // view space depth of the sphere center, front to back inside a material and mesh
+        const glm::mat4& viewProjection = viewTable[viewIndex].projView;
+        for (uint32 meshIndex : regularUnbatched[viewIndex])
+        {
+            const LG::LGraphicsComponent& mesh = *regularMeshesFrame[meshIndex];
+            const glm::vec4 center(regularSpheres.x[meshIndex], regularSpheres.y[meshIndex], regularSpheres.z[meshIndex], 1.0f);
+            const float depth = (viewProjection * center).w / zFar;
+
+            const uint32 material = mesh.textureId != LG::LGraphicsComponent::invalidTextureId ? mesh.textureId : 0;
+            const uint64 key = LDrawKey::make(pass, static_cast<uint32>(DrawPipeline::Regular), material, mesh.getMeshName().getId(), depth);
+            drawQueue.push(key, static_cast<uint32>(drawPackets.size()));
+            drawPackets.push_back({ DrawPipeline::Regular, meshIndex });
+        }
+    }
+
+    drawQueue.sort(jobSystem.get());
+
+    // draws of a pass are contiguous after the sort
+    passDrawRanges.assign(viewsNum, { 0, 0 });
+
+    const std::vector<LDrawQueue::Item>& drawItems = drawQueue.getItems();
+    for (uint32 begin = 0; begin < drawItems.size();)
+    {
+        const uint32 pass = LDrawKey::getPass(drawItems[begin].key);
+
+        uint32 end = begin + 1;
+        while (end < drawItems.size() && LDrawKey::getPass(drawItems[end].key) == pass)
+        {
+            ++end;
+        }
+
+        const uint32 viewIndex = pass == viewsNum - 1 ? 0 : pass + 1;
+        passDrawRanges[viewIndex] = { begin, end };
+        begin = end;
+    }
+}
+
+void LRenderer::cullInstances(VkCommandBuffer commandBuffer)
 {
-    auto portalRt = std::make_unique<RenderTarget>(logicalDevice, allocator);
-    portalRt->images.resize(maxFramesInFlight);
+    ZoneScoped;
 
-    for (uint32 i = 0; i < maxFramesInFlight; ++i)
+    const uint32 viewsNum = getViewsNum();
+    const uint32 bucketsNum = static_cast<uint32>(primitivesData.size());
+
+    if (bucketsNum == 0)
     {
-        HANDLE_VK_ERROR(createImageInternal(swapChainExtent.width, swapChainExtent.height, swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
-            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
-            VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            portalRt->images[i].image, portalRt->images[i].allocation, 1))
+        return;
+    }
 
-        clearUndefinedImage(portalRt->images[i].image);
+    // every command is rewritten with zero instances, the compute pass counts the visible ones
+    std::vector<VkDrawIndexedIndirectCommand> commands(viewsNum * bucketsNum, { 0, 0, 0, 0, 0 });
+    for (uint32 instancedArrayNum = 0; instancedArrayNum < bucketsNum; ++instancedArrayNum)
+    {
+        const ObjectDataBuffer& primitiveData = primitivesData[instancedArrayNum];
+        if (primitiveData.instances.empty())
+        {
+            continue;
+        }
 
-        portalRt->images[i].imageView = createImageView(portalRt->images[i].image, swapChainImageFormat, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+        const MeshRange& meshRange = RenderComponentBuilder::getMeshRange(primitiveData.meshName);
+        for (uint32 viewIndex = 0; viewIndex < viewsNum; ++viewIndex)
+        {
+            const uint32 firstInstance = viewIndex * drawData.visibleListNum + primitiveData.drawBase;
+            commands[viewIndex * bucketsNum + instancedArrayNum] = { meshRange.indicesCount, 0, meshRange.firstIndex, meshRange.vertexOffset, firstInstance };
+        }
     }
 
-    portalsRt.emplace_back(std::move(portalRt));
-    return VK_SUCCESS;
-}
+    // vkCmdUpdateBuffer is limited to 64KB, views and buckets both grow, so big tables go in several updates
+    constexpr VkDeviceSize maxUpdateSize = 65536;
+    const VkDeviceSize commandsSize = commands.size() * sizeof(VkDrawIndexedIndirectCommand);
+    const uint8* commandsData = reinterpret_cast<const uint8*>(commands.data());
+    for (VkDeviceSize offset = 0; offset < commandsSize; offset += maxUpdateSize)
+    {
+        vkCmdUpdateBuffer(commandBuffer, drawData.buffer, currentFrame * drawData.regionSize + offset,
+            std::min(maxUpdateSize, commandsSize - offset), commandsData + offset);
+    }
 
-VkResult LRenderer::createDescriptorSetLayout()
-{
-    VkDescriptorSetLayoutBinding uboLayoutBinding{};
-    uboLayoutBinding.binding = 0;
-    uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    uboLayoutBinding.descriptorCount = 1;
-    uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
 
-    VkDescriptorSetLayoutBinding samplerLayoutBinding{};
-    samplerLayoutBinding.binding = 1;
-    samplerLayoutBinding.descriptorCount = texturesInitData.size();
-    samplerLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    samplerLayoutBinding.pImmutableSamplers = nullptr;
-    samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &descriptorSets[currentFrame], 0, nullptr);
 
-    std::array<VkDescriptorSetLayoutBinding, 2> bindings = { uboLayoutBinding, samplerLayoutBinding };
-    VkDescriptorSetLayoutCreateInfo layoutInfo{};
-    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layoutInfo.bindingCount = static_cast<uint32>(bindings.size());
-    layoutInfo.pBindings = bindings.data();
+    for (uint32 instancedArrayNum = 0; instancedArrayNum < bucketsNum; ++instancedArrayNum)
+    {
+        const ObjectDataBuffer& primitiveData = primitivesData[instancedArrayNum];
+        if (primitiveData.instances.empty())
+        {
+            continue;
+        }
 
-    return vkCreateDescriptorSetLayout(logicalDevice, &layoutInfo, nullptr, &descriptorSetLayout);
-}
+        CullPushConstants constants{};
+        constants.boundingSphere = primitiveData.boundingSphere;
+        constants.bucketIndex = instancedArrayNum;
 
-VkResult LRenderer::createGraphicsPipeline(const GraphicsPipelineParams& params, VkPipeline& graphicsPipelineOut, VkRenderPass renderPass)
-{
-    VkShaderModule vertShaderModule = params.bInstanced? createShaderModule(genericInstancedVert) : createShaderModule(genericVert);
-    VkShaderModule fragShaderModule = createShaderModule(genericFrag);
-    
-    VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-    vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vertShaderStageInfo.module = vertShaderModule;
-    vertShaderStageInfo.pName = "main";
+        for (uint32 viewIndex = 0; viewIndex < viewsNum; ++viewIndex)
+        {
+            // TODO: actually here we should only ignore the portal of the current view
+            // stencil portals are drawn by the views they're seen from, as masks or opaque
+            const bool bSkippedPortal = primitiveData.bIsPortal && (viewIndex != 0 || portalMode == PortalMode::Stencil);
+            if (bSkippedPortal || !isViewActive(viewIndex))
+            {
+                continue;
+            }
 
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-    fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fragShaderStageInfo.module = fragShaderModule;
-    fragShaderStageInfo.pName = "main";
+            constants.viewIndex = viewIndex;
+            constants.commandOffset = static_cast<uint32>((viewIndex * bucketsNum + instancedArrayNum) * sizeof(VkDrawIndexedIndirectCommand) / sizeof(uint32));
+            constants.candidatesOffset = static_cast<uint32>(viewIndex * primitiveData.candidateListSize / sizeof(uint32));
 
-    VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo, fragShaderStageInfo};
+            vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants), &constants);
 
-    auto bindingDescription = LG::LGraphicsComponent::getBindingDescription();
-    auto attributeDescriptions = LG::LGraphicsComponent::getAttributeDescriptions();
+            // group count is written with the candidates of the frame, zero when the hierarchy rejected the whole bucket
+            const VkDeviceSize dispatchOffset = currentFrame * primitiveData.regionSize + primitiveData.entriesSize + viewIndex * primitiveData.candidateListSize;
+            vkCmdDispatchIndirect(commandBuffer, primitiveData.buffer, dispatchOffset);
+        }
+    }
 
-    VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-    vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertexInputInfo.vertexBindingDescriptionCount = 1;
-    vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32>(attributeDescriptions.size());
-    
-    vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-    vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
 
-    VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    inputAssembly.primitiveRestartEnable = VK_FALSE;
+void LRenderer::markInstanceDirty(LName typeName, uint32 instanceIndex)
+{
+    if (uint32 instancedArrayNum = getInstancedArrayIndex(typeName); instancedArrayNum != invalidIndex)
+    {
+        ObjectDataBuffer& primitiveData = primitivesData[instancedArrayNum];
 
-    VkPipelineViewportStateCreateInfo viewportState{};
-    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewportState.viewportCount = 1;
-    viewportState.scissorCount = 1;
-    
-    VkPipelineRasterizationStateCreateInfo rasterizer{};
-    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer.depthClampEnable = VK_FALSE;
-    rasterizer.rasterizerDiscardEnable = VK_FALSE;
-    rasterizer.polygonMode = params.polygonMode;
-    rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    rasterizer.depthBiasEnable = VK_FALSE;
-    rasterizer.depthBiasConstantFactor = 0.0f; // Optional
-    rasterizer.depthBiasClamp = 0.0f; // Optional
-    rasterizer.depthBiasSlopeFactor = 0.0f; // Optional
+        // every frame in flight owns a copy of the instance data, so all of them have to be rewritten
+        for (auto& dirtyIndices : primitiveData.dirtyIndices)
+        {
+            dirtyIndices.push_back(instanceIndex);
+        }
+        primitiveData.bvhDirtySlots.push_back(instanceIndex);
+    }
+}
 
-    VkPipelineMultisampleStateCreateInfo multisampling{};
-    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable = VK_FALSE;
-    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-    multisampling.minSampleShading = 1.0f; // Optional
-    multisampling.pSampleMask = nullptr; // Optional
-    multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
-    multisampling.alphaToOneEnable = VK_FALSE; // Optional
+void LRenderer::queryInstances(const glm::vec3& center, float radius, std::vector<LG::LGraphicsComponent*>& componentsOut) const
+{
+    ZoneScoped;
 
-    VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorBlendAttachment.blendEnable = VK_FALSE;
-    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-    colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD; // Optional
-    colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-    colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO; // Optional
-    colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD; // Optional
+    std::vector<uint32> slots;
+    for (const ObjectDataBuffer& primitiveData : primitivesData)
+    {
+        slots.clear();
+        primitiveData.bvh.querySphere(center, radius, slots);
 
-    VkPipelineColorBlendStateCreateInfo colorBlending{};
-    colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    colorBlending.logicOpEnable = VK_FALSE;
-    colorBlending.logicOp = VK_LOGIC_OP_COPY;
-    colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &colorBlendAttachment;
-    colorBlending.blendConstants[0] = 0.0f;
-    colorBlending.blendConstants[1] = 0.0f;
-    colorBlending.blendConstants[2] = 0.0f;
-    colorBlending.blendConstants[3] = 0.0f;
+        for (uint32 slot : slots)
+        {
+            if (LG::LGraphicsComponent* const* objectPtrPtr = objects.get(primitiveData.instances[slot]))
+            {
+                componentsOut.push_back(*objectPtrPtr);
+            }
+        }
+    }
+}
 
-    std::vector<VkDynamicState> dynamicStates =
-    {
-        VK_DYNAMIC_STATE_VIEWPORT,
-        VK_DYNAMIC_STATE_SCISSOR
-    };
+LG::LGraphicsComponent* LRenderer::raycastInstances(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float* distanceOut) const
+{
+    ZoneScoped;
 
-    VkPipelineDynamicStateCreateInfo dynamicState{};
-    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamicState.dynamicStateCount = static_cast<uint32>(dynamicStates.size());
-    dynamicState.pDynamicStates = dynamicStates.data();
-    
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+    LG::LGraphicsComponent* closestComponent = nullptr;
+    float closestDistance = maxDistance;
 
-    VkPushConstantRange pushConstantRange = {};
-    pipelineLayoutInfo.pushConstantRangeCount = 1;
-    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-    pushConstantRange.offset = 0;
-    pushConstantRange.size = sizeof(PushConstants);
-    pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+    for (const ObjectDataBuffer& primitiveData : primitivesData)
+    {
+        // every bucket is limited by the closest hit so far
+        float distance;
+        const uint32 slot = primitiveData.bvh.raycast(origin, direction, closestDistance, &distance);
+        if (slot == LBVH::invalidItem)
+        {
+            continue;
+        }
 
-    if (!pipelineLayout)
+        if (LG::LGraphicsComponent* const* objectPtrPtr = objects.get(primitiveData.instances[slot]))
+        {
+            closestComponent = *objectPtrPtr;
+            closestDistance = distance;
+        }
+    }
+
+    if (distanceOut && closestComponent)
     {
-        HANDLE_VK_ERROR(vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &pipelineLayout))
+        *distanceOut = closestDistance;
     }
+    return closestComponent;
+}
 
-    VkPipelineDepthStencilStateCreateInfo depthStencil{};
-    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depthStencil.depthTestEnable = VK_TRUE;
-    depthStencil.depthWriteEnable = VK_TRUE;
-    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
-    depthStencil.depthBoundsTestEnable = VK_FALSE;
-    depthStencil.minDepthBounds = 0.0f; // Optional
-    depthStencil.maxDepthBounds = 1.0f; // Optional
-    depthStencil.stencilTestEnable = VK_FALSE;
-    depthStencil.front = {}; // Optional
-    depthStencil.back = {}; // Optional
+//void LRenderer::setProjection(float degrees, float zNear, float zFar)
+//{
+//    glm::mat4 proj = glm::perspective(glm::radians(degrees), swapChainExtent.width / (float) swapChainExtent.height, zNear, zFar);
+//    proj[1][1] *= -1;
+//    projection = proj;
+//    bNeedToUpdateProjView = true;
+//}
 
-    VkGraphicsPipelineCreateInfo pipelineInfo{};
-    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipelineInfo.stageCount = 2;
-    pipelineInfo.pStages = shaderStages;
-    pipelineInfo.pVertexInputState = &vertexInputInfo;
-    pipelineInfo.pInputAssemblyState = &inputAssembly;
-    pipelineInfo.pTessellationState = nullptr;
-    pipelineInfo.pViewportState = &viewportState;
-    pipelineInfo.pRasterizationState = &rasterizer;
-    pipelineInfo.pMultisampleState = &multisampling;
-    pipelineInfo.pDepthStencilState = &depthStencil;
-    pipelineInfo.pColorBlendState = &colorBlending;
-    pipelineInfo.pDynamicState = &dynamicState;
-    pipelineInfo.layout = pipelineLayout;
-    pipelineInfo.renderPass = renderPass;
-    pipelineInfo.subpass = 0;
-    pipelineInfo.basePipelineHandle = nullptr; // Optional
-    pipelineInfo.basePipelineIndex = -1;
+void LRenderer::setProjection(float degrees, float width, float height, float zNear, float zFar)
+{
+    glm::mat4 proj = glm::perspective(glm::radians(degrees), width / height, zNear, zFar);
+    proj[1][1] *= -1;
+    projection = proj;
+}
 
-    HANDLE_VK_ERROR(vkCreateGraphicsPipelines(logicalDevice, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipelineOut))
+void LRenderer::setView(const glm::mat4& viewIn)
+{
+    view = viewIn;
+}
 
-    vkDestroyShaderModule(logicalDevice, fragShaderModule, nullptr);
-    vkDestroyShaderModule(logicalDevice, vertShaderModule, nullptr);
-    
-    return VK_SUCCESS;
+glm::vec3 LRenderer::getCameraUp() const
+{
+    return cameraUp;
 }
 
-VkShaderModule LRenderer::createShaderModule(const std::vector<uint8_t>& code)
+glm::vec3 LRenderer::getCameraFront() const
 {
-    VkShaderModuleCreateInfo createInfo{};
-    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    createInfo.codeSize = code.size();
-    createInfo.pCode = reinterpret_cast<const uint32*>(code.data());
-    
-    VkShaderModule shaderModule;
-    HANDLE_VK_ERROR(vkCreateShaderModule(logicalDevice, &createInfo, nullptr, &shaderModule))
-    return shaderModule;
+    return cameraFront;
 }
 
-void LRenderer::createFramebuffers(RenderTarget* renderTarget, const VkExtent2D& size, uint32 framebuffersNum, VkRenderPass renderPass)
-{ 
-    renderTarget->depthImages.resize(framebuffersNum);
+glm::vec3 LRenderer::getCameraPosition() const
+{
+    return cameraPosition;
+}
 
-    VkFormat depthFormat = findDepthFormat();
-    for (int32 i = 0; i < framebuffersNum; ++i)
-    {
-        createImageInternal(size.width, size.height, depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, renderTarget->depthImages[i].image, renderTarget->depthImages[i].allocation, 1);
-        renderTarget->depthImages[i].imageView = createImageView(renderTarget->depthImages[i].image, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, 1);
-    }
+void LRenderer::setCameraFront(const glm::vec3& cameraFront)
+{
+    this->cameraFront = cameraFront;
+    setView(glm::lookAt(cameraPosition, cameraPosition + cameraFront, cameraUp));
+}
 
-    renderTarget->framebuffers.resize(framebuffersNum);
-    for (uint32 i = 0; i < framebuffersNum; ++i)
-    {
-        std::array<VkImageView, 2> attachments = 
-        {
-            renderTarget->images[i].imageView,
-            renderTarget->depthImages[i].imageView
-        };
+void LRenderer::setCameraPosition(const glm::vec3& cameraPosition)
+{
+    this->cameraPosition = cameraPosition;
+    setView(glm::lookAt(cameraPosition, cameraPosition + cameraFront, cameraUp));
+}
 
-        VkFramebufferCreateInfo framebufferInfo{};
-        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        framebufferInfo.renderPass = renderPass;
-        framebufferInfo.attachmentCount = static_cast<uint32>(attachments.size());
-        framebufferInfo.pAttachments = attachments.data();
-        framebufferInfo.width = size.width;
-        framebufferInfo.height = size.height;
-        framebufferInfo.layers = 1;
+void LRenderer::initProjection()
+{
+    setProjection(degrees, swapChainExtent.width, swapChainExtent.height);
+}
 
-        HANDLE_VK_ERROR(vkCreateFramebuffer(logicalDevice, &framebufferInfo, nullptr, &renderTarget->framebuffers[i]))
-    }
+void LRenderer::initView()
+{
+    glm::mat4 viewMatrix = glm::lookAt(cameraPosition, cameraPosition + cameraFront, cameraUp);
+    setView(viewMatrix);
 }
 
-VkResult LRenderer::createImage(const std::string& texturePath, Image& imageOut)
+void LRenderer::updateProjView()
 {
-    stbi_set_flip_vertically_on_load(true);
+    projView = projection * view;
+}
 
-    int texWidth, texHeight, texChannels;
+void LRenderer::buildViewTree()
+{
+    viewNodes.assign(1, ViewNode{});
+    viewExecutionOrder.assign(1, 0);
 
-    if (stbi_uc* pixels = stbi_load(texturePath.data(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha))
+    if (maxPortalNum == 0)
     {
-        VkDeviceSize imageSize = texWidth * texHeight * 4;
-
-        VkBuffer stagingBuffer;
-        VmaAllocation stagingBufferMemory;
+        return;
+    }
 
-        void* data;
-        // stage buffer to copy from CPU to GPU
-        createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO, stagingBuffer, stagingBufferMemory, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+    const uint32 maxViewsNum = 1u << LDrawKey::passBits;
+    const uint32 linkedPortalsNum = static_cast<uint32>(std::ranges::count_if(portalExits, [](uint32 exit) { return exit != invalidIndex; }));
 
-        vmaMapMemory(allocator, stagingBufferMemory, &data);
-        memcpy(data, pixels, static_cast<uint64>(imageSize));
-        stbi_image_free(pixels);
+    // offscreen portals can't be seen through each other, only the scheduled ones of the frame get a slot
+    if (portalMode == PortalMode::Offscreen)
+    {
+        uint32 slotsNum = std::min(linkedPortalsNum, maxViewsNum - 1);
+        if (maxPortalPasses > 0)
+        {
+            slotsNum = std::min(slotsNum, maxPortalPasses);
+        }
 
-        imageOut.mipLevels = static_cast<uint32>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
+        viewNodes[0].firstChild = 1;
+        viewNodes[0].childrenNum = slotsNum;
 
-        HANDLE_VK_ERROR(createImageInternal(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-            VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            imageOut.image, imageOut.allocation, imageOut.mipLevels))
+        ViewNode slot;
+        slot.parent = 0;
+        slot.depth = 1;
+        viewNodes.resize(slotsNum + 1, slot);
 
-        transitionImageLayout(imageOut.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT, imageOut.mipLevels);
-        copyBufferToImage(stagingBuffer, imageOut.image, static_cast<uint32>(texWidth), static_cast<uint32>(texHeight));
+        viewExecutionOrder.resize(slotsNum + 1);
+        std::iota(viewExecutionOrder.begin(), viewExecutionOrder.end(), 0);
+        return;
+    }
 
-        // TODO: should be pregenerated
-        generateMipmaps(imageOut.image, VK_FORMAT_R8G8B8A8_SRGB, texWidth, texHeight, imageOut.mipLevels);
-        //transitionImageLayout(imageOut.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_ASPECT_COLOR_BIT, imageOut.mipLevels);
+    // a view of a linked portal sees every linked portal but its exit
+    const uint32 maxDepth = std::clamp(portalRecursionDepth, 1u, 8u);
+    auto getSlotsNum = [linkedPortalsNum](uint32 depth, uint32 width) { return std::min(width, depth == 0 ? linkedPortalsNum : linkedPortalsNum - 1); };
 
-        vmaUnmapMemory(allocator, stagingBufferMemory);
-        vmaDestroyBuffer(allocator, stagingBuffer, stagingBufferMemory);
+    // the widest tree which fits the draw key, the digits of all its levels have to fit the stencil
+    uint32 width = 1;
+    for (uint32 candidateWidth = 2; candidateWidth <= linkedPortalsNum && candidateWidth < maxViewsNum; ++candidateWidth)
+    {
+        uint32 viewsNum = 1;
+        uint32 levelViewsNum = 1;
+        for (uint32 depth = 0; depth < maxDepth; ++depth)
+        {
+            levelViewsNum *= getSlotsNum(depth, candidateWidth);
+            viewsNum += levelViewsNum;
+        }
 
-        createTextureImageView(imageOut, imageOut.mipLevels);
-        return VK_SUCCESS;
+        if (viewsNum > maxViewsNum || maxDepth * static_cast<uint32>(std::bit_width(candidateWidth)) > 8)
+        {
+            break;
+        }
+        width = candidateWidth;
     }
-    else
+
+    // a digit per level, 0 is left for the view without the portal of that level
+    const uint32 digitBits = static_cast<uint32>(std::bit_width(width));
+
+    for (uint32 viewIndex = 0; viewIndex < viewNodes.size(); ++viewIndex)
     {
-        if (texturePath.find("portal") != 0)
+        if (viewNodes[viewIndex].depth == maxDepth)
         {
-            RAISE_VK_ERROR("failed to load texture image!");
+            continue;
         }
-    }
-}
 
-VkResult LRenderer::createImageInternal(uint32 width, uint32 height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VmaAllocation& imageMemory, uint32 mipLevels)
-{
-    VkImageCreateInfo imageInfo{};
-    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    imageInfo.extent.width = width;
-    imageInfo.extent.height = height;
-    imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = mipLevels;
-    imageInfo.arrayLayers = 1;
-    imageInfo.format = format;
-    imageInfo.tiling = tiling;
-    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    imageInfo.usage = usage;
-    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        viewNodes[viewIndex].firstChild = static_cast<uint32>(viewNodes.size());
+        viewNodes[viewIndex].childrenNum = getSlotsNum(viewNodes[viewIndex].depth, width);
 
-    VmaAllocationCreateInfo createInfo{};
-    createInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+        for (uint32 slotIndex = 0; slotIndex < viewNodes[viewIndex].childrenNum; ++slotIndex)
+        {
+            const ViewNode& parent = viewNodes[viewIndex];
 
-    VmaAllocationInfo allocInfo{};
-    return vmaCreateImage(allocator, &imageInfo, &createInfo, &image, &imageMemory, &allocInfo);
-}
+            ViewNode node;
+            node.parent = viewIndex;
+            node.depth = parent.depth + 1;
 
-VkResult LRenderer::loadTextureImage(const std::string& texturePath)
-{
-    if (images.find(texturePath) == images.end())
+            const uint32 shift = digitBits * parent.depth;
+            node.stencilRef = parent.stencilRef | ((slotIndex + 1) << shift);
+            node.stencilCompareMask = (1u << shift) - 1;
+            node.stencilWriteMask = ((1u << digitBits) - 1) << shift;
+
+            viewNodes.push_back(node);
+        }
+    }
+
+    // children are pushed reversed, so they're popped in order
+    viewExecutionOrder.clear();
+    std::vector<uint32> stack = { 0 };
+    while (!stack.empty())
     {
-        Image imageToCreate{};
-        HANDLE_VK_ERROR(createImage(texturePath, imageToCreate))
-        images.emplace(texturePath, imageToCreate);
+        const uint32 viewIndex = stack.back();
+        stack.pop_back();
+        viewExecutionOrder.push_back(viewIndex);
 
-        if (textureSamplers.find(imageToCreate.mipLevels) == textureSamplers.end())
+        const ViewNode& node = viewNodes[viewIndex];
+        for (uint32 i = node.childrenNum; i > 0; --i)
         {
-            VkSampler sampler;
-            createTextureSampler(sampler, imageToCreate.mipLevels);
-            textureSamplers[imageToCreate.mipLevels] = sampler;
+            stack.push_back(node.firstChild + i - 1);
         }
     }
 }
 
-void LRenderer::clearUndefinedImage(VkImage imageToClear)
+void LRenderer::schedulePortalViews()
 {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-    VkImageMemoryBarrier barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = imageToClear;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-    vkCmdPipelineBarrier(
-        commandBuffer,
-        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-        VK_PIPELINE_STAGE_TRANSFER_BIT,
-        0,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
-
-    // 2. Clear the image with black color
-    VkClearColorValue clearColor = {};
-    clearColor.float32[0] = 0.0f;
-    clearColor.float32[1] = 0.0f;
-    clearColor.float32[2] = 0.0f;
-    clearColor.float32[3] = 1.0f;
-
-    vkCmdClearColorImage(
-        commandBuffer,
-        imageToClear,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        &clearColor,
-        1,
-        &barrier.subresourceRange
-    );
+    ZoneScoped;
 
-    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    const uint32 viewsNum = getViewsNum();
+    const bool bStencil = portalMode == PortalMode::Stencil;
 
-    vkCmdPipelineBarrier(
-        commandBuffer,
-        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        0,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
+    activeViewsMask = 1;
+    portalSchedule.clear();
+    portalCandidates.clear();
 
-    endSingleTimeCommands(commandBuffer);
-}
+    viewRects.assign(viewsNum, {});
+    viewRects[0] = { { 0, 0 }, swapChainExtent };
+    viewerModels.resize(viewsNum);
+    viewerModels[0] = playerModel;
+    viewTargets.assign(viewsNum, {});
 
-VkResult LRenderer::createTextureSampler(VkSampler& samplerOut, uint32 mipLevels)
-{
-    if (textureSamplers.find(mipLevels) == textureSamplers.end())
-    {
-        VkSamplerCreateInfo samplerInfo{};
-        samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-        samplerInfo.magFilter = VK_FILTER_LINEAR;
-        samplerInfo.minFilter = VK_FILTER_LINEAR;
-        samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-        samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-        samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-        samplerInfo.anisotropyEnable = VK_TRUE;
-        samplerInfo.maxAnisotropy = getMaxAnisotropy(physicalDevice);
-        samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-        samplerInfo.unnormalizedCoordinates = VK_FALSE;
-        samplerInfo.compareEnable = VK_FALSE;
-        samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
-        samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-        samplerInfo.mipLodBias = 0.0f;
-        samplerInfo.minLod = 0.0f;
-        samplerInfo.maxLod = mipLevels;
-        return vkCreateSampler(logicalDevice, &samplerInfo, nullptr, &samplerOut);
-    }
-    return VK_SUCCESS;
-}
+    auto makeCandidate = [this](uint32 viewIndex, uint32 portalIndex, uint32 parentViewIndex) -> std::optional<PortalCandidate>
+        {
+            const VkRect2D rect = computePortalRect(portalIndex, parentViewIndex);
+            if (rect.extent.width == 0 || rect.extent.height == 0 || !isPortalVisible(portalIndex, parentViewIndex))
+            {
+                return std::nullopt;
+            }
+            return PortalCandidate{ viewIndex, portalIndex, rect, static_cast<uint64>(rect.extent.width) * rect.extent.height };
+        };
 
-void LRenderer::createTextureImageView(Image& imageInOut, uint32 mipLevels)
-{
-    imageInOut.imageView = createImageView(imageInOut.image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT, mipLevels);
-}
+    uint32 visiblePortalsNum = 0;
 
-void LRenderer::initStaticDataTextures()
-{
-    for (const auto& [path,_] : texturesInitData)
+    if (bStencil)
     {
-        // TODO: temporar check
-        if (path.find("portal") != 0)
+        for (uint32 viewIndex = 1; viewIndex < viewsNum; ++viewIndex)
         {
-            loadTextureImage(path);
+            viewNodes[viewIndex].portalIndex = invalidIndex;
         }
-    }
-}
 
-void LRenderer::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, VkImageAspectFlags aspect, uint32 mipLevels)
-{
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        // parents go first, a view is seen only through a visible parent, which needs its view for the test.
+        // The slots of a view are taken by the portals covering the most of it, the rest are drawn opaque
+        for (uint32 parentIndex = 0; parentIndex < viewsNum; ++parentIndex)
+        {
+            const ViewNode& parent = viewNodes[parentIndex];
+            if (parent.childrenNum == 0 || (parentIndex != 0 && parent.portalIndex == invalidIndex))
+            {
+                continue;
+            }
 
-    VkImageMemoryBarrier barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = oldLayout;
-    barrier.newLayout = newLayout;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = image;
-    barrier.subresourceRange.aspectMask = aspect;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = mipLevels;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
+            slotCandidates.clear();
+            for (uint32 portalIndex = 0; portalIndex < maxPortalNum; ++portalIndex)
+            {
+                // the exit portal is the near plane of the view, nothing is seen through it. Unlinked portals lead nowhere
+                if (getExitPortalIndex(portalIndex) == invalidIndex || (parentIndex != 0 && portalIndex == getExitPortalIndex(parent.portalIndex)))
+                {
+                    continue;
+                }
 
-    VkPipelineStageFlags sourceStage;
-    VkPipelineStageFlags destinationStage;
+                if (const std::optional<PortalCandidate> candidate = makeCandidate(invalidIndex, portalIndex, parentIndex))
+                {
+                    slotCandidates.push_back(*candidate);
+                }
+            }
+            visiblePortalsNum += static_cast<uint32>(slotCandidates.size());
 
-    if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) 
-    {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            const uint32 slotsNum = std::min(parent.childrenNum, static_cast<uint32>(slotCandidates.size()));
+            std::partial_sort(slotCandidates.begin(), slotCandidates.begin() + slotsNum, slotCandidates.end(),
+                [](const PortalCandidate& a, const PortalCandidate& b) { return a.coverage != b.coverage ? a.coverage > b.coverage : a.portalIndex < b.portalIndex; });
 
-        sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+            for (uint32 slotIndex = 0; slotIndex < slotsNum; ++slotIndex)
+            {
+                PortalCandidate& candidate = slotCandidates[slotIndex];
+                candidate.viewIndex = parent.firstChild + slotIndex;
+
+                viewNodes[candidate.viewIndex].portalIndex = candidate.portalIndex;
+                viewRects[candidate.viewIndex] = candidate.rect;
+                updatePortalView(candidate.viewIndex);
+
+                portalCandidates.push_back(candidate);
+            }
+        }
     }
-    else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) 
+    else
     {
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        for (uint32 portalIndex = 0; portalIndex < maxPortalNum; ++portalIndex)
+        {
+            if (getExitPortalIndex(portalIndex) == invalidIndex)
+            {
+                continue;
+            }
 
-        sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+            if (const std::optional<PortalCandidate> candidate = makeCandidate(invalidIndex, portalIndex, 0))
+            {
+                portalCandidates.push_back(*candidate);
+            }
+        }
+        visiblePortalsNum = static_cast<uint32>(portalCandidates.size());
     }
-    else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) 
+
+    // a child is clipped by the rect of its parent, so with ties going by view index parents are scheduled first
+    std::sort(portalCandidates.begin(), portalCandidates.end(), [](const PortalCandidate& a, const PortalCandidate& b)
+        {
+            if (a.coverage != b.coverage)
+            {
+                return a.coverage > b.coverage;
+            }
+            return a.viewIndex != b.viewIndex ? a.viewIndex < b.viewIndex : a.portalIndex < b.portalIndex;
+        });
+
+    const uint32 passesBudget = maxPortalPasses > 0 ? std::min(maxPortalPasses, viewsNum - 1) : viewsNum - 1;
+
+    for (const PortalCandidate& candidate : portalCandidates)
     {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        if (portalSchedule.size() == passesBudget)
+        {
+            break;
+        }
+
+        uint32 viewIndex = candidate.viewIndex;
+        if (bStencil)
+        {
+            // a parent over the budget hides its subtree
+            if (!isViewActive(viewNodes[viewIndex].parent))
+            {
+                continue;
+            }
+        }
+        else
+        {
+            viewIndex = static_cast<uint32>(portalSchedule.size()) + 1;
+            viewNodes[viewIndex].portalIndex = candidate.portalIndex;
+            viewRects[viewIndex] = candidate.rect;
+            updatePortalView(viewIndex);
+            assignPortalTarget(viewIndex);
+        }
 
-        sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        destinationStage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+        activeViewsMask |= 1u << viewIndex;
+        portalSchedule.push_back(viewIndex);
     }
-    else 
+
+    // slots left over keep nothing from the previous frame
+    for (uint32 viewIndex = static_cast<uint32>(portalSchedule.size()) + 1; !bStencil && viewIndex < viewsNum; ++viewIndex)
     {
-        RAISE_VK_ERROR("unsupported layout transition!")
+        viewNodes[viewIndex].portalIndex = invalidIndex;
     }
 
-    vkCmdPipelineBarrier(
-        commandBuffer,
-        sourceStage, destinationStage,
-        0,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier
-    );
-
-    endSingleTimeCommands(commandBuffer);
+    TracyPlot("Visible portals", static_cast<int64_t>(visiblePortalsNum));
+    TracyPlot("Portal passes", static_cast<int64_t>(portalSchedule.size()));
 }
 
-void LRenderer::copyBufferToImage(VkBuffer buffer, VkImage image, uint32 width, uint32 height)
+void LRenderer::updatePortalView(uint32 viewIndex)
 {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+    const ViewNode& node = viewNodes[viewIndex];
+    const uint32 exitPortalIndex = getExitPortalIndex(node.portalIndex);
+
+    // x and y of the portal projection are the ones of the main view, so the rect bounds its frustum too
+    const glm::vec2 extent(static_cast<float>(swapChainExtent.width), static_cast<float>(swapChainExtent.height));
+    const VkRect2D& rect = viewRects[viewIndex];
+    const glm::vec2 ndcMin = glm::vec2(rect.offset.x, rect.offset.y) / extent * 2.0f - 1.0f;
+    const glm::vec2 ndcMax = glm::vec2(rect.offset.x + rect.extent.width, rect.offset.y + rect.extent.height) / extent * 2.0f - 1.0f;
+
+    // the near plane of the oblique projection is the exit portal, so it culls what's behind the portal too
+    viewerModels[viewIndex] = computePortalViewer(node.portalIndex, exitPortalIndex, viewerModels[node.parent]);
+    const glm::mat4 portalView = computeViewerView(viewerModels[viewIndex]);
+    const glm::mat4 portalProjection = computePortalProjection(exitPortalIndex, portalView);
+    const glm::mat4 portalProjView = portalProjection * portalView;
+    viewTable[viewIndex] = { portalView, portalProjection, portalProjView, extractFrustumPlanes(portalProjView, ndcMin, ndcMax), extent };
+}
 
-    VkBufferImageCopy region{};
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
+bool LRenderer::isPortalVisible(uint32 portalIndex, uint32 parentViewIndex)
+{
+    const LG::LPortal* portal = getPortal(portalIndex);
+    if (!portal)
+    {
+        return false;
+    }
 
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
+    // corners of the local box of the quad against the frustum of the parent view, conservative as the BVH test
+    const std::array<glm::vec3, 8> corners = computeBoxCorners(RenderComponentBuilder::getMeshBounds(portal->getMeshName()), portal->getModelMatrix());
 
-    region.imageOffset = { 0, 0, 0 };
-    region.imageExtent = {
-        width,
-        height,
-        1
-    };
+    for (const glm::vec4& plane : viewTable[parentViewIndex].frustumPlanes)
+    {
+        const bool bOutside = std::all_of(corners.begin(), corners.end(),
+            [&plane](const glm::vec3& corner) { return glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f; });
 
-    vkCmdCopyBufferToImage(
-        commandBuffer,
-        buffer,
-        image,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        1,
-        &region
-    );
+        if (bOutside)
+        {
+            return false;
+        }
+    }
 
-    endSingleTimeCommands(commandBuffer);
+    return true;
 }
 
-void LRenderer::generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32 mipLevels)
+VkRect2D LRenderer::computePortalRect(uint32 portalIndex, uint32 parentViewIndex)
 {
-    VkFormatProperties formatProperties;
-    vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat, &formatProperties);
+    const VkRect2D& fullRect = viewRects[parentViewIndex];
 
-    if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)) 
+    const LG::LPortal* portal = getPortal(portalIndex);
+    if (!portal)
     {
-        RAISE_VK_ERROR("texture image format does not support linear blitting!");
+        return fullRect;
     }
 
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-    VkImageMemoryBarrier barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.image = image;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-    barrier.subresourceRange.levelCount = 1;
-
-    int32 mipWidth = texWidth;
-    int32 mipHeight = texHeight;
+    const std::array<glm::vec3, 8> corners = computeBoxCorners(RenderComponentBuilder::getMeshBounds(portal->getMeshName()), portal->getModelMatrix());
 
-    for (uint32 i = 1; i < mipLevels; i++) 
+    glm::vec2 ndcMin(std::numeric_limits<float>::max());
+    glm::vec2 ndcMax(std::numeric_limits<float>::lowest());
+    for (const glm::vec3& corner : corners)
     {
-        barrier.subresourceRange.baseMipLevel = i - 1;
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        const glm::vec4 clip = viewTable[parentViewIndex].projView * glm::vec4(corner, 1.0f);
 
-        vkCmdPipelineBarrier(commandBuffer,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-            0, nullptr,
-            0, nullptr,
-            1, &barrier);
+        // the quad crosses the camera plane, its projection is unbounded
+        if (clip.w <= 0.0f)
+        {
+            return fullRect;
+        }
 
-        VkImageBlit blit{};
-        blit.srcOffsets[0] = { 0, 0, 0 };
-        blit.srcOffsets[1] = { mipWidth, mipHeight, 1 };
-        blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        blit.srcSubresource.mipLevel = i - 1;
-        blit.srcSubresource.baseArrayLayer = 0;
-        blit.srcSubresource.layerCount = 1;
-        blit.dstOffsets[0] = { 0, 0, 0 };
-        blit.dstOffsets[1] = { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1, 1 };
-        blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        blit.dstSubresource.mipLevel = i;
-        blit.dstSubresource.baseArrayLayer = 0;
-        blit.dstSubresource.layerCount = 1;
+        const glm::vec2 ndc = glm::vec2(clip) / clip.w;
+        ndcMin = glm::min(ndcMin, ndc);
+        ndcMax = glm::max(ndcMax, ndc);
+    }
 
-        vkCmdBlitImage(commandBuffer,
-            image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-            image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            1, &blit,
-            VK_FILTER_LINEAR);
+    // a coarse rect changes less often, so recorded passes are reused while the camera moves a bit
+    const glm::vec2 extent(static_cast<float>(swapChainExtent.width), static_cast<float>(swapChainExtent.height));
+    const glm::vec2 pixelMin = glm::clamp((ndcMin * 0.5f + 0.5f) * extent, glm::vec2(0.0f), extent);
+    const glm::vec2 pixelMax = glm::clamp((ndcMax * 0.5f + 0.5f) * extent, glm::vec2(0.0f), extent);
+
+    // the parent rect is aligned too, so the clipped one stays aligned
+    const uint32 x0 = std::max(static_cast<uint32>(pixelMin.x) / portalRectAlignment * portalRectAlignment, static_cast<uint32>(fullRect.offset.x));
+    const uint32 y0 = std::max(static_cast<uint32>(pixelMin.y) / portalRectAlignment * portalRectAlignment, static_cast<uint32>(fullRect.offset.y));
+    const uint32 x1 = std::min((static_cast<uint32>(std::ceil(pixelMax.x)) + portalRectAlignment - 1) / portalRectAlignment * portalRectAlignment, fullRect.offset.x + fullRect.extent.width);
+    const uint32 y1 = std::min((static_cast<uint32>(std::ceil(pixelMax.y)) + portalRectAlignment - 1) / portalRectAlignment * portalRectAlignment, fullRect.offset.y + fullRect.extent.height);
+
+    VkRect2D rect{};
+    rect.offset = { static_cast<int32>(x0), static_cast<int32>(y0) };
+    rect.extent = { x1 > x0 ? x1 - x0 : 0, y1 > y0 ? y1 - y0 : 0 };
+    return rect;
+}
 
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+void LRenderer::updateViewTable()
+{
+    ZoneScoped;
 
-        vkCmdPipelineBarrier(commandBuffer,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-            0, nullptr,
-            0, nullptr,
-            1, &barrier);
+    updateProjView();
 
-        if (mipWidth > 1)
-        {
-            mipWidth /= 2;
-        }
-        if (mipHeight > 1)
-        {
-            mipHeight /= 2;
-        }
-    }
+    // portals are rendered into targets of the swapchain size
+    const glm::vec2 extent(static_cast<float>(swapChainExtent.width), static_cast<float>(swapChainExtent.height));
 
-    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
-    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    viewTable.resize(getViewsNum());
+    viewTable[0] = { view, projection, projView, extractFrustumPlanes(projView), extent };
 
-    vkCmdPipelineBarrier(commandBuffer,
-        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
-        0, nullptr,
-        0, nullptr,
-        1, &barrier);
+    // inactive views keep stale entries, nothing reads them
+    schedulePortalViews();
 
-    endSingleTimeCommands(commandBuffer);
+    const VkDeviceSize size = viewTable.size() * sizeof(ViewData);
+    memcpy(viewBuffer.getRegion(currentFrame), viewTable.data(), size);
+
+    // no-op for HOST_COHERENT memory
+    vmaFlushAllocation(allocator, viewBuffer.memory, currentFrame * viewBuffer.regionSize, size);
 }
 
-VkResult LRenderer::createCommandPool()
+void LRenderer::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage properties,
+                             VkBuffer& buffer, VmaAllocation& bufferMemory, uint32 vmaFlags)
 {
-    QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+    VkBufferCreateInfo bufferInfo{};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = usage;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    VkCommandPoolCreateInfo poolInfo{};
-    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = properties;
+    allocInfo.flags = vmaFlags;
 
-    return vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &commandPool);
+    HANDLE_VK_ERROR(vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &buffer, &bufferMemory, nullptr))
 }
 
-VkFormat LRenderer::findSupportedFormat(const std::vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features)
+void LRenderer::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size)
 {
-    for (VkFormat format : candidates) 
-    {
-        VkFormatProperties props;
-        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &props);
-        if (tiling == VK_IMAGE_TILING_LINEAR && (props.linearTilingFeatures & features) == features) 
-        {
-            return format;
-        }
-        else if (tiling == VK_IMAGE_TILING_OPTIMAL && (props.optimalTilingFeatures & features) == features) 
-        {
-            return format;
-        }
-    }
-    RAISE_VK_ERROR("failed to find supported format!")
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+    VkBufferCopy copyRegion{};
+    copyRegion.size = size;
+    vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+    endSingleTimeCommands(commandBuffer);
 }
 
-VkFormat LRenderer::findDepthFormat()
+LRenderer::MeshRange LRenderer::uploadMesh(const std::vector<LG::LGraphicsComponent::Vertex>& vertices, const std::vector<uint16>& indices)
 {
-    return findSupportedFormat(
-        { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
-    );
+    ZoneScoped;
+
+    MeshRange meshRange;
+    meshRange.vertexOffset = static_cast<int32>(appendToArena(geometryArena.vertexBuffer, geometryArena.vertexMemory, geometryArena.verticesNum, geometryArena.verticesCapacity,
+        vertices.data(), static_cast<uint32>(vertices.size()), sizeof(LG::LGraphicsComponent::Vertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT));
+    meshRange.firstIndex = appendToArena(geometryArena.indexBuffer, geometryArena.indexMemory, geometryArena.indicesNum, geometryArena.indicesCapacity,
+        indices.data(), static_cast<uint32>(indices.size()), sizeof(uint16), VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+    meshRange.indicesCount = static_cast<uint32>(indices.size());
+
+    return meshRange;
 }
 
-VkCommandBuffer LRenderer::beginSingleTimeCommands()
+uint32 LRenderer::appendToArena(VkBuffer& buffer, VmaAllocation& memory, uint32& elementsNum, uint32& capacity,
+    const void* data, uint32 count, uint32 elementSize, VkBufferUsageFlags usage)
 {
-    VkCommandBufferAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = commandPool;
-    allocInfo.commandBufferCount = 1;
+    const uint32 first = elementsNum;
+    const VkDeviceSize size = static_cast<VkDeviceSize>(count) * elementSize;
 
-    VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffer);
+    VkBuffer stagingBuffer;
+    VmaAllocation stagingBufferMemory;
+    createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO, stagingBuffer, stagingBufferMemory, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
 
-    VkCommandBufferBeginInfo beginInfo{};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    void* mappedData = nullptr;
+    vmaMapWrap(allocator, &stagingBufferMemory, mappedData);
+    memcpy(mappedData, data, size);
+    vmaUnmapWrap(allocator, &stagingBufferMemory);
 
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
-    return commandBuffer;
-}
+    if (first + count > capacity)
+    {
+        const VkBuffer oldBuffer = buffer;
+        const VmaAllocation oldMemory = memory;
 
-void LRenderer::endSingleTimeCommands(VkCommandBuffer commandBuffer)
-{
-    vkEndCommandBuffer(commandBuffer);
+        capacity = std::max({ first + count, capacity * 2, arenaInitialCapacity });
+        createBuffer(static_cast<VkDeviceSize>(capacity) * elementSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+            VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, buffer, memory);
 
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
+        if (oldBuffer != VK_NULL_HANDLE)
+        {
+            VkBufferCopy copyRegion{};
+            copyRegion.size = static_cast<VkDeviceSize>(first) * elementSize;
+            vkCmdCopyBuffer(commandBuffer, oldBuffer, buffer, 1, &copyRegion);
 
-    vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphicsQueue);
+            // frames in flight may still draw from the old buffer
+            retireBuffer(oldBuffer, oldMemory);
+        }
+    }
 
-    vkFreeCommandBuffers(logicalDevice, commandPool, 1, &commandBuffer);
+    VkBufferCopy copyRegion{};
+    copyRegion.dstOffset = static_cast<VkDeviceSize>(first) * elementSize;
+    copyRegion.size = size;
+    vkCmdCopyBuffer(commandBuffer, stagingBuffer, buffer, 1, &copyRegion);
+
+    endSingleTimeCommands(commandBuffer);
+    vmaDestroyBufferWrap(allocator, stagingBuffer, &stagingBufferMemory);
+
+    elementsNum += count;
+    return first;
 }
 
-void LRenderer::updateStaticStorageBuffer(/*uint32 imageIndex*/)
+void LRenderer::createInstancesStorageBuffers()
 {
-    ZoneScoped;
-    uint64 instancedArraysSize = staticPreloadedInstancedMeshes.size();
+     if (primitiveCounterInitData.empty())
+     {
+         return;
+     }
 
-    int32 instancedArrayNum = 0;
-    for (const auto& [primitiveName, primitives] : staticPreloadedInstancedMeshes)
-    {
-        // buffer array
-        VkBuffer bufferToCopy = primitivesData[instancedArrayNum].buffer;
-        const auto& indices = primitiveDataIndices[primitiveName];
-        bool bIsPortal = primitiveName == "LPortal";
+     primitivesData.resize(primitiveCounterInitData.size());
 
-#if _MSC_VER
-        std::for_each(std::execution::par_unseq, indices.begin(), indices.end(), [&](uint32 i)
-        {
-            if (auto objectPtr = primitives[i].lock())
-            {
-                assert(!objectPtr->getColorTexturePath().empty() && "Please, make sure that you set up a color texture to your mesh");
-                SSBOData data =
-                {
-                    .genericMatrix = objectPtr->getModelMatrix(),
-                    .textureId = texturesInitData[objectPtr->getColorTexturePath()],
-                    .isPortal = bIsPortal    
-                };
-                memcpy((uint8_t*)stagingBufferPtr + i * sizeof(SSBOData), &data, sizeof(SSBOData));
-            }
-            else
-            {
-                // Object is expired. Handle accordingly if needed.
-            }
-        });
-#elif __APPLE__
-        // Decide on the number of threads based on the number of available cores
-        size_t numThreads = std::thread::hardware_concurrency();
-        size_t chunkSize = indices.size() / numThreads;
-        
-        // Vector to store threads
-        std::vector<std::thread> threads;
+     // primitiveCounter is only an initial estimate, buckets grow when it's exceeded
+     uint32 instancedArrayNum = 0;
+     for (const auto& [primitiveName, primitivesNum] : primitiveCounterInitData)
+     {
+         ObjectDataBuffer& primitiveData = primitivesData[instancedArrayNum];
+         createInstanceBuffer(primitiveData, std::max(primitivesNum, 1u));
+         primitiveData.transforms = std::make_unique<LTransformStore>();
 
-        // Launch threads
-        for (size_t t = 0; t < numThreads; ++t) 
-        {
-            size_t startIdx = t * chunkSize;
-            size_t endIdx = (t == numThreads - 1) ? indices.size() : startIdx + chunkSize;
-            
-            threads.emplace_back([this, &primitives, &indices, startIdx, endIdx, bIsPortal]() 
-                {
-                    for (size_t i = startIdx; i < endIdx; ++i) {
-                        if (auto objectPtr = primitives[i].lock()) 
-                        {
-                            SSBOData data
-                            {
-                                .genericMatrix = objectPtr->getModelMatrix(),
-                                .textureId = texturesInitData[objectPtr->getColorTexturePath()],
-                                .isPortal = bIsPortal
-                            };
-                            memcpy((uint8_t*)stagingBufferPtr + i * sizeof(SSBOData), &data, sizeof(SSBOData));
-                        } 
-                        else 
-                        {
-                            // Object is expired. Handle accordingly if needed.
-                        }
-                    }
-                }
-            );
-        }
+         if (primitiveName.getId() >= instancedArrayIndices.size())
+         {
+             instancedArrayIndices.resize(primitiveName.getId() + 1, invalidIndex);
+         }
+         instancedArrayIndices[primitiveName.getId()] = instancedArrayNum++;
+     }
 
-        // Join threads
-        for (auto& thread : threads) 
-        {
-            thread.join();
-        }
-#endif
+     createInstanceDrawBuffer();
+}
+
+void LRenderer::createInstanceDrawBuffer()
+{
+    ZoneScoped;
 
-        ++instancedArrayNum;
+    const VkDeviceSize alignment = getMinStorageBufferOffsetAlignment();
+    const uint32 bucketsNum = static_cast<uint32>(primitivesData.size());
 
-        copyBuffer(stagingBuffer.buffer, bufferToCopy, primitives.size() * sizeof(SSBOData));
+    uint32 visibleNum = 0;
+    for (ObjectDataBuffer& primitiveData : primitivesData)
+    {
+        primitiveData.drawBase = visibleNum;
+        visibleNum += primitiveData.capacity;
     }
-}
 
-//void LRenderer::setProjection(float degrees, float zNear, float zFar)
-//{
-//    glm::mat4 proj = glm::perspective(glm::radians(degrees), swapChainExtent.width / (float) swapChainExtent.height, zNear, zFar);
-//    proj[1][1] *= -1;
-//    projection = proj;
-//    bNeedToUpdateProjView = true;
-//}
+    drawData.visibleListNum = visibleNum;
+    drawData.visibleListSize = visibleNum * sizeof(SSBOData);
 
-void LRenderer::setProjection(float degrees, float width, float height, float zNear, float zFar)
-{
-    glm::mat4 proj = glm::perspective(glm::radians(degrees), width / height, zNear, zFar);
-    proj[1][1] *= -1;
-    projection = proj;
-}
+    const VkDeviceSize commandsSize = getViewsNum() * bucketsNum * sizeof(VkDrawIndexedIndirectCommand);
+    drawData.commandsSize = (commandsSize + alignment - 1) & ~(alignment - 1);
 
-void LRenderer::setView(const glm::mat4& viewIn)
-{
-    view = viewIn;
-}
+    const VkDeviceSize regionSize = drawData.commandsSize + getViewsNum() * drawData.visibleListSize;
+    drawData.regionSize = (regionSize + alignment - 1) & ~(alignment - 1);
 
-glm::vec3 LRenderer::getCameraUp() const
-{
-    return cameraUp;
+    // culling results are rebuilt every frame, nothing to migrate
+    if (drawData.buffer != VK_NULL_HANDLE)
+    {
+        retireBuffer(drawData.buffer, drawData.memory);
+        drawData.outdatedDescriptorsMask = (1u << maxFramesInFlight) - 1;
+    }
+
+    createBuffer(drawData.regionSize * maxFramesInFlight,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO,
+        drawData.buffer, drawData.memory);
 }
 
-glm::vec3 LRenderer::getCameraFront() const
+void LRenderer::createBatchBuffer(uint32 capacity)
 {
-    return cameraFront;
+    ZoneScoped;
+
+    const VkDeviceSize alignment = getMinStorageBufferOffsetAlignment();
+
+    const VkDeviceSize regionSize = sizeof(SSBOData) * capacity;
+    batchData.regionSize = (regionSize + alignment - 1) & ~(alignment - 1);
+    batchData.capacity = capacity;
+
+    // entries are rewritten every frame, nothing to migrate
+    if (batchData.buffer != VK_NULL_HANDLE)
+    {
+        retireBuffer(batchData.buffer, batchData.memory);
+        batchData.outdatedDescriptorsMask = (1u << maxFramesInFlight) - 1;
+    }
+
+    createBuffer(batchData.regionSize * maxFramesInFlight, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO,
+        batchData.buffer, batchData.memory, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+    VmaAllocationInfo allocationInfo{};
+    vmaGetAllocationInfo(allocator, batchData.memory, &allocationInfo);
+    batchData.mapped = static_cast<uint8*>(allocationInfo.pMappedData);
 }
 
-glm::vec3 LRenderer::getCameraPosition() const
+void LRenderer::createViewBuffer()
 {
-    return cameraPosition;
+    const VkDeviceSize alignment = getMinStorageBufferOffsetAlignment();
+
+    const VkDeviceSize regionSize = sizeof(ViewData) * getViewsNum();
+    viewBuffer.regionSize = (regionSize + alignment - 1) & ~(alignment - 1);
+
+    createBuffer(viewBuffer.regionSize * maxFramesInFlight, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO,
+        viewBuffer.buffer, viewBuffer.memory, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+    VmaAllocationInfo allocationInfo{};
+    vmaGetAllocationInfo(allocator, viewBuffer.memory, &allocationInfo);
+    viewBuffer.mapped = static_cast<uint8*>(allocationInfo.pMappedData);
 }
 
-void LRenderer::setCameraFront(const glm::vec3& cameraFront)
+void LRenderer::createInstanceBuffer(ObjectDataBuffer& primitiveData, uint32 capacity)
 {
-    this->cameraFront = cameraFront;
-    setView(glm::lookAt(cameraPosition, cameraPosition + cameraFront, cameraUp));
+    // every frame in flight gets its own region, so CPU writes never race with GPU reads of the previous frame
+    const VkDeviceSize alignment = getMinStorageBufferOffsetAlignment();
+
+    // candidates of a view never exceed the number of instances
+    const VkDeviceSize entriesSize = sizeof(SSBOData) * capacity;
+    primitiveData.entriesSize = (entriesSize + alignment - 1) & ~(alignment - 1);
+
+    const VkDeviceSize candidateListSize = sizeof(uint32) * (ObjectDataBuffer::candidatesHeaderNum + capacity);
+    primitiveData.candidateListSize = (candidateListSize + alignment - 1) & ~(alignment - 1);
+
+    primitiveData.regionSize = primitiveData.entriesSize + getViewsNum() * primitiveData.candidateListSize;
+    primitiveData.capacity = capacity;
+
+    // transfer usage is for the migration to a bigger buffer, indirect one for the cull dispatches
+    createBuffer(primitiveData.regionSize * maxFramesInFlight,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO,
+        primitiveData.buffer, primitiveData.memory, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+
+    VmaAllocationInfo allocationInfo{};
+    vmaGetAllocationInfo(allocator, primitiveData.memory, &allocationInfo);
+    primitiveData.mapped = static_cast<uint8*>(allocationInfo.pMappedData);
 }
 
-void LRenderer::setCameraPosition(const glm::vec3& cameraPosition)
+void LRenderer::growInstanceBuffer(ObjectDataBuffer& primitiveData, uint32 requiredCapacity)
 {
-    this->cameraPosition = cameraPosition;
-    setView(glm::lookAt(cameraPosition, cameraPosition + cameraFront, cameraUp));
+    ZoneScoped;
+
+    const VkBuffer oldBuffer = primitiveData.buffer;
+    const VmaAllocation oldMemory = primitiveData.memory;
+    const VkDeviceSize oldRegionSize = primitiveData.regionSize;
+    const VkDeviceSize oldEntriesSize = primitiveData.entriesSize;
+
+    createInstanceBuffer(primitiveData, std::max(requiredCapacity, primitiveData.capacity * 2));
+
+    // mapped memory may be write-combined, so the regions are migrated by the GPU instead of being read back.
+    // Candidates are rewritten every frame, only the entries are copied
+    std::array<VkBufferCopy, maxFramesInFlight> copyRegions{};
+    for (uint32 i = 0; i < maxFramesInFlight; ++i)
+    {
+        copyRegions[i].srcOffset = i * oldRegionSize;
+        copyRegions[i].dstOffset = i * primitiveData.regionSize;
+        copyRegions[i].size = oldEntriesSize;
+    }
+
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+    vkCmdCopyBuffer(commandBuffer, oldBuffer, primitiveData.buffer, static_cast<uint32>(copyRegions.size()), copyRegions.data());
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT | VK_ACCESS_HOST_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    endSingleTimeCommands(commandBuffer);
+    vmaInvalidateAllocation(allocator, primitiveData.memory, 0, VK_WHOLE_SIZE);
+
+    // frames in flight may still read the old buffer, its descriptor sets are rewritten once they retire
+    retireBuffer(oldBuffer, oldMemory);
+    primitiveData.outdatedDescriptorsMask = (1u << maxFramesInFlight) - 1;
+
+    // ranges of the following buckets in the visible lists are shifted
+    createInstanceDrawBuffer();
 }
 
-void LRenderer::initProjection()
+void LRenderer::updateDrawDescriptor(uint32 frame)
 {
-    setProjection(degrees, swapChainExtent.width, swapChainExtent.height);
+    VkDescriptorBufferInfo visibleInfo{};
+    visibleInfo.buffer = drawData.buffer;
+    visibleInfo.offset = frame * drawData.regionSize + drawData.commandsSize;
+    visibleInfo.range = getViewsNum() * drawData.visibleListSize;
+
+    VkDescriptorBufferInfo commandsInfo{};
+    commandsInfo.buffer = drawData.buffer;
+    commandsInfo.offset = frame * drawData.regionSize;
+    commandsInfo.range = drawData.commandsSize;
+
+    std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+
+    descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[0].dstSet = descriptorSets[frame];
+    descriptorWrites[0].dstBinding = 0;
+    descriptorWrites[0].dstArrayElement = 0;
+    descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[0].descriptorCount = 1;
+    descriptorWrites[0].pBufferInfo = &visibleInfo;
+
+    descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[1].dstSet = descriptorSets[frame];
+    descriptorWrites[1].dstBinding = 2;
+    descriptorWrites[1].dstArrayElement = 0;
+    descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[1].descriptorCount = 1;
+    descriptorWrites[1].pBufferInfo = &commandsInfo;
+
+    vkUpdateDescriptorSets(logicalDevice, static_cast<uint32>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
 }
 
-void LRenderer::initView()
+void LRenderer::updateViewDescriptor(uint32 frame)
 {
-    glm::mat4 viewMatrix = glm::lookAt(cameraPosition, cameraPosition + cameraFront, cameraUp);
-    setView(viewMatrix);
+    VkDescriptorBufferInfo bufferInfo{};
+    bufferInfo.buffer = viewBuffer.buffer;
+    bufferInfo.offset = frame * viewBuffer.regionSize;
+    bufferInfo.range = viewBuffer.regionSize;
+
+    VkWriteDescriptorSet descriptorWrite{};
+    descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrite.dstSet = descriptorSets[frame];
+    descriptorWrite.dstBinding = 6;
+    descriptorWrite.dstArrayElement = 0;
+    descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrite.descriptorCount = 1;
+    descriptorWrite.pBufferInfo = &bufferInfo;
+
+    vkUpdateDescriptorSets(logicalDevice, 1, &descriptorWrite, 0, nullptr);
 }
 
-void LRenderer::updateProjView()
+void LRenderer::updateBatchDescriptor(uint32 frame)
 {
-    projView = projection * view;
+    VkDescriptorBufferInfo bufferInfo{};
+    bufferInfo.buffer = batchData.buffer;
+    bufferInfo.offset = frame * batchData.regionSize;
+    bufferInfo.range = batchData.regionSize;
+
+    VkWriteDescriptorSet descriptorWrite{};
+    descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrite.dstSet = descriptorSets[frame];
+    descriptorWrite.dstBinding = 5;
+    descriptorWrite.dstArrayElement = 0;
+    descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrite.descriptorCount = 1;
+    descriptorWrite.pBufferInfo = &bufferInfo;
+
+    vkUpdateDescriptorSets(logicalDevice, 1, &descriptorWrite, 0, nullptr);
 }
 
-void LRenderer::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage properties,
-                             VkBuffer& buffer, VmaAllocation& bufferMemory, uint32 vmaFlags)
+void LRenderer::updateInstanceDescriptor(uint32 frame, uint32 instancedArrayNum)
 {
-    VkBufferCreateInfo bufferInfo{};
-    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferInfo.size = size;
-    bufferInfo.usage = usage;
-    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    VmaAllocationCreateInfo allocInfo = {};
-    allocInfo.usage = properties;
-    allocInfo.flags = vmaFlags;
-
-    HANDLE_VK_ERROR(vmaCreateBuffer(allocator, &bufferInfo, &allocInfo, &buffer, &bufferMemory, nullptr))
+    const ObjectDataBuffer& primitiveData = primitivesData[instancedArrayNum];
+
+    VkDescriptorBufferInfo bufferInfo{};
+    bufferInfo.buffer = primitiveData.buffer;
+    bufferInfo.offset = frame * primitiveData.regionSize;
+    bufferInfo.range = primitiveData.entriesSize;
+
+    VkDescriptorBufferInfo candidatesInfo{};
+    candidatesInfo.buffer = primitiveData.buffer;
+    candidatesInfo.offset = frame * primitiveData.regionSize + primitiveData.entriesSize;
+    candidatesInfo.range = primitiveData.regionSize - primitiveData.entriesSize;
+
+    // element of the bucket in the buffer arrays
+    std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+
+    descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[0].dstSet = descriptorSets[frame];
+    descriptorWrites[0].dstBinding = 3;
+    descriptorWrites[0].dstArrayElement = instancedArrayNum;
+    descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[0].descriptorCount = 1;
+    descriptorWrites[0].pBufferInfo = &bufferInfo;
+
+    descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[1].dstSet = descriptorSets[frame];
+    descriptorWrites[1].dstBinding = 4;
+    descriptorWrites[1].dstArrayElement = instancedArrayNum;
+    descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrites[1].descriptorCount = 1;
+    descriptorWrites[1].pBufferInfo = &candidatesInfo;
+
+    vkUpdateDescriptorSets(logicalDevice, static_cast<uint32>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
 }
 
-void LRenderer::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size)
+void LRenderer::retireBuffer(VkBuffer buffer, VmaAllocation memory)
 {
-    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+    retiredBuffers.push_back({ buffer, memory, (1u << maxFramesInFlight) - 1 });
 
-    VkBufferCopy copyRegion{};
-    copyRegion.size = size;
-    vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-    endSingleTimeCommands(commandBuffer);
+    // recorded command buffers may still reference it
+    ++recordedCommandsVersion;
 }
 
-void LRenderer::createInstancesStorageBuffers()
+void LRenderer::releaseRetiredInstanceBuffers()
 {
-     VkDeviceSize globalBufferSize = findProperStageBufferSize();
-
-     if (globalBufferSize == 0)
-     {
-         return;
-     }
-
-     // stage buffer to copy from CPU to GPU
-     createBuffer(globalBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO, stagingBuffer.buffer, stagingBuffer.memory, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
-     vmaMapMemory(allocator, stagingBuffer.memory, &stagingBufferPtr);
+    // called right after inFlightFences[currentFrame] is waited, so nothing reads the sets of currentFrame anymore
+    const uint32 frameBit = 1u << currentFrame;
+    bool bUpdatedDescriptors = false;
 
-     uint64 instancedArraysSize = primitiveCounterInitData.size();
+    if (drawData.outdatedDescriptorsMask & frameBit)
+    {
+        updateDrawDescriptor(currentFrame);
+        drawData.outdatedDescriptorsMask &= ~frameBit;
+        bUpdatedDescriptors = true;
+    }
 
-     primitivesData.resize(instancedArraysSize /** maxFramesInFlight*/);
+    if (batchData.outdatedDescriptorsMask & frameBit)
+    {
+        updateBatchDescriptor(currentFrame);
+        batchData.outdatedDescriptorsMask &= ~frameBit;
+        bUpdatedDescriptors = true;
+    }
 
-     //for (uint32 i = 0; i < maxFramesInFlight; ++i)
-     {
-         uint32 instancedArrayNum = 0;
-         for (const auto& [_, primitivesNum] : primitiveCounterInitData)
-         {
-             uint32 index = /*instancedArraysSize +*/ instancedArrayNum;
-             auto bufferSize = sizeof(SSBOData) * primitivesNum;
-             createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, primitivesData[index].buffer, primitivesData[index].memory);
-             ++instancedArrayNum;
-         }
-     }
+    for (uint32 instancedArrayNum = 0; instancedArrayNum < primitivesData.size(); ++instancedArrayNum)
+    {
+        ObjectDataBuffer& primitiveData = primitivesData[instancedArrayNum];
+        if (primitiveData.outdatedDescriptorsMask & frameBit)
+        {
+            updateInstanceDescriptor(currentFrame, instancedArrayNum);
+            primitiveData.outdatedDescriptorsMask &= ~frameBit;
+            bUpdatedDescriptors = true;
+        }
+    }
 
-     for (const auto& [primitiveName, primitivesNum] : primitiveCounterInitData)
-     {
-         std::vector<uint32> indices(primitivesNum);
-         std::iota(indices.begin(), indices.end(), 0);
-         primitiveDataIndices.emplace(std::make_pair(primitiveName, indices));
-     }
-}
+    // these bindings aren't update-after-bind, the writes invalidate the command buffers which bound the set
+    if (bUpdatedDescriptors)
+    {
+        ++recordedCommandsVersion;
+    }
 
-uint32 LRenderer::findProperStageBufferSize() const
-{
-    uint32 maxprimitiveCounterInitData = 0;
-    for (const auto& [_, counter] : primitiveCounterInitData)
+    for (uint64 i = 0; i < retiredBuffers.size();)
     {
-        uint32 primitivesNum = counter;
-        if (primitivesNum > maxprimitiveCounterInitData)
+        RetiredBuffer& retiredBuffer = retiredBuffers[i];
+        retiredBuffer.pendingFramesMask &= ~frameBit;
+
+        if (retiredBuffer.pendingFramesMask == 0)
+        {
+            vmaDestroyBuffer(allocator, retiredBuffer.buffer, retiredBuffer.memory);
+            retiredBuffers[i] = retiredBuffers.back();
+            retiredBuffers.pop_back();
+        }
+        else
         {
-            maxprimitiveCounterInitData = primitivesNum;
+            ++i;
         }
     }
-    return maxprimitiveCounterInitData * sizeof(SSBOData);
+}
+
+VkDeviceSize LRenderer::getMinStorageBufferOffsetAlignment() const
+{
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+    return std::max<VkDeviceSize>(deviceProperties.limits.minStorageBufferOffsetAlignment, 1);
 }
 
 void LRenderer::vmaMapWrap(VmaAllocator allocator, VmaAllocation* memory, void*& mappedData)
@@ -1519,17 +3483,29 @@ void LRenderer::vmaDestroyBufferWrap(VmaAllocator allocator, VkBuffer& buffer, V
     vmaDestroyBuffer(allocator, buffer, *memory);
 }
 
-VkResult LRenderer::createCommandBuffers()
+VkResult LRenderer::createPassCommandPools()
 {
-    commandBuffers.resize(maxFramesInFlight);
-    
-    VkCommandBufferAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool = commandPool;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandBufferCount = static_cast<uint32>(commandBuffers.size());
+    QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+    // recorded buffers are kept while they are reused, each one is reset when it's begun again
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
 
-    return vkAllocateCommandBuffers(logicalDevice, &allocInfo, commandBuffers.data());
+    passCommandPools.resize(maxFramesInFlight);
+    for (std::vector<PassCommandPool>& framePools : passCommandPools)
+    {
+        framePools.resize(jobSystem->getThreadsNum());
+        for (PassCommandPool& passPool : framePools)
+        {
+            HANDLE_VK_ERROR(vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &passPool.pool))
+        }
+    }
+
+    recordedFrames.resize(maxFramesInFlight);
+
+    return VK_SUCCESS;
 }
 
 uint32 LRenderer::findMemoryType(uint32 typeFilter, VkMemoryPropertyFlags properties)
@@ -1550,91 +3526,91 @@ uint32 LRenderer::findMemoryType(uint32 typeFilter, VkMemoryPropertyFlags proper
 
 VkResult LRenderer::createDescriptorPool()
 {
+    const uint32 bucketsNum = static_cast<uint32>(primitiveCounterInitData.size());
+
+    // one set per frame: visible lists, commands, batches, views, instances and candidates of every bucket, textures
     std::array<VkDescriptorPoolSize, 2> poolSizes{};
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    poolSizes[0].descriptorCount = static_cast<uint32>(maxFramesInFlight) * primitiveCounterInitData.size();
+    poolSizes[0].descriptorCount = maxFramesInFlight * (4 + 2 * bucketsNum);
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    poolSizes[1].descriptorCount = static_cast<uint32>(maxFramesInFlight) * primitiveCounterInitData.size() * texturesInitData.size();
+    poolSizes[1].descriptorCount = maxFramesInFlight * static_cast<uint32>(textureNames.size());
 
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = static_cast<uint32>(poolSizes.size());
     poolInfo.pPoolSizes = poolSizes.data();
-    poolInfo.maxSets = static_cast<uint32>(maxFramesInFlight) * primitiveCounterInitData.size();
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    poolInfo.maxSets = maxFramesInFlight;
 
     return vkCreateDescriptorPool(logicalDevice, &poolInfo, nullptr, &descriptorPool);
 }
 
 VkResult LRenderer::createDescriptorSets()
 {
-     std::vector<VkDescriptorSetLayout> layouts(static_cast<uint32>(maxFramesInFlight) * primitiveCounterInitData.size(), descriptorSetLayout);
+     std::vector<VkDescriptorSetLayout> layouts(maxFramesInFlight, descriptorSetLayout);
      VkDescriptorSetAllocateInfo allocInfo{};
      allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
      allocInfo.descriptorPool = descriptorPool;
-     allocInfo.descriptorSetCount = static_cast<uint32>(maxFramesInFlight) * primitiveCounterInitData.size();
+     allocInfo.descriptorSetCount = maxFramesInFlight;
      allocInfo.pSetLayouts = layouts.data();
     
      descriptorSets.resize(allocInfo.descriptorSetCount);
      HANDLE_VK_ERROR(vkAllocateDescriptorSets(logicalDevice, &allocInfo, descriptorSets.data()))
-         
+
+
      for (uint32 i = 0; i < maxFramesInFlight; ++i)
      {
-         uint32 instancedArrayNum = 0;
-         for (auto it = primitiveCounterInitData.begin(); it != primitiveCounterInitData.end(); ++it)
+         // buffer bindings
+         if (!primitivesData.empty())
+         {
+             updateDrawDescriptor(i);
+         }
+
+         for (uint32 instancedArrayNum = 0; instancedArrayNum < primitivesData.size(); ++instancedArrayNum)
+         {
+             updateInstanceDescriptor(i, instancedArrayNum);
+         }
+
+         updateBatchDescriptor(i);
+         updateViewDescriptor(i);
+
+         std::vector<VkDescriptorImageInfo> imageDescriptors;
+         imageDescriptors.resize(textureNames.size());
+
+         for (auto& [path, image] : images)
+         {
+             VkDescriptorImageInfo imageInfo{};
+             imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+             imageInfo.imageView = image.imageView;
+             imageInfo.sampler = textureSamplers[image.mipLevels];
+
+             uint32 textureIndex = getTextureId(path);
+             imageDescriptors[textureIndex] = imageInfo;
+         }
+
+         for (uint32 j = 0; j < maxPortalNum; ++j)
          {
-             auto& [_, primitivesNum] = *it;
-
-             VkDescriptorBufferInfo bufferInfo{};
-             bufferInfo.buffer = primitivesData[instancedArrayNum].buffer;
-             bufferInfo.offset = 0;
-             bufferInfo.range = sizeof(SSBOData) * primitivesNum;
-
-             std::vector<VkDescriptorImageInfo> imageDescriptors;
-             imageDescriptors.resize(texturesInitData.size());
-
-             for (auto& [path, image] : images)
-             {
-                 VkDescriptorImageInfo imageInfo{};
-                 imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                 imageInfo.imageView = image.imageView;
-                 imageInfo.sampler = textureSamplers[image.mipLevels];
-
-                 uint32 textureIndex = texturesInitData[path];
-                 imageDescriptors[textureIndex] = imageInfo;
-             }
-
-             for (uint32 j = 0; j < maxPortalNum; ++j)
-             {
-                 VkDescriptorImageInfo imageInfo{};
-                 imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                 imageInfo.imageView = portalsRt[j]->images[i].imageView;
-                 imageInfo.sampler = portalSampler;
-
-                 uint32 textureIndex = texturesInitData[std::format("portal{}", j + 1)];
-                 imageDescriptors[textureIndex] = imageInfo;
-             }
-
-             std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
-
-             descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-             descriptorWrites[0].dstSet = descriptorSets[i * primitiveCounterInitData.size() + instancedArrayNum];
-             descriptorWrites[0].dstBinding = 0;
-             descriptorWrites[0].dstArrayElement = 0;
-             descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-             descriptorWrites[0].descriptorCount = 1;
-             descriptorWrites[0].pBufferInfo = &bufferInfo;
-
-             descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-             descriptorWrites[1].dstSet = descriptorSets[i * primitiveCounterInitData.size() + instancedArrayNum];
-             descriptorWrites[1].dstBinding = 1;
-             descriptorWrites[1].dstArrayElement = 0;
-             descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-             descriptorWrites[1].descriptorCount = imageDescriptors.size();
-             descriptorWrites[1].pImageInfo = imageDescriptors.data();
-
-             vkUpdateDescriptorSets(logicalDevice, static_cast<uint32>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
-             ++instancedArrayNum;
+             // offscreen portals get their targets once they're scheduled. Stencil portals have none,
+             // their masks still sample the slot with the color writes off
+             VkDescriptorImageInfo imageInfo{};
+             imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+             imageInfo.imageView = portalFallbackImage.imageView;
+             imageInfo.sampler = portalSampler;
+
+             uint32 textureIndex = getTextureId(LName(std::format("portal{}", j + 1)));
+             imageDescriptors[textureIndex] = imageInfo;
          }
+
+         VkWriteDescriptorSet descriptorWrite{};
+         descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+         descriptorWrite.dstSet = descriptorSets[i];
+         descriptorWrite.dstBinding = 1;
+         descriptorWrite.dstArrayElement = 0;
+         descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+         descriptorWrite.descriptorCount = imageDescriptors.size();
+         descriptorWrite.pImageInfo = imageDescriptors.data();
+
+         vkUpdateDescriptorSets(logicalDevice, 1, &descriptorWrite, 0, nullptr);
      }
 
      return VK_SUCCESS;
@@ -1663,7 +3639,7 @@ VkResult LRenderer::createSyncObjects()
     return VK_SUCCESS;
 }
 
-void LRenderer::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32 imageIndex)
+VkCommandBuffer LRenderer::recordCommandBuffer(uint32 imageIndex)
 {
     ZoneScoped;
 
@@ -1673,6 +3649,63 @@ void LRenderer::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32 imageI
         bUpdatedStaticStorageBuffer = true;
     }
 
+    // views are known before any pass, culling of all of them is dispatched at once
+    updateViewTable();
+
+    cullRegularMeshes();
+    batchRegularMeshes();
+    buildDrawQueue();
+
+    const uint32 viewsNum = getViewsNum();
+    RecordedFrame& recordedFrame = getRecordedFrame(imageIndex);
+    const uint64 signature = computeFrameSignature();
+
+    // the camera and the instances only change buffer contents, the recorded commands stay valid
+    if (bReuseCommandBuffers && recordedFrame.bRecorded && recordedFrame.signature == signature)
+    {
+        collectInstanceCandidates();
+
+        TracyPlot("Reused command buffers", static_cast<int64_t>(1));
+        return recordedFrame.commandBuffer;
+    }
+
+    TracyPlot("Reused command buffers", static_cast<int64_t>(0));
+
+    // the fence of the frame is waited, so the old secondary buffers can be recorded again
+    for (const PassCommandBuffer& pass : recordedFrame.passes)
+    {
+        if (pass.commandBuffer != VK_NULL_HANDLE)
+        {
+            passCommandPools[currentFrame][pass.threadIndex].freeCommandBuffers.push_back(pass.commandBuffer);
+        }
+    }
+
+    recordedFrame.passes.assign(viewsNum, {});
+    recordedFrame.bRecorded = false;
+    passBindStates.resize(viewsNum);
+
+    // passes only read the results of the frame, they are recorded while the instances are culled
+    // stencil portal views are subpasses of the main pass, offscreen ones have targets of their own
+    VkFramebuffer mainFramebuffer = swapChainRt->framebuffers[imageIndex];
+    const bool bStencilPortals = portalMode == PortalMode::Stencil;
+
+    std::vector<LJobSystem::JobHandle> passJobs;
+    // the biggest portals start recording first
+    for (uint32 viewIndex : portalSchedule)
+    {
+        const uint32 portalIndex = viewNodes[viewIndex].portalIndex;
+        VkRenderPass renderPass = bStencilPortals ? mainPass->getRenderPass() : portalPass->getRenderPass();
+        VkFramebuffer framebuffer = bStencilPortals ? mainFramebuffer : getPortalTarget(viewTargets[viewIndex])->framebuffers[0];
+        passJobs.push_back(jobSystem->schedule([this, &recordedFrame, viewIndex, renderPass, framebuffer]() { recordPass(recordedFrame, viewIndex, renderPass, framebuffer); }));
+    }
+
+    passJobs.push_back(jobSystem->schedule([this, &recordedFrame, mainFramebuffer]() { recordPass(recordedFrame, 0, mainPass->getRenderPass(), mainFramebuffer); }));
+
+    collectInstanceCandidates();
+
+    VkCommandBuffer commandBuffer = recordedFrame.commandBuffer;
+    HANDLE_VK_ERROR(vkResetCommandBuffer(commandBuffer, 0))
+
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = 0; // Optional
@@ -1680,40 +3713,62 @@ void LRenderer::recordCommandBuffer(VkCommandBuffer commandBuffer, uint32 imageI
 
     HANDLE_VK_ERROR(vkBeginCommandBuffer(commandBuffer, &beginInfo))
 
-    VkViewport viewport{};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = static_cast<float>(swapChainExtent.width);
-    viewport.height = static_cast<float>(swapChainExtent.height);
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-
-    VkRect2D scissor{};
-    scissor.offset = { 0, 0 };
-    scissor.extent = swapChainExtent;
-    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    cullInstances(commandBuffer);
 
-    //glm::mat4 savedView = getView();
+    {
+        ZoneScopedN("Wait pass recording");
+        jobSystem->wait(passJobs);
+    }
 
     // TODO: Ideally these pass calls should be incapsulated inside RenderPass->render(), but there is some work to do...
+    if (bStencilPortals)
     {
-        ZoneScopedN("Portal passes");
+        // a view goes right after the masks of its parent, and its own children go before its siblings
+        std::vector<VkCommandBuffer> passCommandBuffers;
+        for (uint32 viewIndex : viewExecutionOrder)
+        {
+            if (isViewActive(viewIndex))
+            {
+                passCommandBuffers.push_back(recordedFrame.passes[viewIndex].commandBuffer);
+            }
+        }
 
-        storedView = view;
+        mainPass->beginPass(commandBuffer, mainFramebuffer, viewRects[0], VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        vkCmdExecuteCommands(commandBuffer, static_cast<uint32>(passCommandBuffers.size()), passCommandBuffers.data());
+        mainPass->endPass(commandBuffer);
+    }
+    else
+    {
+        for (uint32 viewIndex : portalSchedule)
+        {
+            portalPass->beginPass(commandBuffer, getPortalTarget(viewTargets[viewIndex])->framebuffers[0], viewRects[viewIndex], VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            vkCmdExecuteCommands(commandBuffer, 1, &recordedFrame.passes[viewIndex].commandBuffer);
+            portalPass->endPass(commandBuffer);
+        }
 
-        doPortalPass(commandBuffer, portalsRt[0]->framebuffers[currentFrame], portalPasses[0], 0, 1);
-        doPortalPass(commandBuffer, portalsRt[1]->framebuffers[currentFrame], portalPasses[1], 1, 0);
+        mainPass->beginPass(commandBuffer, mainFramebuffer, viewRects[0], VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        vkCmdExecuteCommands(commandBuffer, 1, &recordedFrame.passes[0].commandBuffer);
+        mainPass->endPass(commandBuffer);
     }
 
+    HANDLE_VK_ERROR(vkEndCommandBuffer(commandBuffer))
+
+    recordedFrame.signature = signature;
+    recordedFrame.bRecorded = true;
+
+    // the skipped ones would be issued by binding per draw
+    uint32 issuedBinds = 0;
+    uint32 skippedBinds = 0;
+    for (const GraphicsBindState& passBindState : passBindStates)
     {
-        ZoneScopedN("Main pass");
-        view = storedView;
-        updateProjView();
-        doMainPass(commandBuffer, swapChainRt->framebuffers[imageIndex]);
+        issuedBinds += passBindState.issuedBinds;
+        skippedBinds += passBindState.skippedBinds;
     }
 
-    HANDLE_VK_ERROR(vkEndCommandBuffer(commandBuffer))
+    TracyPlot("Binds issued", static_cast<int64_t>(issuedBinds));
+    TracyPlot("Binds saved", static_cast<int64_t>(skippedBinds));
+
+    return commandBuffer;
 }
 
 void LRenderer::recreateSwapChain()
@@ -1734,14 +3789,22 @@ void LRenderer::recreateSwapChain()
     createSwapChain();
     createFramebuffers(swapChainRt.get(), swapChainExtent, swapChainSize, mainPass->getRenderPass());
 
-    for (uint32 i = 0; i < portalsRt.size(); ++i)
+    // pools are resized, every portal goes back to the fallback target until it's scheduled again
+    if (portalPass)
     {
-        auto& portalRt = portalsRt[i];
-
-        portalRt->clear();
-        createFramebuffers(portalRt.get(), swapChainExtent, portalSize, portalPasses[i]->getRenderPass());
+        createPortalTargetPools();
+        for (uint32 frame = 0; frame < maxFramesInFlight; ++frame)
+        {
+            for (uint32 portalIndex = 0; portalIndex < maxPortalNum; ++portalIndex)
+            {
+                updatePortalDescriptor(frame, portalIndex);
+            }
+        }
     }
 
+    // recorded frames reference the destroyed framebuffers
+    ++recordedCommandsVersion;
+
     initProjection();
 }
 
@@ -1755,6 +3818,8 @@ void LRenderer::drawFrame(float delta)
         vkWaitForFences(logicalDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
     }
 
+    releaseRetiredInstanceBuffers();
+
     VkResult result;
     {
         ZoneScopedN("Acquire next image");
@@ -1771,11 +3836,11 @@ void LRenderer::drawFrame(float delta)
         RAISE_VK_ERROR(result)
     }
     
+    VkCommandBuffer commandBuffer;
     {
         ZoneScopedN("Rerecording command buffer");
         vkResetFences(logicalDevice, 1, &inFlightFences[currentFrame]);
-        vkResetCommandBuffer(commandBuffers[currentFrame], 0);
-        recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+        commandBuffer = recordCommandBuffer(imageIndex);
     }
     
     VkSubmitInfo submitInfo{};
@@ -1787,7 +3852,7 @@ void LRenderer::drawFrame(float delta)
     submitInfo.pWaitSemaphores = waitSemaphores;
     submitInfo.pWaitDstStageMask = waitStages;
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+    submitInfo.pCommandBuffers = &commandBuffer;
     
     VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
     submitInfo.signalSemaphoreCount = 1;
@@ -1886,11 +3951,16 @@ VkResult LRenderer::createLogicalDevice()
 
     VkPhysicalDeviceFeatures deviceFeatures{};
     deviceFeatures.samplerAnisotropy = VK_TRUE;
+    deviceFeatures.multiDrawIndirect = VK_TRUE;
+    deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+    deviceFeatures.shaderStorageBufferArrayDynamicIndexing = VK_TRUE;
 
     VkPhysicalDeviceVulkan12Features deviceFeatures12{};
     deviceFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
     deviceFeatures12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
     deviceFeatures12.runtimeDescriptorArray = VK_TRUE;
+    deviceFeatures12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    deviceFeatures12.descriptorBindingPartiallyBound = VK_TRUE;
 
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -1948,10 +4018,25 @@ bool LRenderer::isDeviceSuitable(VkPhysicalDevice device) const
         swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
     }
 
-    VkPhysicalDeviceFeatures supportedFeatures;
-    vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
+    VkPhysicalDeviceVulkan12Features supportedFeatures12{};
+    supportedFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+    VkPhysicalDeviceFeatures2 supportedFeatures2{};
+    supportedFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supportedFeatures2.pNext = &supportedFeatures12;
+    vkGetPhysicalDeviceFeatures2(device, &supportedFeatures2);
+
+    const VkPhysicalDeviceFeatures& supportedFeatures = supportedFeatures2.features;
     
-    return extensionsSupported && swapChainAdequate && indices.isValid() && supportedFeatures.samplerAnisotropy;
+    // all instanced buckets are drawn with one indirect call, a bucket is selected with firstInstance
+    const bool bMultiDrawIndirect = supportedFeatures.multiDrawIndirect && supportedFeatures.drawIndirectFirstInstance;
+
+    // one set per frame: buffer arrays indexed by the bucket, textures updated after bind
+    const bool bBindless = supportedFeatures.shaderStorageBufferArrayDynamicIndexing && supportedFeatures12.runtimeDescriptorArray &&
+        supportedFeatures12.shaderSampledImageArrayNonUniformIndexing && supportedFeatures12.descriptorBindingSampledImageUpdateAfterBind &&
+        supportedFeatures12.descriptorBindingPartiallyBound;
+
+    return extensionsSupported && swapChainAdequate && indices.isValid() && supportedFeatures.samplerAnisotropy && bMultiDrawIndirect && bBindless;
 }
 
 bool LRenderer::checkDeviceExtensionSupport(VkPhysicalDevice device) const
@@ -2184,46 +4269,114 @@ uint32 LRenderer::getMaxAnisotropy(VkPhysicalDevice physicalDeviceIn) const
     return deviceProperties.limits.maxSamplerAnisotropy;
 }
 
-void LRenderer::addPrimitive(std::weak_ptr<LG::LGraphicsComponent> ptr)
+void LRenderer::addPrimitive(LG::LGraphicsComponent* component)
 {
-    if (auto sharedPtr = ptr.lock())
+    const LG::LPrimitiveType& primitiveType = component->getPrimitiveType();
+    const LName typeName = primitiveType.typeName;
+    component->registryHandle = objects.insert(component);
+
+    if (!component->texturePath.isNone())
+    {
+        component->textureId = getTextureId(component->texturePath);
+    }
+
+    auto addInstance = [this, component, &primitiveType]()
     {
-        const auto& typeName = sharedPtr->getTypeName();
+        ObjectDataBuffer& primitiveData = primitivesData[getInstancedArrayIndex(primitiveType.typeName)];
+        primitiveData.meshName = primitiveType.meshName;
+        primitiveData.bIsPortal = primitiveType.traits.bPortal;
 
-        if (LG::isPortal(sharedPtr.get()))
+        if (primitiveData.instances.empty())
         {
-            portals.emplace_back(std::reinterpret_pointer_cast<LG::LPortal>(sharedPtr));
-            auto& staticInstancesArray = staticPreloadedInstancedMeshes[typeName];
-            staticInstancesArray.emplace_back(ptr);
+            primitiveData.boundingSphere = RenderComponentBuilder::getMeshBounds(primitiveType.meshName).sphere;
         }
-        else if (isEnoughStaticInstanceSpace(typeName) && LG::isInstancePrimitive(sharedPtr.get()))
+
+        uint32 slot = primitiveData.transforms->allocate();
+
+        if (slot >= primitiveData.capacity)
         {
-            auto& staticInstancesArray = staticPreloadedInstancedMeshes[typeName];
-            staticInstancesArray.emplace_back(ptr);
+            growInstanceBuffer(primitiveData, slot + 1);
         }
-        else
+
+        component->transformStore = primitiveData.transforms.get();
+        component->transformSlot = slot;
+        component->instanceIndex = slot;
+
+        // freed slots are reused, so the array only grows when the store does
+        if (slot >= primitiveData.instances.size())
         {
-            primitiveMeshes.push_back(ptr);
+            primitiveData.instances.resize(slot + 1);
         }
+        primitiveData.instances[slot] = component->registryHandle;
+
+        // the initial data has to be uploaded anyway
+        component->bDirty = false;
+        component->markDirty();
+    };
+
+    if (primitiveType.traits.bPortal)
+    {
+        portals.emplace_back(component->registryHandle);
+    }
+
+    // user primitives opt in with PipelineType::Instanced traits and a primitiveCounter entry
+    if (primitiveType.traits.isInstanceable() && hasInstancedArray(typeName))
+    {
+        addInstance();
+    }
+    else
+    {
+        component->transformStore = &regularTransforms;
+        component->transformSlot = regularTransforms.allocate();
+        primitiveMeshes.push_back(component->registryHandle);
     }
 }
 
-DEBUG_CODE(void LRenderer::addDebugPrimitive(std::weak_ptr<LG::LGraphicsComponent> ptr)
+DEBUG_CODE(void LRenderer::addDebugPrimitive(LG::LGraphicsComponent* component)
 {
-    debugMeshes.push_back(ptr);
+    component->registryHandle = objects.insert(component);
+    debugMeshes.push_back(component->registryHandle);
 })
 
+void LRenderer::removePrimitive(LG::LGraphicsComponent* component)
+{
+    if (!objects.erase(component->registryHandle))
+    {
+        return;
+    }
+
+    if (component->transformStore)
+    {
+        component->transformStore->free(component->transformSlot);
+    }
+
+    if (component->instanceIndex != LG::LGraphicsComponent::invalidInstanceIndex)
+    {
+        // slot stays in the instance buffer until it's reused, upload it with zero scale
+        markInstanceDirty(component->getTypeName(), component->instanceIndex);
+    }
+}
+
+LG::LPortal* LRenderer::getPortal(uint32 portalIndex)
+{
+    if (LG::LGraphicsComponent** portalPtr = objects.get(portals[portalIndex]))
+    {
+        return static_cast<LG::LPortal*>(*portalPtr);
+    }
+    return nullptr;
+}
+
 bool LRenderer::needPortalRecalculation() const
 {
     if (maxPortalNum == 0)
     {
         return false;
     }
-    for (uint32 i = 0; i < portals.size(); ++i)
+    for (LSlotMapHandle portalHandle : portals)
     {
-        if (std::shared_ptr<LG::LPortal> portalPtr = portals[i].lock())
+        if (LG::LGraphicsComponent* const* portalPtr = objects.get(portalHandle))
         {
-            if (portalPtr->needsRecalculation())
+            if (static_cast<const LG::LPortal*>(*portalPtr)->needsRecalculation())
             {
                 return true;
             }
@@ -2304,7 +4457,7 @@ void LRenderer::RenderPass::init(VkFormat colorFormat, VkFormat depthFormat)
     depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
     depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
     depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depthAttachment.stencilLoadOp = hasStencilComponent(depthFormat) ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
@@ -2354,14 +4507,13 @@ void LRenderer::RenderPass::init(VkFormat colorFormat, VkFormat depthFormat)
     HANDLE_VK_ERROR(vkCreateRenderPass(logicalDevice, &renderPassInfo, nullptr, &renderPass))
 }
 
-void LRenderer::RenderPass::beginPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, const VkExtent2D& size)
+void LRenderer::RenderPass::beginPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, const VkRect2D& renderArea, VkSubpassContents contents)
 {
     VkRenderPassBeginInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderPassInfo.renderPass = renderPass;
     renderPassInfo.framebuffer = framebuffer;
-    renderPassInfo.renderArea.offset = { 0, 0 };
-    renderPassInfo.renderArea.extent = size;
+    renderPassInfo.renderArea = renderArea;
 
     std::array<VkClearValue, 2> clearValues{};
     clearValues[0].color = { {0.0f, 0.0f, 0.0f, 1.0f} };
@@ -2370,7 +4522,7 @@ void LRenderer::RenderPass::beginPass(VkCommandBuffer commandBuffer, VkFramebuff
     renderPassInfo.clearValueCount = static_cast<uint32>(clearValues.size());
     renderPassInfo.pClearValues = clearValues.data();
 
-    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, contents);
 }
 
 void LRenderer::RenderPass::endPass(VkCommandBuffer commandBuffer)
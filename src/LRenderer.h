@@ -17,6 +17,13 @@
 
 #include "LWindow.h"
 #include "Primitives.h"
+#include "LTransformStore.h"
+#include "LSlotMap.h"
+#include "LJobSystem.h"
+#include "LName.h"
+#include "LFrustumCulling.h"
+#include "LBVH.h"
+#include "LDrawQueue.h"
 
 #include <vma/vk_mem_alloc.h>
 
@@ -29,6 +36,7 @@
 class LRenderer
 {
 	friend class RenderComponentBuilder;
+	friend class LG::LGraphicsComponent;
 	
 public:
 
@@ -36,26 +44,96 @@ public:
 	glm::mat4 playerModel;
 	glm::quat playerOrientation;
 
+	// Offscreen - every portal view is rendered into a target of its own, the portal surface samples it.
+	// Stencil - portal views are rendered into the main framebuffer inside stencil masks of their portals,
+	// portals seen through portals recurse up to portalRecursionDepth
+	enum class PortalMode : uint8
+	{
+		Offscreen,
+		Stencil
+	};
+
 	struct StaticInitData
 	{
+		// instanced primitive types with their initial capacity, buckets grow past it at runtime
 		std::unordered_map<std::string, uint32> primitiveCounter;
 		std::set<std::string> textures;
 		uint32 maxPortalNum = 0;
+
+		PortalMode portalMode = PortalMode::Offscreen;
+
+		// a linked portal exits at its pair, unlinked ones show nothing. Empty - consecutive portals are paired, 0 with 1 and so on
+		std::vector<std::pair<uint32, uint32>> portalLinks;
+
+		// 0 - every visible portal view is rendered, otherwise only the ones covering the most of the screen
+		uint32 maxPortalPasses = 0;
+
+		// stencil mode only, up to 8. Every view has as many slots for the views of its portals as fit the draw key
+		// and the stencil, the portals covering the most of the view take them, the others are drawn opaque
+		uint32 portalRecursionDepth = 1;
+
+		// 0 - one worker per hardware thread except the main one
+		uint32 jobWorkersNum = 0;
+
+		// command buffers are resubmitted while the recorded draws stay the same, e.g. only the camera moves
+		bool bReuseCommandBuffers = true;
+
+		// offscreen portal views which are small on the screen or far away are rendered at a lower resolution
+		bool bAdaptivePortalResolution = true;
 	};
 	
-	struct VkMemoryBuffer
+	// range of a mesh inside the geometry arena
+	struct MeshRange
 	{
-		VkBuffer vertexBuffer, indexBuffer;
-		VmaAllocation vertexBufferMemory, indexBufferMemory;
+		uint32 firstIndex = 0;
+		int32 vertexOffset = 0;
+		uint32 indicesCount = 0;
 	};
 
+	// everything else about the view is read from the view table, so recorded push constants don't depend on the camera
 	struct PushConstants
 	{
-		glm::mat4 genericMatrix;
-		float width;
-		float height;
-		float reserved1;
-		float reserved2;
+		// model matrix of the unbatched regular meshes, unused by the instanced pipelines
+		glm::mat4 genericMatrix = glm::mat4(1.0f);
+		uint32 viewIndex;
+		uint32 reserved0 = 0;
+		uint32 reserved1 = 0;
+		uint32 reserved2 = 0;
+	};
+
+	// must match cullInstancesComp.comp
+	struct CullPushConstants
+	{
+		// local space, xyz - center, w - radius
+		glm::vec4 boundingSphere;
+
+		// element of the view table, its frustum planes are tested
+		uint32 viewIndex;
+
+		// in uint32 elements of the commands binding, firstInstance of the command is the visible list range
+		uint32 commandOffset;
+
+		// in uint32 elements of the candidates binding, points at the header of the list
+		uint32 candidatesOffset;
+
+		// element of the instance and candidate arrays
+		uint32 bucketIndex;
+	};
+
+	// element of the view table: the main camera and every portal camera, written once per frame
+	// so recorded commands don't depend on the camera. Must match the shaders
+	struct ViewData
+	{
+		glm::mat4 view;
+		glm::mat4 projection;
+		glm::mat4 projView;
+
+		// normalized, normals point inside
+		std::array<glm::vec4, 6> frustumPlanes;
+
+		// of the render target
+		glm::vec2 extent;
+		glm::vec2 reserved = glm::vec2(0.0f);
 	};
 
 	struct SSBOData
@@ -68,10 +146,33 @@ public:
 		uint32 reserved3 = 0;
 	};
 
+	// only stencil portals use the stencil aspect
+	enum class StencilUsage : uint8
+	{
+		None,
+
+		// draws of a view pass where the stencil equals the dynamic reference of the view
+		Test,
+
+		// portal surface, writes the id of the child view where it's visible. Masks and reference are dynamic
+		PortalMask,
+
+		// portal surface, resets depth to the far plane inside the region of its view
+		PortalDepthReset,
+
+		// portal surface without a view of its own, opaque, so the view behind the portal plane doesn't show through
+		PortalFallback
+	};
+
 	struct GraphicsPipelineParams
 	{
 		VkPolygonMode polygonMode;
 		bool bInstanced;
+
+		// regular meshes read their matrices from the batch buffer
+		bool bBatched = false;
+
+		StencilUsage stencilUsage = StencilUsage::None;
 	};
 
 	struct Image
@@ -107,7 +208,7 @@ public:
 		RenderPass(VkDevice logicalDevice, VkFormat colorFormat, VkFormat depthFormat, bool bToPresent);
 		virtual ~RenderPass();
 
-		void beginPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, const VkExtent2D& size);
+		void beginPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, const VkRect2D& renderArea, VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE);
 		//virtual void render() = 0;
 		void endPass(VkCommandBuffer commandBuffer);
 
@@ -167,6 +268,13 @@ public:
 	void drawFrame(float delta);
 	void exit();
 
+	// bytes written to the instance buffers during the last frame
+	uint64 getUploadedBytes() const { return uploadedBytes; }
+
+	// spatial queries over the instanced meshes, they see the transforms of the last recorded frame
+	void queryInstances(const glm::vec3& center, float radius, std::vector<LG::LGraphicsComponent*>& componentsOut) const;
+	LG::LGraphicsComponent* raycastInstances(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float* distanceOut = nullptr) const;
+
 	static LRenderer* get()
 	{
 		return thisPtr;
@@ -179,8 +287,77 @@ protected:
 	void init();
 	void cleanup();
 
-	void doPortalPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, const std::unique_ptr<RenderPass>& portalPass, uint32 portal1Ind, uint32 portal2Ind);
-	void doMainPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer, bool bSwitchRenderPass = true);
+	// model matrix of the viewer moved from the first portal to the second one
+	glm::mat4 computePortalViewer(uint32 portal1Ind, uint32 portal2Ind, const glm::mat4& viewerModel);
+	glm::mat4 computeViewerView(const glm::mat4& viewerModel) const;
+
+	// invalidIndex for an unlinked portal
+	uint32 getExitPortalIndex(uint32 portalIndex) const { return portalExits[portalIndex]; }
+
+	// projection with the near plane on the exit portal, everything between the portal camera and the portal is clipped.
+	// Falls back to the regular projection when the camera is almost on the portal plane
+	glm::mat4 computePortalProjection(uint32 exitPortalIndex, const glm::mat4& portalView);
+	static constexpr float obliquePlaneMinDistance = 1e-3f;
+
+	// the main view and the views of portals seen from their parent views, every view has its own culling results.
+	// Portal views are slots, the portals of the frame are assigned to them
+	struct ViewNode
+	{
+		uint32 parent = invalidIndex;
+
+		// portal the view is seen through, invalidIndex for an unused slot
+		uint32 portalIndex = invalidIndex;
+		uint32 depth = 0;
+
+		// children are contiguous, the tree is built breadth first
+		uint32 firstChild = 0;
+		uint32 childrenNum = 0;
+
+		// stencil mode only. The id of a view extends the id of its parent with the digit of its slot,
+		// the mask of the portal compares the parent digits and writes its own one
+		uint32 stencilRef = 0;
+		uint32 stencilCompareMask = 0;
+		uint32 stencilWriteMask = 0;
+	};
+
+	void buildViewTree();
+	uint32 getViewsNum() const { return static_cast<uint32>(viewNodes.size()); }
+
+	// portal views are rendered only when their portal is in the frustum of the parent view. Visible ones are
+	// scheduled by their screen coverage up to maxPortalPasses, the view table entries of the scheduled ones are filled
+	void schedulePortalViews();
+	void updatePortalView(uint32 viewIndex);
+	bool isPortalVisible(uint32 portalIndex, uint32 parentViewIndex);
+
+	struct PortalCandidate
+	{
+		// invalidIndex until a slot is assigned
+		uint32 viewIndex;
+		uint32 portalIndex;
+		VkRect2D rect;
+		uint64 coverage;
+	};
+
+	// screen rect of the portal in the parent view clipped by the rect of the parent, aligned out to portalRectAlignment.
+	// Portal views match the fragment coordinates of the main view, so only this rect of them is ever seen
+	VkRect2D computePortalRect(uint32 portalIndex, uint32 parentViewIndex);
+	static constexpr uint32 portalRectAlignment = 32;
+	bool isViewActive(uint32 viewIndex) const { return (activeViewsMask >> viewIndex) & 1; }
+
+	// compute pre-pass, fills the indirect commands and the visible lists of every view, must be recorded outside of render passes
+	void cullInstances(VkCommandBuffer commandBuffer);
+
+	// CPU pass over the regular meshes, fills regularVisible for every view
+	void cullRegularMeshes();
+
+	// groups the visible regular meshes of every view by mesh and writes their entries to the batch buffer
+	void batchRegularMeshes();
+
+	// keys every draw of every view and sorts them, doMainPass records the range of its view
+	void buildDrawQueue();
+
+	// passes are recorded portal views first, the main view last
+	uint32 getPassOrder(uint32 viewIndex) const { return viewIndex == 0 ? getViewsNum() - 1 : viewIndex - 1; }
 
 	bool checkValidationLayerSupport() const;
 	std::vector<const char*> getRequiredExtensions() const;
@@ -203,14 +380,15 @@ protected:
 	VkResult createAllocator();
 	VkResult createSurface();
 	VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32 mipLevels);
-	VkResult createPortalRenderTarget();
+	VkResult createPortalRenderTarget(const VkExtent2D& extent, std::unique_ptr<RenderTarget>& renderTargetOut);
 	VkResult createDescriptorSetLayout();
 	VkResult createGraphicsPipeline(const GraphicsPipelineParams& params, VkPipeline& graphicsPipelineOut, VkRenderPass renderPass);
+	VkResult createCullPipeline();
 	VkShaderModule createShaderModule(const std::vector<uint8_t>& code);
 	void createFramebuffers(RenderTarget* renderTarget, const VkExtent2D& size, uint32 framebuffersNum, VkRenderPass renderPass);
 	VkResult createImage(const std::string& texturePath, Image& imageOut);
 	VkResult createImageInternal(uint32 width, uint32 height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VmaAllocation& imageMemory, uint32 mipLevels);
-	VkResult loadTextureImage(const std::string& texturePath);
+	VkResult loadTextureImage(LName texturePath);
 	void clearUndefinedImage(VkImage imageToClear);
 	VkResult createTextureSampler(VkSampler& samplerOut, uint32 mipLevels);
 	void createTextureImageView(Image& imageInOut, uint32 mipLevels);
@@ -225,11 +403,24 @@ protected:
 	void endSingleTimeCommands(VkCommandBuffer commandBuffer);
 
 	void updateStaticStorageBuffer(/*uint32 imageIndex*/);
+	void markInstanceDirty(LName typeName, uint32 instanceIndex);
 
-	bool isEnoughStaticInstanceSpace(const std::string& typeName)
+	// unknown textures fall back to the first one
+	uint32 getTextureId(LName texturePath) const
 	{
-		uint32 counter = primitiveCounterInitData[typeName];
-		return staticPreloadedInstancedMeshes[typeName].size() < counter;
+		return texturePath.getId() < textureIndices.size() && textureIndices[texturePath.getId()] != invalidIndex ?
+			textureIndices[texturePath.getId()] : 0;
+	}
+
+	// index in primitivesData or invalidIndex
+	uint32 getInstancedArrayIndex(LName typeName) const
+	{
+		return typeName.getId() < instancedArrayIndices.size() ? instancedArrayIndices[typeName.getId()] : invalidIndex;
+	}
+
+	bool hasInstancedArray(LName typeName) const
+	{
+		return getInstancedArrayIndex(typeName) != invalidIndex;
 	}
 	
 	void initProjection();
@@ -237,65 +428,44 @@ protected:
 
 	void updateProjView();
 
-    enum class BufferType : uint8
-    {
-	    Vertex,
-    	Index
-    };
-	
+	// computes the main and portal views of the frame and uploads them to the view buffer in one write
+	void updateViewTable();
+
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage properties, VkBuffer& buffer, VmaAllocation& bufferMemory, uint32 vmaFlags = 0);
 	void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
 	void createInstancesStorageBuffers();
-	uint32 findProperStageBufferSize() const;
+	void createInstanceDrawBuffer();
+	void updateDrawDescriptor(uint32 frame);
+	void createBatchBuffer(uint32 capacity);
+	void updateBatchDescriptor(uint32 frame);
+	void createViewBuffer();
+	void updateViewDescriptor(uint32 frame);
+
+	// the buffer is destroyed when no frame in flight can read it
+	void retireBuffer(VkBuffer buffer, VmaAllocation memory);
+	void updateInstanceDescriptor(uint32 frame, uint32 instancedArrayNum);
+	void releaseRetiredInstanceBuffers();
+	VkDeviceSize getMinStorageBufferOffsetAlignment() const;
 
 	void vmaMapWrap(VmaAllocator allocator, VmaAllocation* memory, void*& mappedData);
 	void vmaUnmapWrap(VmaAllocator allocator, VmaAllocation* memory);
 	void vmaDestroyBufferWrap(VmaAllocator allocator, VkBuffer& buffer, VmaAllocation* memory);
 	
-	template<typename Buffer>
-	void createObjectBuffer(const Buffer& arrData, VkMemoryBuffer& memoryBuffer, BufferType bufferType)
-	{
-		using T = typename Buffer::value_type;
-		
-		auto memorySize = sizeof(T) * arrData.size();
-
-		VkBuffer stagingBuffer;
-		VmaAllocation stagingBufferMemory;
-		createBuffer(memorySize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO, stagingBuffer, stagingBufferMemory, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+	// appends the mesh to the geometry arena, the mesh is drawn with the offsets of the returned range
+	MeshRange uploadMesh(const std::vector<LG::LGraphicsComponent::Vertex>& vertices, const std::vector<uint16>& indices);
 
-		void* mappedData = nullptr;
-		vmaMapWrap(allocator, &stagingBufferMemory, mappedData);
-		memcpy(mappedData, arrData.data(), memorySize);
-		vmaUnmapWrap(allocator, &stagingBufferMemory);
-
-		if (bufferType == BufferType::Vertex)
-		{
-			createBuffer(memorySize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, memoryBuffer.vertexBuffer, memoryBuffer.vertexBufferMemory);
-			copyBuffer(stagingBuffer, memoryBuffer.vertexBuffer, memorySize);	
-		}
-
-		else
-		{
-			createBuffer(memorySize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE, memoryBuffer.indexBuffer, memoryBuffer.indexBufferMemory);
-			copyBuffer(stagingBuffer, memoryBuffer.indexBuffer, memorySize);	
-		}
-
-		vmaDestroyBufferWrap(allocator, stagingBuffer, &stagingBufferMemory);
-	}
-
-	void destroyObjectBuffer(VkMemoryBuffer& memoryBuffer)
-	{
-		vmaDestroyBufferWrap(allocator, memoryBuffer.vertexBuffer, &memoryBuffer.vertexBufferMemory);
-		vmaDestroyBufferWrap(allocator, memoryBuffer.indexBuffer, &memoryBuffer.indexBufferMemory);
-	}
+	// returns the first element of the appended data, the buffer grows geometrically and the old one is retired
+	uint32 appendToArena(VkBuffer& buffer, VmaAllocation& memory, uint32& elementsNum, uint32& capacity,
+		const void* data, uint32 count, uint32 elementSize, VkBufferUsageFlags usage);
 	
 	uint32 findMemoryType(uint32 typeFilter, VkMemoryPropertyFlags properties);
 
 	VkResult createDescriptorPool();
 	VkResult createDescriptorSets();
-	VkResult createCommandBuffers();
 	VkResult createSyncObjects();
-	void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32 imageIndex);
+
+	// returns the command buffer to submit, the cached one when the draws of the frame are the same
+	VkCommandBuffer recordCommandBuffer(uint32 imageIndex);
 
 	void recreateSwapChain();
 
@@ -333,8 +503,11 @@ protected:
 	uint32 getPushConstantSize(VkPhysicalDevice physicalDevice) const;
 	uint32 getMaxAnisotropy(VkPhysicalDevice physicalDeviceIn) const;
 
-	void addPrimitive(std::weak_ptr<LG::LGraphicsComponent> ptr);
-	DEBUG_CODE(void addDebugPrimitive(std::weak_ptr<LG::LGraphicsComponent> ptr);)
+	void addPrimitive(LG::LGraphicsComponent* component);
+	DEBUG_CODE(void addDebugPrimitive(LG::LGraphicsComponent* component);)
+	void removePrimitive(LG::LGraphicsComponent* component);
+
+	LG::LPortal* getPortal(uint32 portalIndex);
 
 	bool needPortalRecalculation() const;
 
@@ -373,10 +546,55 @@ protected:
 	VkExtent2D swapChainExtent;
 
 	uint32 swapChainSize = 0;
-	uint32 portalSize = 0;
 
 	std::unique_ptr<RenderTarget> swapChainRt;
-	std::vector<std::unique_ptr<RenderTarget>> portalsRt;
+
+	// offscreen portal views are rendered at 1, 1/2 or 1/4 of the swapchain size into targets pooled per resolution.
+	// A portal keeps the target of a frame slot, and the last image in it, until it's rendered at another resolution
+	static constexpr uint32 portalResolutionsNum = 3;
+	static constexpr float portalFullResolutionDistance = 8.0f;
+
+	// ratio a portal has to pass a size or distance threshold by before its resolution changes
+	static constexpr float portalResolutionHysteresis = 1.25f;
+
+	struct PortalTargetPool
+	{
+		VkExtent2D extent;
+
+		// single image targets
+		std::vector<std::unique_ptr<RenderTarget>> targets;
+		std::vector<uint32> freeTargets;
+	};
+
+	struct PortalTargetHandle
+	{
+		uint32 resolution = invalidIndex;
+		uint32 target = invalidIndex;
+	};
+
+	void createPortalTargetPools();
+	uint32 choosePortalResolution(uint32 viewIndex);
+	void assignPortalTarget(uint32 viewIndex);
+	RenderTarget* getPortalTarget(const PortalTargetHandle& handle) { return portalTargetPools[handle.resolution].targets[handle.target].get(); }
+
+	// portals without a target of the frame slot sample the fallback one
+	void updatePortalDescriptor(uint32 frame, uint32 portalIndex);
+
+	// cleared 1x1 image, never rendered. Stencil portal masks sample it too, so no portal slot is left without an image
+	VkResult createPortalFallbackImage();
+
+	std::array<PortalTargetPool, portalResolutionsNum> portalTargetPools;
+	Image portalFallbackImage{};
+
+	// [frame][portal]
+	std::vector<std::vector<PortalTargetHandle>> portalTargets;
+
+	// per portal, resolution it was last rendered at by any frame slot
+	std::vector<uint32> portalResolutions;
+
+	// per view, target of the offscreen portal view of the frame
+	std::vector<PortalTargetHandle> viewTargets;
+	bool bAdaptivePortalResolution = true;
 
 	std::unordered_map<uint32, VkSampler> textureSamplers;
 
@@ -385,23 +603,37 @@ protected:
 
 	VkPipeline graphicsPipelineInstanced;
 	VkPipeline graphicsPipelineRegular;
+	VkPipeline graphicsPipelineBatched;
 	VkPipeline debugGraphicsPipeline;
 
+	// stencil mode only
+	VkPipeline graphicsPipelinePortalMask = VK_NULL_HANDLE;
+	VkPipeline graphicsPipelinePortalDepthReset = VK_NULL_HANDLE;
+	VkPipeline graphicsPipelinePortalFallback = VK_NULL_HANDLE;
+
 	// TODO: need to be cleared
 	VkPipeline graphicsPipelineInstancedPortal;
 	VkPipeline graphicsPipelineRegularPortal;
 
 	std::unique_ptr<RenderPass> mainPass;
-	std::vector<std::unique_ptr<RenderPass>> portalPasses;
+
+	// offscreen mode only, shared by every portal target
+	std::unique_ptr<RenderPass> portalPass;
 
 	VkDescriptorSetLayout descriptorSetLayout;
 	VkDescriptorPool descriptorPool;
+	// one per frame in flight, shared by every pipeline. Buffers of the buckets are arrays indexed by the bucket
 	std::vector<VkDescriptorSet> descriptorSets;
 	
 	VkPipelineLayout pipelineLayout = nullptr;
 
+	VkPipelineLayout cullPipelineLayout;
+	VkPipeline cullPipeline;
+
+	// local_size_x of cullInstancesComp.comp
+	static constexpr uint32 cullGroupSize = 64;
+
 	VkCommandPool commandPool;
-	std::vector<VkCommandBuffer> commandBuffers;
 
 	std::vector<VkSemaphore> imageAvailableSemaphores;
 	std::vector<VkSemaphore> renderFinishedSemaphores;
@@ -414,25 +646,199 @@ protected:
 	static const int32 maxFramesInFlight = 2;
 	uint32 currentFrame = 0;
 
+	// host visible, persistently mapped, split into maxFramesInFlight regions of regionSize bytes.
+	// Region: instance entries, then the BVH candidates of every view.
+	// A candidate list starts with the VkDispatchIndirectCommand of its cull dispatch and the candidates count
 	struct ObjectDataBuffer
 	{
 		VkBuffer buffer;
 		VmaAllocation memory;
+		uint8* mapped = nullptr;
+		VkDeviceSize regionSize = 0;
+		VkDeviceSize entriesSize = 0;
+		VkDeviceSize candidateListSize = 0;
+
+		// instances which have to be rewritten in the region of the frame, may contain duplicates
+		std::array<std::vector<uint32>, maxFramesInFlight> dirtyIndices;
+
+		// transform slot == instance slot
+		std::unique_ptr<LTransformStore> transforms;
+
+		LName meshName;
+		bool bIsPortal = false;
+
+		// indexed by instance slot
+		std::vector<LSlotMapHandle> instances;
+
+		// instances per region, grows geometrically
+		uint32 capacity = 0;
+
+		// first element of the bucket in the visible list of a view
+		uint32 drawBase = 0;
+
+		glm::vec4 boundingSphere = glm::vec4(0.0f);
+
+		// item == instance slot, world bounds of the instances
+		LBVH bvh;
+		std::vector<uint32> bvhDirtySlots;
+
+		// per view, results of the hierarchical pass which are tested per instance by cullInstances
+		std::vector<std::vector<uint32>> candidates;
+
+		// bit per frame in flight whose descriptor set still points to the previous buffer
+		uint32 outdatedDescriptorsMask = 0;
+
+		SSBOData* getRegion(uint32 frame) const
+		{
+			return reinterpret_cast<SSBOData*>(mapped + frame * regionSize);
+		}
+
+		static constexpr uint32 candidatesHeaderNum = 4;
+
+		uint32* getCandidates(uint32 frame, uint32 viewIndex) const
+		{
+			return reinterpret_cast<uint32*>(mapped + frame * regionSize + entriesSize + viewIndex * candidateListSize);
+		}
 	};
 
-	// used for multithread write
-	std::unordered_map<std::string, std::vector<uint32>> primitiveDataIndices;
-	
-	// TODO: should be destroyed
+	void createInstanceBuffer(ObjectDataBuffer& primitiveData, uint32 capacity);
+	void growInstanceBuffer(ObjectDataBuffer& primitiveData, uint32 requiredCapacity);
+
+	// job bodies of updateStaticStorageBuffer, begin/end are positions in the sorted dirty list of the current frame
+	void packInstances(ObjectDataBuffer& primitiveData, uint32 begin, uint32 end);
+	void flushInstances(const ObjectDataBuffer& primitiveData);
+
+	// rebuilds the BVH when slots were added, refits the moved instances otherwise
+	void updateInstanceHierarchy(ObjectDataBuffer& primitiveData);
+	LAABB computeInstanceBounds(const ObjectDataBuffer& primitiveData, uint32 slot) const;
+
+	// traverses the BVH of every bucket for every view and uploads the candidates of the frame
+	void collectInstanceCandidates();
+
 	std::vector<ObjectDataBuffer> primitivesData;
 
-	// TODO: should be destroyed
-	ObjectDataBuffer stagingBuffer;
-	void* stagingBufferPtr;
+	static constexpr uint32 invalidIndex = std::numeric_limits<uint32>::max();
+
+	// LName id of the primitive type -> index in primitivesData (and element of the descriptor buffer arrays)
+	std::vector<uint32> instancedArrayIndices;
+
+	// instance buffers replaced by a bigger one, destroyed when no frame in flight can read them
+	struct RetiredBuffer
+	{
+		VkBuffer buffer;
+		VmaAllocation memory;
+		uint32 pendingFramesMask = 0;
+	};
+
+	std::vector<RetiredBuffer> retiredBuffers;
+
+	// device local, per frame region: indirect command of every bucket for every view, then the visible list of every view.
+	// A visible list holds the compacted instance entries of all buckets, bucket ranges start at drawBase
+	struct InstanceDrawBuffer
+	{
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VmaAllocation memory = VK_NULL_HANDLE;
+		VkDeviceSize regionSize = 0;
+		VkDeviceSize commandsSize = 0;
+
+		// entries of one view, firstInstance of a command is viewIndex * visibleListNum + drawBase
+		uint32 visibleListNum = 0;
+		VkDeviceSize visibleListSize = 0;
+
+		// bit per frame in flight whose descriptor set still points to the previous buffer
+		uint32 outdatedDescriptorsMask = 0;
+	};
+
+	InstanceDrawBuffer drawData;
+
+	// host visible, per frame region: entries of the batched regular meshes of every view, rewritten every frame
+	struct BatchBuffer
+	{
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VmaAllocation memory = VK_NULL_HANDLE;
+		uint8* mapped = nullptr;
+		VkDeviceSize regionSize = 0;
+
+		// entries of one region
+		uint32 capacity = 0;
+
+		// bit per frame in flight whose descriptor set still points to the previous buffer
+		uint32 outdatedDescriptorsMask = 0;
+
+		SSBOData* getRegion(uint32 frame) const
+		{
+			return reinterpret_cast<SSBOData*>(mapped + frame * regionSize);
+		}
+	};
+
+	BatchBuffer batchData;
+	static constexpr uint32 batchInitialCapacity = 1024;
+
+	// host visible, per frame region: the view table, written before the frame is submitted
+	struct ViewBuffer
+	{
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VmaAllocation memory = VK_NULL_HANDLE;
+		uint8* mapped = nullptr;
+		VkDeviceSize regionSize = 0;
+
+		ViewData* getRegion(uint32 frame) const
+		{
+			return reinterpret_cast<ViewData*>(mapped + frame * regionSize);
+		}
+	};
+
+	ViewBuffer viewBuffer;
 
-	std::unordered_map<std::string, uint32> primitiveCounterInitData;
-	std::unordered_map<std::string, uint32> texturesInitData;
+	// instanced draw of the visible regular meshes sharing a mesh, firstInstance is the offset in the batch region
+	struct RegularBatch
+	{
+		LName meshName;
+		uint32 firstInstance;
+		uint32 instancesNum;
+	};
+
+	// device local, meshes are appended and never freed, so a range stays valid while the renderer lives
+	struct GeometryArena
+	{
+		VkBuffer vertexBuffer = VK_NULL_HANDLE;
+		VmaAllocation vertexMemory = VK_NULL_HANDLE;
+		VkBuffer indexBuffer = VK_NULL_HANDLE;
+		VmaAllocation indexMemory = VK_NULL_HANDLE;
+
+		// in elements
+		uint32 verticesNum = 0;
+		uint32 verticesCapacity = 0;
+		uint32 indicesNum = 0;
+		uint32 indicesCapacity = 0;
+	};
+
+	GeometryArena geometryArena;
+	static constexpr uint32 arenaInitialCapacity = 1 << 16;
+
+	std::unordered_map<LName, uint32> primitiveCounterInitData;
+
+	// texture index -> name, and LName id -> texture index or invalidIndex
+	std::vector<LName> textureNames;
+	std::vector<uint32> textureIndices;
 	uint32 maxPortalNum;
+	PortalMode portalMode;
+	uint32 portalRecursionDepth;
+	uint32 maxPortalPasses;
+
+	// portal -> exit portal or invalidIndex
+	std::vector<uint32> portalExits;
+
+	// breadth first, index 0 is the main view
+	std::vector<ViewNode> viewNodes;
+
+	// stencil mode, depth first, so every mask is drawn after the view of its portal and before the view behind it
+	std::vector<uint32> viewExecutionOrder;
+
+	std::unique_ptr<LJobSystem> jobSystem;
+
+	// dirty instances packed by one job chunk
+	uint32 instancesChunkSize = 4096;
 
 	glm::mat4 projection;
 	
@@ -445,23 +851,159 @@ protected:
 	glm::vec3 cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
 	glm::vec3 cameraUp = glm::vec3(0.0f, 1.0f, 0.0f);
 	
-	glm::mat4 storedView;
 	glm::mat4 view;
 
 	// precalculated
 	glm::mat4 projView;
 
-	std::unordered_map<std::string, Image> images;
+	// every view of the frame, index 0 is the main one, the portal cameras follow
+	std::vector<ViewData> viewTable;
+
+	// per view, scissor and render area of the pass, its frustum is narrowed to it
+	std::vector<VkRect2D> viewRects;
+
+	// per view, model matrix of the player moved through the portals of the view
+	std::vector<glm::mat4> viewerModels;
+
+	// bit per view, hidden portal views aren't culled nor rendered, their targets keep the last image
+	uint32 activeViewsMask = 1;
+
+	// active portal views of the frame, the biggest ones on the screen first
+	std::vector<uint32> portalSchedule;
+	std::vector<PortalCandidate> portalCandidates;
+
+	// stencil mode, visible portals of the view whose slots are being assigned
+	std::vector<PortalCandidate> slotCandidates;
+
+	std::unordered_map<LName, Image> images;
 	
+	// registry of every alive component, the containers below keep handles into it.
+	// Components unregister themselves on destruction, stale handles are filtered by the generation check
+	LSlotMap<LG::LGraphicsComponent*> objects;
+
 	// TODO: doesn't work properly
-	std::vector<std::weak_ptr<LG::LGraphicsComponent>> debugMeshes;
-	std::vector<std::weak_ptr<LG::LGraphicsComponent>> primitiveMeshes;
-	std::unordered_map<std::string, std::vector<std::weak_ptr<LG::LGraphicsComponent>>> staticPreloadedInstancedMeshes;
+	std::vector<LSlotMapHandle> debugMeshes;
+	std::vector<LSlotMapHandle> primitiveMeshes;
+	LTransformStore regularTransforms;
+
+	// alive regular meshes of the frame and their world spheres, regularVisible[viewIndex] indexes both
+	std::vector<LG::LGraphicsComponent*> regularMeshesFrame;
+	LSphereBatch regularSpheres;
+	std::vector<std::vector<uint32>> regularVisible;
+
+	// per view: batches of the visible meshes, and the meshes opted out of batching drawn one by one
+	std::vector<std::vector<RegularBatch>> regularBatches;
+	std::vector<std::vector<uint32>> regularUnbatched;
+
+	// in the order of the draw key field, cheaper to switch between the later ones
+	enum class DrawPipeline : uint32
+	{
+		Instanced,
+		Batched,
+		Regular
+	};
+
+	// payload of a queued draw: the bucket commands of the view, a batch of regularBatches or a mesh of regularMeshesFrame
+	struct DrawPacket
+	{
+		DrawPipeline pipeline;
+		uint32 index;
+	};
+
+	LDrawQueue drawQueue;
+	std::vector<DrawPacket> drawPackets;
+
+	// [begin, end) of the sorted draws of every view
+	std::vector<std::pair<uint32, uint32>> passDrawRanges;
+
+	// graphics state of the secondary command buffer of a pass, nothing is inherited from the primary
+	struct GraphicsBindState
+	{
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+		VkBuffer vertexBuffer = VK_NULL_HANDLE;
+		VkBuffer indexBuffer = VK_NULL_HANDLE;
+
+		// push constants hold the view index of the pass, regular draws overwrite them with their model matrix
+		bool bViewConstantsPushed = false;
+
+		uint32 issuedBinds = 0;
+		uint32 skippedBinds = 0;
+	};
+
+	// per view, written by the recording job of the pass
+	std::vector<GraphicsBindState> passBindStates;
+
+	// pipeline, descriptor set and geometry binds of a draw, the ones matching the bound state are skipped
+	void bindDrawState(VkCommandBuffer commandBuffer, GraphicsBindState& bindState, VkPipeline pipeline);
+	void pushViewConstants(VkCommandBuffer commandBuffer, GraphicsBindState& bindState, uint32 viewIndex);
+
+	// records the sorted draws of the view, the render pass is begun by the primary buffer
+	void doMainPass(VkCommandBuffer commandBuffer, uint32 viewIndex, GraphicsBindState& bindState);
+
+	// a draw call with the model matrix of the mesh in the push constants, the pipeline is bound by the caller
+	void drawRegularMesh(VkCommandBuffer commandBuffer, GraphicsBindState& bindState, const LG::LGraphicsComponent& mesh, uint32 viewIndex);
+
+	// stencil mode, the portal of the view clears depth of its region before the view is drawn,
+	// the portals of the child views mark their regions after it. Portals without an active child view,
+	// e.g. at the last recursion level or over the pass budget, are drawn opaque instead
+	void resetPortalDepth(VkCommandBuffer commandBuffer, uint32 viewIndex, GraphicsBindState& bindState);
+	void drawPortalFallbacks(VkCommandBuffer commandBuffer, uint32 viewIndex, GraphicsBindState& bindState);
+	void drawPortalMasks(VkCommandBuffer commandBuffer, uint32 viewIndex, GraphicsBindState& bindState);
+
+	// command pools are externally synchronized, so every thread records from its own pool of the frame
+	struct PassCommandPool
+	{
+		VkCommandPool pool = VK_NULL_HANDLE;
+
+		// returned by re-recorded frames, reset implicitly when they are begun
+		std::vector<VkCommandBuffer> freeCommandBuffers;
+	};
+
+	struct PassCommandBuffer
+	{
+		uint32 threadIndex = 0;
+		VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	};
+
+	// primary buffer of a frame slot and a swapchain image with the secondary buffers of its passes
+	struct RecordedFrame
+	{
+		VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+
+		// per view
+		std::vector<PassCommandBuffer> passes;
+
+		// computeFrameSignature of the recorded draws
+		uint64 signature = 0;
+		bool bRecorded = false;
+	};
+
+	// job body, records the view into a secondary buffer of the calling thread
+	void recordPass(RecordedFrame& recordedFrame, uint32 viewIndex, VkRenderPass renderPass, VkFramebuffer framebuffer);
+
+	VkResult createPassCommandPools();
+	PassCommandBuffer acquirePassCommandBuffer();
+	RecordedFrame& getRecordedFrame(uint32 imageIndex);
+
+	// hash of everything the recorded commands depend on, view matrices and instance data live in buffers
+	uint64 computeFrameSignature() const;
+
+	// [frame][thread index of the job system]
+	std::vector<std::vector<PassCommandPool>> passCommandPools;
+
+	// [frame][swapchain image], a recorded frame is only submitted from its frame slot
+	std::vector<std::vector<RecordedFrame>> recordedFrames;
+
+	// bumped by everything that invalidates recorded command buffers: retired buffers, descriptor writes, new render targets
+	uint64 recordedCommandsVersion = 0;
+	bool bReuseCommandBuffers = true;
 	
 	bool bUpdatedStaticStorageBuffer = false;
+	uint64 uploadedBytes = 0;
 	//std::unordered_map<uint32, bool> updatedStorageBuffer;
 
-	std::vector<std::weak_ptr<LG::LPortal>> portals;
+	std::vector<LSlotMapHandle> portals;
 
 	float delta;
 };
@@ -504,18 +1046,23 @@ protected:
 
 		auto object = graphicsComponent.lock();
 
-		// TODO: it worth to implement UE FName alternative to save some memory
 		if (LRenderer* renderer = LRenderer::get())
 		{
-			auto resCounter = objectsCounter.emplace(object->getTypeName(), 0);
-			auto resBuffer = memoryBuffers.emplace(object->getTypeName(), LRenderer::VkMemoryBuffer());
+			const uint32 meshId = object->getMeshName().getId();
+			if (meshId >= objectsCounter.size())
+			{
+				objectsCounter.resize(meshId + 1, 0);
+				meshRanges.resize(meshId + 1);
+				meshBounds.resize(meshId + 1);
+			}
 
-			if (resCounter.first->second++ == 0)
+			// ranges stay in the geometry arena, a mesh is uploaded once
+			if (objectsCounter[meshId]++ == 0 && meshRanges[meshId].indicesCount == 0)
 			{
-				renderer->createObjectBuffer(object->getVertexBuffer(), resBuffer.first->second, LRenderer::BufferType::Vertex);
-				renderer->createObjectBuffer(object->getIndexBuffer(), resBuffer.first->second, LRenderer::BufferType::Index);
+				meshBounds[meshId] = object->computeBounds();
+				meshRanges[meshId] = renderer->uploadMesh(object->getVertexBuffer(), object->getIndexBuffer());
 			}
-			renderer->addPrimitive(object);
+			renderer->addPrimitive(object.get());
 		}
 		DEBUG_CODE(
 			bIsConstructing = false;
@@ -525,22 +1072,27 @@ protected:
 	template<typename T>
 	static void destruct(T* object)
 	{
-		auto resCounter = objectsCounter.find(object->getTypeName());
-		auto resBuffer = memoryBuffers.find(object->getTypeName());
-
-		if (int32 counter = --resCounter->second; counter == 0)
+		const uint32 meshId = object->getMeshName().getId();
+		if (meshId >= objectsCounter.size())
 		{
-			if (LRenderer* renderer = LRenderer::get())
-			{
-				// maybe we want to cache it, but not destroy
-				renderer->destroyObjectBuffer(resBuffer->second);
-			}
+			// was never adjusted
+			return;
 		}
+
+		// the mesh stays cached in the geometry arena
+		--objectsCounter[meshId];
+	}
+
+	[[nodiscard]] static const LRenderer::MeshRange& getMeshRange(LName meshName)
+	{
+		assert(meshName.getId() < meshRanges.size());
+		return meshRanges[meshName.getId()];
 	}
 
-	[[nodiscard]] static const LRenderer::VkMemoryBuffer& getMemoryBuffer(const std::string& primitiveName)
+	[[nodiscard]] static const LMeshBounds& getMeshBounds(LName meshName)
 	{
-		return memoryBuffers[primitiveName];
+		assert(meshName.getId() < meshBounds.size());
+		return meshBounds[meshName.getId()];
 	}
 
 	DEBUG_CODE(
@@ -549,8 +1101,10 @@ protected:
 
 protected:
 
-	static std::unordered_map<std::string, int32> objectsCounter;
-	static std::unordered_map<std::string, LRenderer::VkMemoryBuffer> memoryBuffers;
+	// indexed by LName id of the mesh
+	static std::vector<int32> objectsCounter;
+	static std::vector<LRenderer::MeshRange> meshRanges;
+	static std::vector<LMeshBounds> meshBounds;
 
 	DEBUG_CODE(
 		static bool bIsConstructing;
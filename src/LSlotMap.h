@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+
+#include "globals.h"
+
+struct LSlotMapHandle
+{
+    static constexpr uint32 invalidIndex = std::numeric_limits<uint32>::max();
+
+    uint32 index = invalidIndex;
+    uint32 generation = 0;
+
+    bool isValid() const { return index != invalidIndex; }
+    bool operator==(const LSlotMapHandle& other) const = default;
+};
+
+// Generational index slot map. Odd generation means the slot is alive: insert and erase both bump it,
+// so a stale handle never matches again. Erased slots are recycled through an intrusive free list.
+// Lookups are a bounds check and an integer compare, no atomics and no control blocks are touched.
+template<typename T>
+class LSlotMap
+{
+public:
+
+    using Handle = LSlotMapHandle;
+
+    Handle insert(const T& value)
+    {
+        uint32 index;
+        if (freeHead != Handle::invalidIndex)
+        {
+            index = freeHead;
+            freeHead = slots[index].nextFree;
+        }
+        else
+        {
+            index = static_cast<uint32>(slots.size());
+            slots.emplace_back();
+        }
+
+        Slot& slot = slots[index];
+        slot.value = value;
+        ++slot.generation;
+        ++aliveCount;
+
+        return { index, slot.generation };
+    }
+
+    bool erase(Handle handle)
+    {
+        if (!contains(handle))
+        {
+            return false;
+        }
+
+        Slot& slot = slots[handle.index];
+        slot.value = T();
+        ++slot.generation;
+        slot.nextFree = freeHead;
+        freeHead = handle.index;
+        --aliveCount;
+
+        return true;
+    }
+
+    bool contains(Handle handle) const
+    {
+        return handle.index < slots.size() && slots[handle.index].generation == handle.generation && (handle.generation & 1);
+    }
+
+    T* get(Handle handle)
+    {
+        return contains(handle) ? &slots[handle.index].value : nullptr;
+    }
+
+    const T* get(Handle handle) const
+    {
+        return contains(handle) ? &slots[handle.index].value : nullptr;
+    }
+
+    uint32 size() const { return aliveCount; }
+
+    template<typename Func>
+    void forEach(Func&& func)
+    {
+        for (uint32 i = 0; i < slots.size(); ++i)
+        {
+            if (slots[i].generation & 1)
+            {
+                func(Handle{ i, slots[i].generation }, slots[i].value);
+            }
+        }
+    }
+
+protected:
+
+    struct Slot
+    {
+        T value{};
+        uint32 generation = 0;
+        uint32 nextFree = Handle::invalidIndex;
+    };
+
+    std::vector<Slot> slots;
+    uint32 freeHead = Handle::invalidIndex;
+    uint32 aliveCount = 0;
+};
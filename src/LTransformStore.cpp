@@ -0,0 +1,79 @@
+#include "pch.h"
+#include "LTransformStore.h"
+
+uint32 LTransformStore::allocate()
+{
+    if (!freeSlots.empty())
+    {
+        uint32 slot = freeSlots.back();
+        freeSlots.pop_back();
+
+        positions[slot] = glm::vec3(0.0f);
+        rotations[slot] = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        scales[slot] = glm::vec3(1.0f);
+        return slot;
+    }
+
+    positions.emplace_back(0.0f);
+    rotations.emplace_back(1.0f, 0.0f, 0.0f, 0.0f);
+    scales.emplace_back(1.0f);
+    return static_cast<uint32>(positions.size() - 1);
+}
+
+void LTransformStore::free(uint32 slot)
+{
+    assert(slot < getSize());
+    scales[slot] = glm::vec3(0.0f);
+    freeSlots.push_back(slot);
+}
+
+glm::mat4 LTransformStore::getModelMatrix(uint32 slot) const
+{
+    glm::mat4 model;
+    composeModelMatrices(slot, 1, &model, sizeof(glm::mat4));
+    return model;
+}
+
+void LTransformStore::composeModelMatrices(uint32 first, uint32 count, void* out, uint64 stride) const
+{
+    assert(first + count <= getSize());
+
+    const glm::vec3* position = positions.data() + first;
+    const glm::quat* rotation = rotations.data() + first;
+    const glm::vec3* scale = scales.data() + first;
+    uint8* dst = static_cast<uint8*>(out);
+
+    // same as glm::translate * glm::mat4_cast * glm::scale, but without the 4x4 products and branches
+    for (uint32 i = 0; i < count; ++i, dst += stride)
+    {
+        const glm::quat& q = rotation[i];
+        const glm::vec3& s = scale[i];
+        const glm::vec3& p = position[i];
+
+        const float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+        const float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+        const float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+        float* m = reinterpret_cast<float*>(dst);
+
+        m[0] = (1.0f - 2.0f * (yy + zz)) * s.x;
+        m[1] = 2.0f * (xy + wz) * s.x;
+        m[2] = 2.0f * (xz - wy) * s.x;
+        m[3] = 0.0f;
+
+        m[4] = 2.0f * (xy - wz) * s.y;
+        m[5] = (1.0f - 2.0f * (xx + zz)) * s.y;
+        m[6] = 2.0f * (yz + wx) * s.y;
+        m[7] = 0.0f;
+
+        m[8] = 2.0f * (xz + wy) * s.z;
+        m[9] = 2.0f * (yz - wx) * s.z;
+        m[10] = (1.0f - 2.0f * (xx + yy)) * s.z;
+        m[11] = 0.0f;
+
+        m[12] = p.x;
+        m[13] = p.y;
+        m[14] = p.z;
+        m[15] = 1.0f;
+    }
+}
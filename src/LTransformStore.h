@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+
+#include "globals.h"
+
+#include <glm/vec3.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/mat4x4.hpp>
+
+// Structure of arrays storage of object transforms, owned by the renderer.
+// Every instanced array has its own store, so a transform slot is the instance slot inside the SSBO.
+class LTransformStore
+{
+public:
+
+    static constexpr uint32 invalidSlot = std::numeric_limits<uint32>::max();
+
+    uint32 allocate();
+
+    // freed slot gets zero scale, so stale GPU copies of it produce degenerate triangles only
+    void free(uint32 slot);
+
+    void setPosition(uint32 slot, const glm::vec3& position) { positions[slot] = position; }
+    void setRotation(uint32 slot, const glm::quat& rotation) { rotations[slot] = rotation; }
+    void setScale(uint32 slot, const glm::vec3& scale) { scales[slot] = scale; }
+
+    const glm::vec3& getPosition(uint32 slot) const { return positions[slot]; }
+    const glm::quat& getRotation(uint32 slot) const { return rotations[slot]; }
+    const glm::vec3& getScale(uint32 slot) const { return scales[slot]; }
+
+    glm::mat4 getModelMatrix(uint32 slot) const;
+
+    // batch kernel: writes translate * rotate * scale of [first, first + count) to out, advancing by stride bytes
+    void composeModelMatrices(uint32 first, uint32 count, void* out, uint64 stride) const;
+
+    // number of slots ever allocated, including freed ones
+    uint32 getSize() const { return static_cast<uint32>(positions.size()); }
+    uint32 getAliveCount() const { return getSize() - static_cast<uint32>(freeSlots.size()); }
+
+protected:
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::quat> rotations;
+    std::vector<glm::vec3> scales;
+
+    std::vector<uint32> freeSlots;
+};
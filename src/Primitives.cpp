@@ -1,8 +1,11 @@
 ﻿#include "Primitives.h"
 #include "pch.h"
 #include "LRenderer.h"
+#include "LTransformStore.h"
 
 std::set<std::string> LG::LGraphicsComponent::textures;
+std::array<LG::LPrimitiveType, LG::LPrimitiveTypeRegistry::maxTypesNum> LG::LPrimitiveTypeRegistry::types;
+std::atomic<uint32> LG::LPrimitiveTypeRegistry::typesNum = 1;
 uint32 LG::LPortal::portalCounter = 0;
 
 const std::vector<LG::LGraphicsComponent::Vertex> LG::verticesPlane =
@@ -57,10 +60,64 @@ const std::vector<uint16_t> LG::indicesCube =
     12, 13, 1, 1, 0, 12
 };
 
+uint8 LG::LPrimitiveTypeRegistry::registerType(const LPrimitiveTraits& traits)
+{
+    uint32 tag = typesNum++;
+    assert(tag < maxTypesNum && "Too many primitive types");
+
+    types[tag] = { traits, LName(traits.typeName), LName(traits.meshName) };
+    return static_cast<uint8>(tag);
+}
+
 void LG::LGraphicsComponent::setColorTexture(std::string&& path)
 {
-    textures.insert(path);
-    texturePath = path;
+    texturePath = LName(path);
+    textures.insert(std::move(path));
+
+    // textures are collected before the renderer exists, then the id is resolved on registration
+    if (LRenderer* renderer = LRenderer::get())
+    {
+        textureId = renderer->getTextureId(texturePath);
+    }
+    markDirty();
+}
+
+LMeshBounds LG::LGraphicsComponent::computeBounds() const
+{
+    assert(vertices && !vertices->empty());
+
+    glm::vec3 minPos = (*vertices)[0].pos;
+    glm::vec3 maxPos = minPos;
+    for (const Vertex& vertex : *vertices)
+    {
+        minPos = glm::min(minPos, vertex.pos);
+        maxPos = glm::max(maxPos, vertex.pos);
+    }
+
+    const glm::vec3 center = (minPos + maxPos) * 0.5f;
+    float radius = 0.0f;
+    for (const Vertex& vertex : *vertices)
+    {
+        radius = std::max(radius, glm::length(vertex.pos - center));
+    }
+
+    LMeshBounds bounds;
+    bounds.aabbMin = minPos;
+    bounds.aabbMax = maxPos;
+    bounds.sphere = glm::vec4(center, radius);
+    return bounds;
+}
+
+void LG::LGraphicsComponent::markDirty()
+{
+    if (!bDirty && instanceIndex != invalidInstanceIndex)
+    {
+        if (LRenderer* renderer = LRenderer::get())
+        {
+            renderer->markInstanceDirty(getTypeName(), instanceIndex);
+        }
+    }
+    bDirty = true;
 }
 
 LG::LGraphicsComponent::LGraphicsComponent()
@@ -76,6 +133,52 @@ LG::LGraphicsComponent::LGraphicsComponent()
 LG::LGraphicsComponent::~LGraphicsComponent()
 {
     ::RenderComponentBuilder::destruct(this);
+
+    if (LRenderer* renderer = LRenderer::get())
+    {
+        renderer->removePrimitive(this);
+    }
+}
+
+void LG::LGraphicsComponent::setPosition(const glm::vec3& position)
+{
+    assert(transformStore && "Component is not registered in the renderer");
+    transformStore->setPosition(transformSlot, position);
+    markDirty();
+}
+
+void LG::LGraphicsComponent::setRotation(const glm::quat& rotation)
+{
+    assert(transformStore && "Component is not registered in the renderer");
+    transformStore->setRotation(transformSlot, rotation);
+    markDirty();
+}
+
+void LG::LGraphicsComponent::setScale(const glm::vec3& scale)
+{
+    assert(transformStore && "Component is not registered in the renderer");
+    transformStore->setScale(transformSlot, scale);
+    markDirty();
+}
+
+glm::vec3 LG::LGraphicsComponent::getPosition() const
+{
+    return transformStore ? transformStore->getPosition(transformSlot) : glm::vec3(0.0f);
+}
+
+glm::quat LG::LGraphicsComponent::getRotation() const
+{
+    return transformStore ? transformStore->getRotation(transformSlot) : glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+}
+
+glm::vec3 LG::LGraphicsComponent::getScale() const
+{
+    return transformStore ? transformStore->getScale(transformSlot) : glm::vec3(1.0f);
+}
+
+glm::mat4x4 LG::LGraphicsComponent::getModelMatrix() const
+{
+    return transformStore ? transformStore->getModelMatrix(transformSlot) : glm::mat4x4(1.0f);
 }
 
 void LG::LPortal::setPortalView(const glm::mat4& view)
@@ -3,18 +3,87 @@
 #include <vector>
 #include <array>
 #include <functional>
+#include <limits>
+#include <atomic>
+#include <type_traits>
 
 #include "globals.h"
+#include "LSlotMap.h"
+#include "LName.h"
 #include "vulkan/vulkan.h"
 
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/quaternion.hpp"
 #include "glm/glm.hpp"
 
+class LRenderer;
+class LTransformStore;
+struct LMeshBounds;
+
 namespace LG
 {
+    enum class PipelineType : uint8
+    {
+        Instanced,
+        Regular
+    };
+
+    // compile time description of a primitive class, every class declares its own `static constexpr LPrimitiveTraits traits`
+    struct LPrimitiveTraits
+    {
+        const char* typeName = "";
+
+        // geometry buffers are shared between the types with the same mesh
+        const char* meshName = "";
+
+        bool bPortal = false;
+        PipelineType pipeline = PipelineType::Regular;
+
+        // regular meshes of the same mesh are drawn with one instanced call, types that need their own draw opt out
+        bool bBatched = true;
+
+        constexpr bool isInstanceable() const { return pipeline == PipelineType::Instanced; }
+    };
+
+    // traits with interned names
+    struct LPrimitiveType
+    {
+        LPrimitiveTraits traits;
+        LName typeName;
+        LName meshName;
+    };
+
+    // Registered primitive classes, components keep a small tag into it, so classification needs no RTTI.
+    // Tag 0 is the plain LGraphicsComponent
+    class LPrimitiveTypeRegistry
+    {
+    public:
+
+        static constexpr uint32 maxTypesNum = std::numeric_limits<uint8>::max() + 1;
+
+        // the class is registered on the first call
+        template<typename T>
+        static uint8 getTag()
+        {
+            static const uint8 tag = registerType(T::traits);
+            return tag;
+        }
+
+        static const LPrimitiveType& get(uint8 tag) { return types[tag]; }
+
+    protected:
+
+        static uint8 registerType(const LPrimitiveTraits& traits);
+
+        static std::array<LPrimitiveType, maxTypesNum> types;
+        static std::atomic<uint32> typesNum;
+    };
+
     class LGraphicsComponent
     {
+        friend class ::LRenderer;
+
         LGraphicsComponent(const LGraphicsComponent&) = delete;
         LGraphicsComponent& operator=(const LGraphicsComponent&) = delete;
 
@@ -65,6 +134,9 @@ namespace LG
             return static_cast<uint32>(indices->size());
         }
 
+        // local space AABB and sphere, computed once per mesh on registration
+        LMeshBounds computeBounds() const;
+
         uint32 getVerticesCount() const
         {
             assert(vertices);
@@ -83,29 +155,68 @@ namespace LG
             return *indices;
         };
 
-        const std::string& getTypeName()
-        {
-            return typeName;
-        }
+        uint8 getTypeTag() const { return typeTag; }
+        const LPrimitiveType& getPrimitiveType() const { return LPrimitiveTypeRegistry::get(typeTag); }
+        LName getTypeName() const { return getPrimitiveType().typeName; }
+        LName getMeshName() const { return getPrimitiveType().meshName; }
 
         static const std::set<std::string>& getInitTexturesData() { return textures; }
 
-        virtual std::string getColorTexturePath() const { return texturePath;}
+        LName getColorTexturePath() const { return texturePath; }
         void setColorTexture(std::string&& path);
+
+        // index of the color texture inside the renderer texture array
+        uint32 getColorTextureId() const { return textureId; }
+
+        // must be called after every transform change, only dirty instances are re-uploaded to the GPU
+        void markDirty();
+        bool isDirty() const { return bDirty; }
         
         LGraphicsComponent();
         virtual ~LGraphicsComponent();
 
-        const std::function<glm::mat4x4()> getModelMatrix = [](){ return glm::mat4x4(1); };
+        // transform lives in the renderer transform store, the setters mark the instance dirty
+        void setPosition(const glm::vec3& position);
+        void setRotation(const glm::quat& rotation);
+        void setScale(const glm::vec3& scale);
+
+        glm::vec3 getPosition() const;
+        glm::quat getRotation() const;
+        glm::vec3 getScale() const;
+
+        glm::mat4x4 getModelMatrix() const;
         
     protected:
 
+        // called by every primitive class constructor
+        template<typename T>
+        void setPrimitiveType()
+        {
+            static_assert(std::is_base_of_v<LGraphicsComponent, T>);
+            typeTag = LPrimitiveTypeRegistry::getTag<T>();
+        }
+
         const std::vector<LG::LGraphicsComponent::Vertex>* vertices = nullptr;
         const std::vector<uint16>* indices = nullptr;
 
-        // TODO: should be changed to hash/index storage to reduce memory usage
-        std::string typeName;
-        std::string texturePath;
+        uint8 typeTag = 0;
+        LName texturePath;
+
+        static constexpr uint32 invalidTextureId = std::numeric_limits<uint32>::max();
+
+        // resolved from texturePath once, so the per-instance upload doesn't touch strings
+        uint32 textureId = invalidTextureId;
+
+        static constexpr uint32 invalidInstanceIndex = std::numeric_limits<uint32>::max();
+
+        // slot inside the renderer instanced array, invalidInstanceIndex for non-instanced meshes
+        uint32 instanceIndex = invalidInstanceIndex;
+        bool bDirty = false;
+
+        // assigned by the renderer on registration
+        LSlotMapHandle registryHandle;
+        LTransformStore* transformStore = nullptr;
+        uint32 transformSlot = invalidInstanceIndex;
 
         // TODO: temporal desicion
         static std::set<std::string> textures;
@@ -119,9 +230,16 @@ namespace LG
 
     public:
 
+        static constexpr LPrimitiveTraits traits =
+        {
+            .typeName = "LCube",
+            .meshName = "LCube",
+            .pipeline = PipelineType::Instanced
+        };
+
         LCube()
         {
-            typeName = std::string("LCube");
+            setPrimitiveType<LCube>();
             vertices = &verticesCube;
             indices = &indicesCube;
         }
@@ -135,9 +253,16 @@ namespace LG
 
     public:
 
+        static constexpr LPrimitiveTraits traits =
+        {
+            .typeName = "LPlane",
+            .meshName = "LPlane",
+            .pipeline = PipelineType::Instanced
+        };
+
         LPlane()
         {
-            typeName = std::string("LPlane");
+            setPrimitiveType<LPlane>();
             vertices = &verticesPlane;
             indices = &indicesPlane;
         }
@@ -149,21 +274,25 @@ namespace LG
 
     public:
 
+        static constexpr LPrimitiveTraits traits =
+        {
+            .typeName = "LPortal",
+            .meshName = "LPlane",
+            .bPortal = true,
+            .pipeline = PipelineType::Instanced
+        };
+
         LPortal()
         {
+            setPrimitiveType<LPortal>();
             portalIndex = ++portalCounter;
             std::string textureName = std::format("portal{}", portalIndex);
             setColorTexture(std::move(textureName));
-            typeName = std::string("LPortal");
         }
 
         const glm::mat4& getPortalView() const { return view; }
         void setPortalView(const glm::mat4& view);
         bool needsRecalculation() const { return bNeedRecalculation; }
-        virtual std::string getColorTexturePath() const override
-        {
-            return std::format("portal{}", portalIndex);
-        }
 
     protected:
 
@@ -174,16 +303,4 @@ namespace LG
         static uint32 portalCounter;
     };
 
-    template<typename Component>
-    bool isInstancePrimitive(Component* ptr)
-    {
-        return dynamic_cast<LG::LCube*>(ptr) || dynamic_cast<LG::LPlane*>(ptr);
-    }
-
-    template<typename Component>
-    bool isPortal(Component* ptr)
-    {
-        return dynamic_cast<LG::LPortal*>(ptr);
-    }
-
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <exception>
+#include <cstdint>
 
 #if defined(_MSC_VER)
     #define DEBUG_BREAK __debugbreak();
@@ -34,7 +35,7 @@ throw std::runtime_error("");\
     } \
 
 #ifndef int64
-#ifdef __APPLE__
+#ifndef _MSC_VER
 typedef char __int8;
 typedef short __int16;
 typedef int __int32;
@@ -12,6 +12,7 @@
 #include <execution>
 #include <numeric>
 #include <ranges>
+#include <bit>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
@@ -0,0 +1,63 @@
+#version 450
+
+struct SSBOEntry 
+{
+    mat4 model;
+    uint textureId;
+    uint isPortal;
+    uint reserved2;
+    uint reserved3;
+};
+
+layout(push_constant) uniform UniformBufferObject 
+{
+    mat4 genericMatrix;
+    uint viewIndex;
+    uint reserved0;
+    uint reserved1;
+    uint reserved2;
+} constants;
+
+// must match LRenderer::ViewData
+struct ViewData
+{
+    mat4 view;
+    mat4 projection;
+    mat4 projView;
+    vec4 frustumPlanes[6];
+    vec2 extent;
+    vec2 reserved;
+};
+
+layout (binding = 6) readonly buffer Views
+{
+    ViewData data[];
+} views;
+
+// visible regular meshes grouped by mesh on the CPU, firstInstance of a draw points at the range of its batch
+layout (binding = 5) readonly buffer BatchedInstances
+{
+    SSBOEntry entries[];
+} batched;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in vec2 inTexCoord;
+
+layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragTexCoord;
+layout(location = 2) flat out uint textureId;
+layout(location = 3) flat out uint isPortal;
+layout(location = 4) flat out vec2 extent;
+
+void main() 
+{
+    SSBOEntry entry = batched.entries[gl_InstanceIndex];
+
+    gl_Position = views.data[constants.viewIndex].projView * entry.model * vec4(inPosition, 1.0);
+    fragColor = inColor;
+    fragTexCoord = inTexCoord;
+    textureId = entry.textureId;
+    isPortal = entry.isPortal;
+    extent = views.data[constants.viewIndex].extent;
+}
\ No newline at end of file
@@ -16,6 +16,7 @@ void main()
 {
     vec2 newCoords = fragTexCoord;
 
+    // portal targets may be smaller than the screen, their views fill them, so normalized coordinates fit any resolution
     if (isPortal == 1)
     {
         newCoords.x = gl_FragCoord.x / extent.x;
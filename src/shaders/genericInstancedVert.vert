@@ -11,17 +11,35 @@ struct SSBOEntry
 
 layout(push_constant) uniform UniformBufferObject 
 {
-    mat4 projView;
-    float width;
-    float height;
-    float reserved1;
-    float reserved2;
+    mat4 genericMatrix;
+    uint viewIndex;
+    uint reserved0;
+    uint reserved1;
+    uint reserved2;
 } constants;
 
-layout (binding = 0) buffer SSBO
+// must match LRenderer::ViewData
+struct ViewData
+{
+    mat4 view;
+    mat4 projection;
+    mat4 projView;
+    vec4 frustumPlanes[6];
+    vec2 extent;
+    vec2 reserved;
+};
+
+layout (binding = 6) readonly buffer Views
+{
+    ViewData data[];
+} views;
+
+// compacted by the culling pass, gl_InstanceIndex goes over the visible instances only.
+// firstInstance of a command points at the range of its bucket in the visible list of the view
+layout (binding = 0) readonly buffer VisibleInstances
 {
     SSBOEntry entries[];
-} ssbo;
+} visible;
 
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
@@ -35,11 +53,12 @@ layout(location = 4) flat out vec2 extent;
 
 void main() 
 {
-    gl_Position = constants.projView * ssbo.entries[gl_InstanceIndex].model * vec4(inPosition, 1.0);
+    SSBOEntry entry = visible.entries[gl_InstanceIndex];
+
+    gl_Position = views.data[constants.viewIndex].projView * entry.model * vec4(inPosition, 1.0);
     fragColor = inColor;
     fragTexCoord = inTexCoord;
-    textureId = ssbo.entries[gl_InstanceIndex].textureId;
-    isPortal = ssbo.entries[gl_InstanceIndex].isPortal;
-    extent.x = constants.width;
-    extent.y = constants.height;
+    textureId = entry.textureId;
+    isPortal = entry.isPortal;
+    extent = views.data[constants.viewIndex].extent;
 }
\ No newline at end of file
@@ -2,11 +2,12 @@
 
 layout(push_constant) uniform UniformBufferObject 
 {
-    mat4 mvp;
-    float width;
-    float height;
-    float reserved1;
-    float reserved2;
+    // model matrix of the mesh
+    mat4 genericMatrix;
+    uint viewIndex;
+    uint reserved0;
+    uint reserved1;
+    uint reserved2;
 
     //ivec4 textureId_R_R_R;
     //ivec4 R_R_R_R1;
@@ -14,6 +15,22 @@ layout(push_constant) uniform UniformBufferObject
     //ivec4 R_R_R_R3;
 } constants;
 
+// must match LRenderer::ViewData
+struct ViewData
+{
+    mat4 view;
+    mat4 projection;
+    mat4 projView;
+    vec4 frustumPlanes[6];
+    vec2 extent;
+    vec2 reserved;
+};
+
+layout (binding = 6) readonly buffer Views
+{
+    ViewData data[];
+} views;
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
 layout(location = 2) in vec2 inTexCoord;
@@ -26,10 +43,10 @@ layout(location = 4) flat out vec2 extent;
 
 void main() 
 {
-    gl_Position = constants.mvp * vec4(inPosition, 1.0);
+    gl_Position = views.data[constants.viewIndex].projView * constants.genericMatrix * vec4(inPosition, 1.0);
     fragColor = inColor;
     fragTexCoord = inTexCoord;
     textureId = 0; //constants.textureId_R_R_R.x;
     isPortal = 0;
-    extent = vec2(constants.width, constants.height);
+    extent = views.data[constants.viewIndex].extent;
 }
\ No newline at end of file
@@ -0,0 +1,7 @@
+#version 450
+
+// covers the portal of a view with the far plane, so the view behind it isn't hidden by the parent view depth
+void main() 
+{
+    gl_FragDepth = 1.0;
+}
@@ -0,0 +1,9 @@
+#version 450
+
+layout(location = 0) out vec4 outColor;
+
+// the color of the cleared portal targets, covers a portal which has no view of its own
+void main() 
+{
+    outColor = vec4(0.0, 0.0, 0.0, 1.0);
+}